@@ -0,0 +1,347 @@
+/*
+
+  devia benchmark
+
+  Measure the probe and action paths, without hardware. A synthetic sysfs
+  tree is built for 10, 100 and 1000 devices, and the HID USB devices are
+  simulated Nuvoton relay controllers.
+
+  For each benchmark, the number of operations per second and the average
+  latency of an operation is printed.
+
+  Usage: devia-bench [<root directory of the synthetic tree>]
+  The root can also be given with BENCH_ROOT. Default /tmp/devia-bench
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Linux */
+#include <glib.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+#include "hidusb.h"
+#include "relay_nuvoton.h"
+#include "sysfs.h"
+#include "sysfs_index.h"
+#include "w1.h"
+#include "stats.h"
+
+#include "fixture.h"
+#include "sim_nuvoton.h"
+
+#define DEFAULT_ROOT "/tmp/devia-bench"
+#define MIN_BENCH_US 200000     // Repeat each benchmark for at least this long
+#define DEEP_TREE_DEPTH 7
+#define DEEP_TREE_FANOUT 4
+
+int info = false;
+
+static const int scale[] = { 10, 100, 1000, 0 };
+
+struct bench {
+  const char *name;
+  int devices;
+  int si_index;
+  sds root;
+};
+
+static int interface_index(const char *name){
+  for (int i = 0; supported_interface[i].name; i++)
+    if ( !strcmp(supported_interface[i].name, name) )
+      return i;
+  return FAILURE;
+}
+
+static void free_list(GList *device_list){
+  g_list_free_full(device_list, (GDestroyNotify)free_device_entry);
+}
+
+// Run op(bench, n) repeatedly, for at least MIN_BENCH_US, and print the rate
+static void run(struct bench *bench, const char *name, int si_index, int (*op)(struct bench *, int)){
+  uint64_t start, elapsed;
+  int ops = 0, failed = 0;
+
+  bench->name = name;
+  bench->si_index = si_index;
+
+  start = stats_time_us();
+  do {
+    if ( op(bench, ops++) )
+      failed++;
+    elapsed = stats_time_us() - start;
+  } while ( elapsed < MIN_BENCH_US );
+
+  printf("%-26s %7d %9d %14.2f %12.1f%s\n",
+    name,
+    bench->devices,
+    ops,
+    ops * 1000000.0 / elapsed,
+    (double)elapsed / ops,
+    failed ? "  FAILED" : ""
+  );
+  fflush(stdout);
+}
+
+static int op_probe_w1(struct bench *bench, int n){
+  struct _device_identifier id;
+  GList *device_list = NULL;
+  int result;
+
+  memset(&id, 0, sizeof(id));
+  result = probe_w1(bench->si_index, id, &device_list);
+  if ( (int)g_list_length(device_list) != bench->devices )
+    result = FAILURE;
+  free_list(device_list);
+  return result;
+}
+
+// Search the hierarchy for a device, by name
+static int op_probe_sysfs(struct bench *bench, int n){
+  struct _device_identifier id;
+  GList *device_list = NULL;
+  int result;
+
+  memset(&id, 0, sizeof(id));
+  id.device_id = fixture_device_name(n % bench->devices);
+  result = probe_sysfs(bench->si_index, id, &device_list);
+  if ( !device_list )
+    result = FAILURE;
+  free_list(device_list);
+  sdsfree(id.device_id);
+  return result;
+}
+
+static int op_finddir(struct bench *bench, int n){
+  sds devices = sdscatprintf(sdsempty(), "%s/sys/devices", bench->root);
+  sds name = fixture_device_name(n % bench->devices);
+  GList *list = finddir(devices, name);
+  int result = g_list_length(list) == 1 ? SUCCESS : FAILURE;
+
+  finddir_free(list);
+  g_list_free(list);
+  sdsfree(name);
+  sdsfree(devices);
+  return result;
+}
+
+static int op_sysfs_index(struct bench *bench, int n){
+  sds devices = sdscatprintf(sdsempty(), "%s/sys/devices", bench->root);
+  sds name = fixture_device_name(n % bench->devices);
+  GList *list = sysfs_index_find(devices, name);
+  int result = g_list_length(list) == 1 ? SUCCESS : FAILURE;
+
+  finddir_free(list);
+  g_list_free(list);
+  sdsfree(name);
+  sdsfree(devices);
+  return result;
+}
+
+// Search the whole deep tree, for a leaf
+static int op_finddir_deep(struct bench *bench, int n){
+  sds deep = sdscatprintf(sdsempty(), "%s/deep", bench->root);
+  sds name = fixture_leaf_name(n * 7919 % bench->devices);
+  GList *list = finddir(deep, name);
+  int result = g_list_length(list) == 1 ? SUCCESS : FAILURE;
+
+  finddir_free(list);
+  g_list_free(list);
+  sdsfree(name);
+  sdsfree(deep);
+  return result;
+}
+
+// Search the deep tree, until the leaf is found
+static int op_finddir_deep_first(struct bench *bench, int n){
+  sds deep = sdscatprintf(sdsempty(), "%s/deep", bench->root);
+  sds name = fixture_leaf_name(n * 7919 % bench->devices);
+  GList *list = finddir_limit(deep, name, 1);
+  int result = g_list_length(list) == 1 ? SUCCESS : FAILURE;
+
+  finddir_free(list);
+  g_list_free(list);
+  sdsfree(name);
+  sdsfree(deep);
+  return result;
+}
+
+static int op_probe_hidusb(struct bench *bench, int n){
+  struct _device_identifier id;
+  GList *device_list = NULL;
+  int result;
+
+  memset(&id, 0, sizeof(id));
+  result = probe_hidusb(bench->si_index, id, &device_list);
+  if ( (int)g_list_length(device_list) != bench->devices )
+    result = FAILURE;
+  free_list(device_list);
+  return result;
+}
+
+// Probe as before udev, by opening each device with libusb
+static int op_probe_hidusb_libusb(struct bench *bench, int n){
+  int result;
+
+  hidusb_select_enumerator("libusb");
+  result = op_probe_hidusb(bench, n);
+  hidusb_select_enumerator("udev");
+  return result;
+}
+
+// Probe for the board at one port, with a fully specified device id
+static int op_probe_hidusb_port(struct bench *bench, int n){
+  struct _device_identifier id;
+  GList *device_list = NULL;
+  int result;
+
+  memset(&id, 0, sizeof(id));
+  id.device_id = sdscatprintf(sdsempty(), "%04x:%04x::Nuvoton", SIM_NUVOTON_VENDOR, SIM_NUVOTON_PRODUCT);
+  id.port = sim_nuvoton_port(n % bench->devices);
+  result = probe_hidusb(bench->si_index, id, &device_list);
+  if ( g_list_length(device_list) != 1 )
+    result = FAILURE;
+  free_list(device_list);
+  sdsfree(id.device_id);
+  sdsfree(id.port);
+  return result;
+}
+
+static int op_probe_hidusb_port_libusb(struct bench *bench, int n){
+  int result;
+
+  hidusb_select_enumerator("libusb");
+  result = op_probe_hidusb_port(bench, n);
+  hidusb_select_enumerator("udev");
+  return result;
+}
+
+static int op_find_hidraw_path(struct bench *bench, int n){
+  sds port = sim_nuvoton_port(n % bench->devices);
+  sds path = find_hidraw_path(port);
+  sds expected = sdscatprintf(sdsempty(), "/dev/hidraw%d", n % bench->devices);
+  int result = strcmp(path, expected) ? FAILURE : SUCCESS;
+
+  sdsfree(expected);
+  sdsfree(path);
+  sdsfree(port);
+  return result;
+}
+
+static int run_action(struct bench *bench, struct _device_list *device, const char *attribute, const char *action){
+  sds attr = attribute ? sdsnew(attribute) : NULL;
+  sds act = action ? sdsnew(action) : NULL;
+  sds reply = sdsempty();
+  int result;
+
+  result = device->action(device, attr, act, &reply);
+  if ( !sdslen(reply) )
+    result = FAILURE;
+  sdsfree(reply);
+  sdsfree(attr);
+  sdsfree(act);
+  return result;
+}
+
+static int op_action_w1(struct bench *bench, int n){
+  static GList *device_list = NULL;
+  static int devices = 0;
+  struct _device_identifier id;
+
+  // Probe once per scale
+  if ( devices != bench->devices ) {
+    free_list(device_list);
+    device_list = NULL;
+    memset(&id, 0, sizeof(id));
+    probe_w1(bench->si_index, id, &device_list);
+    devices = bench->devices;
+  }
+  if ( !device_list )
+    return FAILURE;
+  return run_action(bench, (struct _device_list *)g_list_nth_data(device_list, n % g_list_length(device_list)), "w1_slave", NULL);
+}
+
+static int op_action_sysfs(struct bench *bench, int n){
+  struct _device_list device;
+  int result;
+
+  memset(&device, 0, sizeof(device));
+  device.path = fixture_device_path(bench->root, n % bench->devices);
+  device.id = sdscatprintf(sdsempty(), "sysfs#%s", device.path);
+  device.action = action_sysfs;
+  result = run_action(bench, &device, "value", NULL);
+  sdsfree(device.id);
+  sdsfree(device.path);
+  return result;
+}
+
+static int op_action_nuvoton(struct bench *bench, int n){
+  struct _device_list device;
+  char relay[8];
+  int result;
+
+  memset(&device, 0, sizeof(device));
+  device.port = sim_nuvoton_port(n % bench->devices);
+  device.si_index = bench->si_index;
+  device.action = action_nuvoton;
+  snprintf(relay, sizeof(relay), "%d", n % 16 + 1);
+  result = run_action(bench, &device, relay, "toggle");
+  sdsfree(device.port);
+  return result;
+}
+
+int main(int argc, char **argv){
+  struct bench bench;
+  const char *root = argc > 1 ? argv[1] : getenv("BENCH_ROOT") ? : DEFAULT_ROOT;
+  int w1 = interface_index("w1"), sysfs = interface_index("sysfs"), hidusb = interface_index("hidusb");
+
+  // devia must look for devices in the synthetic tree
+  sysfs_set_root(root);
+
+  memset(&bench, 0, sizeof(bench));
+  bench.root = sdsnew(root);
+
+  printf("Synthetic sysfs tree in %s\n\n", root);
+  printf("%-26s %7s %9s %14s %12s\n", "Benchmark", "Devices", "Ops", "Ops/sec", "Latency us");
+
+  for (int s = 0; scale[s]; s++) {
+    bench.devices = scale[s];
+    if ( fixture_build(root, bench.devices) ) {
+      fprintf(stderr, "Unable to build synthetic sysfs tree in %s\n", root);
+      return 1;
+    }
+    sim_nuvoton_setup(bench.devices);
+
+    run(&bench, "probe_w1", w1, op_probe_w1);
+    run(&bench, "probe_sysfs", sysfs, op_probe_sysfs);
+    run(&bench, "finddir", sysfs, op_finddir);
+    run(&bench, "sysfs_index", sysfs, op_sysfs_index);
+    run(&bench, "probe_hidusb", hidusb, op_probe_hidusb);
+    run(&bench, "probe_hidusb_libusb", hidusb, op_probe_hidusb_libusb);
+    run(&bench, "probe_hidusb_port", hidusb, op_probe_hidusb_port);
+    run(&bench, "probe_hidusb_port_libusb", hidusb, op_probe_hidusb_port_libusb);
+    run(&bench, "find_hidraw_path", hidusb, op_find_hidraw_path);
+    run(&bench, "action_w1", w1, op_action_w1);
+    run(&bench, "action_sysfs", sysfs, op_action_sysfs);
+    run(&bench, "action_nuvoton", hidusb, op_action_nuvoton);
+    puts("");
+  }
+
+  // Traversal of a deep tree. Devices is the number of leaves
+  if ( (bench.devices = fixture_build_tree(root, DEEP_TREE_DEPTH, DEEP_TREE_FANOUT)) <= 0 ) {
+    fprintf(stderr, "Unable to build deep tree in %s\n", root);
+    return 1;
+  }
+  run(&bench, "finddir_deep", sysfs, op_finddir_deep);
+  run(&bench, "finddir_deep_first", sysfs, op_finddir_deep_first);
+  puts("");
+
+  fixture_remove(root);
+  sdsfree(bench.root);
+  return 0;
+}
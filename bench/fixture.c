@@ -0,0 +1,270 @@
+/*
+
+  Synthetic sysfs tree
+
+  Build a sysfs like tree under a root directory, for benchmarking without
+  hardware. The tree has:
+    - One-wire slaves, with a w1_slave file, as DS18B20 temperature sensors
+    - Devices with attributes, deep in a /sys/devices hierarchy
+    - A hidraw node for each simulated Nuvoton board, below its USB interface,
+      linked from the hidraw class. The USB device and interface have the
+      attributes and subsystem links, that udev reads
+
+  A separate deep and wide tree, with a single file in each directory, is
+  built for directory traversal.
+
+  The benchmark points devia to the tree with sysfs_set_root(<root>)
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+/* Unix */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#include "fixture.h"
+#include "sim_nuvoton.h"
+
+// Create a directory and all its parents
+static int make_path(sds path){
+  for (char *p = path + 1; *p; p++) {
+    if ( *p != '/' )
+      continue;
+    *p = '\0';
+    mkdir(path, 0755);
+    *p = '/';
+  }
+  if ( mkdir(path, 0755) && errno != EEXIST ) {
+    perror(path);
+    return FAILURE;
+  }
+  return SUCCESS;
+}
+
+static int write_attribute(const char *directory, const char *name, const char *content){
+  sds path = sdscatprintf(sdsempty(), "%s/%s", directory, name);
+  int fd, result = FAILURE;
+
+  if ( (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0 ) {
+    if ( write(fd, content, strlen(content)) == (ssize_t)strlen(content) )
+      result = SUCCESS;
+    close(fd);
+  }
+  if ( result )
+    perror(path);
+  sdsfree(path);
+  return result;
+}
+
+/*
+  Create a class entry at <link>, two levels below /sys, that links to the
+  device at <device>. <device> is the path below /sys, ex. /devices/...
+*/
+static int make_link(const char *device, sds link){
+  sds directory = sdsnew(link), target = sdscatprintf(sdsempty(), "../..%s", device);
+  int result = SUCCESS;
+
+  *strrchr(directory, '/') = '\0';
+  sdsupdatelen(directory);
+  if ( make_path(directory) || symlink(target, link) ) {
+    perror(link);
+    result = FAILURE;
+  }
+  sdsfree(directory);
+  sdsfree(target);
+  return result;
+}
+
+// Link the subsystem of a device, ex. bus/usb. A bus lists its devices too
+static int make_subsystem(const char *root, const char *device, const char *subsystem){
+  sds directory = sdscatprintf(sdsempty(), "%s/sys/%s", root, subsystem);
+  sds link = sdscatprintf(sdsempty(), "%s/subsystem", device);
+  sds devices = sdscatprintf(sdsempty(), "%s/devices", directory);
+  sds entry = sdscatprintf(sdsempty(), "%s/%s", devices, strrchr(device, '/') + 1);
+  int result = SUCCESS;
+
+  if ( make_path(directory) || symlink(directory, link) ) {
+    perror(link);
+    result = FAILURE;
+  } else if ( !strncmp(subsystem, "bus/", 4) && ( make_path(devices) || symlink(device, entry) ) ) {
+    perror(entry);
+    result = FAILURE;
+  }
+  sdsfree(directory);
+  sdsfree(link);
+  sdsfree(devices);
+  sdsfree(entry);
+  return result;
+}
+
+/*
+  The USB device, USB interface, HID device and hidraw node of a simulated
+  Nuvoton board, with the attributes udev reads, and the entry in the hidraw
+  class.
+*/
+static int make_board(const char *root, int board){
+  sds port = sim_nuvoton_port(board);
+  sds usb_device = sdscatprintf(sdsempty(), "%s/sys/devices/pci0000:00/0000:00:14.0/usb1/1-1/1-1.%d", root, board + 1);
+  sds usb_interface = sdscatprintf(sdsempty(), "%s/%s", usb_device, port);
+  sds hid = sdscatprintf(sdsempty(), "%s/0003:%04X:%04X.%04X", usb_interface, SIM_NUVOTON_VENDOR, SIM_NUVOTON_PRODUCT, board + 1);
+  sds hidraw = sdscatprintf(sdsempty(), "%s/hidraw/hidraw%d", hid, board);
+  sds link = sdscatprintf(sdsempty(), "%s/sys/class/hidraw/hidraw%d", root, board);
+  sds vendor = sdscatprintf(sdsempty(), "%04x\n", SIM_NUVOTON_VENDOR);
+  sds product = sdscatprintf(sdsempty(), "%04x\n", SIM_NUVOTON_PRODUCT);
+  sds uevent = sdscatprintf(sdsempty(), "MAJOR=247\nMINOR=%d\nDEVNAME=hidraw%d\n", board, board);
+  int result;
+
+  result = make_path(hidraw)
+    || write_attribute(usb_device, "uevent", "DEVTYPE=usb_device\n")
+    || write_attribute(usb_device, "idVendor", vendor)
+    || write_attribute(usb_device, "idProduct", product)
+    || write_attribute(usb_device, "bcdDevice", "0100\n")
+    || write_attribute(usb_device, "manufacturer", "Nuvoton\n")
+    || write_attribute(usb_device, "product", "HID Transfer\n")
+    || make_subsystem(root, usb_device, "bus/usb")
+    || write_attribute(usb_interface, "uevent", "DEVTYPE=usb_interface\n")
+    || write_attribute(usb_interface, "bInterfaceNumber", "00\n")
+    || write_attribute(usb_interface, "bInterfaceClass", "03\n")
+    || make_subsystem(root, usb_interface, "bus/usb")
+    || make_subsystem(root, hid, "bus/hid")
+    || write_attribute(hidraw, "dev", "247:0\n")
+    || write_attribute(hidraw, "uevent", uevent)
+    || make_subsystem(root, hidraw, "class/hidraw")
+    || make_link(hidraw + strlen(root) + strlen("/sys"), link);
+
+  sdsfree(port);
+  sdsfree(usb_device);
+  sdsfree(usb_interface);
+  sdsfree(hid);
+  sdsfree(hidraw);
+  sdsfree(link);
+  sdsfree(vendor);
+  sdsfree(product);
+  sdsfree(uevent);
+  return result ? FAILURE : SUCCESS;
+}
+
+// Name of a synthetic sysfs device
+sds fixture_device_name(int index){
+  return sdscatprintf(sdsempty(), "bench%04d", index);
+}
+
+// Path to a synthetic sysfs device, 6 levels below /sys/devices
+sds fixture_device_path(const char *root, int index){
+  sds name = fixture_device_name(index);
+  sds path = sdscatprintf(sdsempty(), "%s/sys/devices/platform/bench/bus%d/hub%d/port%d/slot%d/%s",
+    root, index % 4, ( index / 4 ) % 4, ( index / 16 ) % 4, index / 64, name);
+
+  sdsfree(name);
+  return path;
+}
+
+// Name of a synthetic one-wire slave
+sds fixture_w1_name(int index){
+  return sdscatprintf(sdsempty(), "28-%012d", index);
+}
+
+// Name of a leaf directory in the deep tree
+sds fixture_leaf_name(int index){
+  return sdscatprintf(sdsempty(), "leaf%05d", index);
+}
+
+static int build_tree(char *path, size_t length, int depth, int fanout, int *leaves){
+  int result = SUCCESS;
+
+  if ( mkdir(path, 0755) && errno != EEXIST ) {
+    perror(path);
+    return FAILURE;
+  }
+  if ( write_attribute(path, "uevent", "") )
+    return FAILURE;
+
+  for (int i = 0; i < fanout && result == SUCCESS; i++) {
+    if ( depth > 1 )
+      snprintf(path + length, PATH_MAX - length, "/node%d", i);
+    else
+      snprintf(path + length, PATH_MAX - length, "/leaf%05d", (*leaves)++);
+    result = depth > 1
+      ? build_tree(path, strlen(path), depth - 1, fanout, leaves)
+      : mkdir(path, 0755) && errno != EEXIST;
+    path[length] = '\0';
+  }
+  return result ? FAILURE : SUCCESS;
+}
+
+/*
+  Build a deep and wide tree below <root>/deep, with <fanout> directories
+  named node<n> in each directory, <depth> levels down. The directories at
+  the bottom are named leaf<n>, and are unique. Return the number of leaves.
+*/
+int fixture_build_tree(const char *root, int depth, int fanout){
+  char path[PATH_MAX];
+  int leaves = 0;
+
+  fixture_remove(root);
+  snprintf(path, sizeof(path), "%s", root);
+  mkdir(path, 0755);
+  snprintf(path, sizeof(path), "%s/deep", root);
+  if ( build_tree(path, strlen(path), depth, fanout, &leaves) )
+    return FAILURE;
+  return leaves;
+}
+
+static int remove_entry(const char *path, const struct stat *stat_buffer, int flag, struct FTW *ftw){
+  return remove(path);
+}
+
+void fixture_remove(const char *root){
+  nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+  Build a tree with <devices> of each kind, under <root>.
+  Any previous tree is removed.
+*/
+int fixture_build(const char *root, int devices){
+  sds path, name, content;
+  int result = SUCCESS;
+
+  fixture_remove(root);
+
+  for (int i = 0; i < devices && result == SUCCESS; i++) {
+    // One-wire temperature sensor
+    name = fixture_w1_name(i);
+    path = sdscatprintf(sdsempty(), "%s/sys/devices/w1_bus_master1/%s", root, name);
+    content = sdscatprintf(sdsempty(),
+      "72 01 4b 46 7f ff 0e 10 57 : crc=57 YES\n72 01 4b 46 7f ff 0e 10 57 t=%d\n", 20000 + i);
+    result = make_path(path)
+      || write_attribute(path, "w1_slave", content)
+      || write_attribute(path, "name", name);
+    sdsfree(content);
+    sdsfree(name);
+    sdsfree(path);
+
+    // Device with attributes
+    path = fixture_device_path(root, i);
+    result = result
+      || make_path(path)
+      || write_attribute(path, "value", "1\n")
+      || write_attribute(path, "edge", "none\n")
+      || write_attribute(path, "direction", "out\n")
+      || write_attribute(path, "uevent", "");
+    sdsfree(path);
+
+    // A simulated Nuvoton board
+    result = result || make_board(root, i);
+  }
+
+  return result ? FAILURE : SUCCESS;
+}
@@ -0,0 +1,16 @@
+#ifndef FIXTURE_H
+#define FIXTURE_H
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+int fixture_build(const char *root, int devices);
+void fixture_remove(const char *root);
+sds fixture_device_name(int index);
+sds fixture_device_path(const char *root, int index);
+sds fixture_w1_name(int index);
+sds fixture_leaf_name(int index);
+int fixture_build_tree(const char *root, int depth, int fanout);
+
+#endif
@@ -0,0 +1,192 @@
+/*
+
+  Simulated Nuvoton relay controllers
+
+  Replaces the HIDAPI functions used by the HID USB probe and the Nuvoton
+  driver, with a number of simulated boards. The boards answer the 16 byte
+  read (0xD2) and write (0xC3) reports, and keep their relay state between
+  opens, like the real controller.
+
+  Only linked into the benchmark, in place of HIDAPI.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <wchar.h>
+
+/* Linux */
+#include <hidapi/hidapi.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#include "hid_enum.h"
+#include "sim_nuvoton.h"
+
+#define REPORT_SIZE 16
+
+struct hid_device_ {
+  int board;
+  int pending;                          // A reply is waiting to be read
+  unsigned long received;               // Replies read
+  unsigned char reply[REPORT_SIZE];
+};
+
+static int boards = 0;
+static uint16_t *board_state = NULL;
+
+// Create <count> simulated boards, with all relays off
+void sim_nuvoton_setup(int count){
+  free(board_state);
+  board_state = (uint16_t *)calloc(count ? count : 1, sizeof(uint16_t));
+  boards = count;
+}
+
+// The port of a board, as hidapi (libusb) names the USB interface
+sds sim_nuvoton_port(int board){
+  return sdscatprintf(sdsempty(), "1-1.%d:1.0", board + 1);
+}
+
+/*
+  The boards that match, checked like the libusb enumerator: The port before
+  the strings. The boards have no serial number.
+*/
+struct hid_device_info * hid_enumerate_matching(const struct hid_match *match){
+  struct hid_device_info *first = NULL, **last = &first, *device;
+
+  if ( ( match->vendor_id && match->vendor_id != SIM_NUVOTON_VENDOR )
+    || ( match->product_id && match->product_id != SIM_NUVOTON_PRODUCT )
+    || match->serial_number
+    || ( match->manufacturer && strcmp(match->manufacturer, "Nuvoton") ) )
+    return NULL;
+
+  for (int i = 0; i < boards; i++) {
+    sds port = sim_nuvoton_port(i);
+
+    if ( match->port && strcmp(match->port, port) ) {
+      sdsfree(port);
+      continue;
+    }
+    device = (struct hid_device_info *)calloc(1, sizeof(struct hid_device_info));
+    device->path = strdup(port);
+    device->vendor_id = SIM_NUVOTON_VENDOR;
+    device->product_id = SIM_NUVOTON_PRODUCT;
+    device->manufacturer_string = wcsdup(L"Nuvoton");
+    device->product_string = wcsdup(L"HID Transfer");
+    device->interface_number = 0;
+    *last = device;
+    last = &device->next;
+    sdsfree(port);
+  }
+  return first;
+}
+
+struct hid_device_info * hid_enumerate(unsigned short vendor_id, unsigned short product_id){
+  struct hid_match match;
+
+  memset(&match, 0, sizeof(match));
+  match.vendor_id = vendor_id;
+  match.product_id = product_id;
+  return hid_enumerate_matching(&match);
+}
+
+void hid_free_enumeration(struct hid_device_info *device){
+  struct hid_device_info *next;
+
+  for ( ; device; device = next) {
+    next = device->next;
+    free(device->path);
+    free(device->serial_number);
+    free(device->manufacturer_string);
+    free(device->product_string);
+    free(device);
+  }
+}
+
+hid_device * hid_open_path(const char *path){
+  hid_device *device;
+  int board;
+
+  if ( sscanf(path, "1-1.%d:1.0", &board) != 1 || board < 1 || board > boards )
+    return NULL;
+
+  device = (hid_device *)calloc(1, sizeof(hid_device));
+  device->board = board - 1;
+  return device;
+}
+
+void hid_close(hid_device *device){
+  free(device);
+}
+
+int hid_set_nonblocking(hid_device *device, int nonblock){
+  return 0;
+}
+
+// Checksum of a report: the sum of all bytes, but the checksum
+static uint16_t checksum(const unsigned char *report){
+  uint16_t sum = 0;
+
+  for (int i = 0; i < REPORT_SIZE - 2; i++)
+    sum += report[i];
+  return sum;
+}
+
+int hid_write(hid_device *device, const unsigned char *data, size_t length){
+  uint16_t sum;
+
+  if ( length != REPORT_SIZE || memcmp(data + 10, "HIDC", 4) )
+    return -1;
+
+  sum = checksum(data);
+  if ( data[14] != ( sum & 0xFF ) || data[15] != ( sum >> 8 ) )
+    return -1;
+
+  switch ( data[0] ) {
+    case 0xD2: // Read relay state. Reply is big endian
+      memset(device->reply, 0, REPORT_SIZE);
+      device->reply[0] = 0xD2;
+      device->reply[1] = REPORT_SIZE - 2;
+      device->reply[2] = board_state[device->board] >> 8;
+      device->reply[3] = board_state[device->board] & 0xFF;
+      memcpy(device->reply + 10, "HIDC", 4);
+      sum = checksum(device->reply);
+      device->reply[14] = sum & 0xFF;
+      device->reply[15] = sum >> 8;
+      device->pending = true;
+      break;
+
+    case 0xC3: // Set relay state. Little endian
+      board_state[device->board] = data[2] | ( data[3] << 8 );
+      break;
+
+    default:
+      return -1;
+  }
+  return length;
+}
+
+int hid_read_timeout(hid_device *device, unsigned char *data, size_t length, int milliseconds){
+  if ( !device->pending )
+    return 0;
+
+  if ( length > REPORT_SIZE )
+    length = REPORT_SIZE;
+  memcpy(data, device->reply, length);
+  device->pending = false;
+  device->received++;
+  return length;
+}
+
+int hid_get_input_statistics(hid_device *device, unsigned long *received, unsigned long *dropped){
+  *received = device->received;
+  *dropped = 0;
+  return 0;
+}
+
+int hid_read(hid_device *device, unsigned char *data, size_t length){
+  return hid_read_timeout(device, data, length, 0);
+}
@@ -0,0 +1,14 @@
+#ifndef SIM_NUVOTON_H
+#define SIM_NUVOTON_H
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#define SIM_NUVOTON_VENDOR 0x0416
+#define SIM_NUVOTON_PRODUCT 0x5020
+
+void sim_nuvoton_setup(int count);
+sds sim_nuvoton_port(int board);
+
+#endif
@@ -0,0 +1,413 @@
+/*
+
+  Simulated udev
+
+  Replaces the libudev functions used by the HID USB enumerator, with a view
+  of the synthetic sysfs tree. As in udev, the subsystem of a device is the
+  name its subsystem link points to, the device type and node name are read
+  from its uevent file, and attributes are the files in its directory.
+
+  Only linked into the benchmark, in place of libudev.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+/* Unix */
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+
+/* Linux */
+#include <glib.h>
+#include <libudev.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#include "walk.h"
+
+struct udev {
+  int refs;
+};
+
+struct udev_list_entry {
+  sds name;
+  struct udev_list_entry *next;
+};
+
+struct udev_enumerate {
+  struct udev *udev;
+  sds subsystem;
+  sds sysname;
+  struct udev_device *parent;
+  GList *sysattr;                 // Name and pattern pairs, that must all match
+  GList *property;                // Name and pattern pairs, of which one must match
+  struct udev_list_entry *list;
+};
+
+struct udev_device {
+  struct udev *udev;
+  int refs;
+  sds syspath;
+  sds subsystem;
+  sds devtype;
+  sds devnode;
+  sds uevent;
+  GHashTable *attributes;         // Attributes read, name -> value
+  struct udev_device *parent;     // Owned by the device, as in libudev
+  int parent_read;
+};
+
+struct udev *udev_new(void){
+  struct udev *udev = (struct udev *)calloc(1, sizeof(struct udev));
+
+  udev->refs = 1;
+  return udev;
+}
+
+struct udev *udev_unref(struct udev *udev){
+  if ( udev && --udev->refs == 0 )
+    free(udev);
+  return NULL;
+}
+
+struct udev_enumerate *udev_enumerate_new(struct udev *udev){
+  struct udev_enumerate *enumerate = (struct udev_enumerate *)calloc(1, sizeof(struct udev_enumerate));
+
+  enumerate->udev = udev;
+  return enumerate;
+}
+
+struct udev_enumerate *udev_enumerate_unref(struct udev_enumerate *enumerate){
+  struct udev_list_entry *next;
+
+  for ( ; enumerate->list; enumerate->list = next) {
+    next = enumerate->list->next;
+    sdsfree(enumerate->list->name);
+    free(enumerate->list);
+  }
+  g_list_free_full(enumerate->sysattr, (GDestroyNotify)sdsfree);
+  g_list_free_full(enumerate->property, (GDestroyNotify)sdsfree);
+  udev_device_unref(enumerate->parent);
+  sdsfree(enumerate->subsystem);
+  sdsfree(enumerate->sysname);
+  free(enumerate);
+  return NULL;
+}
+
+int udev_enumerate_add_match_subsystem(struct udev_enumerate *enumerate, const char *subsystem){
+  sdsfree(enumerate->subsystem);
+  enumerate->subsystem = sdsnew(subsystem);
+  return 0;
+}
+
+int udev_enumerate_add_match_sysname(struct udev_enumerate *enumerate, const char *sysname){
+  sdsfree(enumerate->sysname);
+  enumerate->sysname = sdsnew(sysname);
+  return 0;
+}
+
+int udev_enumerate_add_match_parent(struct udev_enumerate *enumerate, struct udev_device *parent){
+  udev_device_unref(enumerate->parent);
+  enumerate->parent = udev_device_ref(parent);
+  return 0;
+}
+
+int udev_enumerate_add_match_sysattr(struct udev_enumerate *enumerate, const char *name, const char *value){
+  enumerate->sysattr = g_list_append(enumerate->sysattr, sdsnew(name));
+  enumerate->sysattr = g_list_append(enumerate->sysattr, sdsnew(value));
+  return 0;
+}
+
+int udev_enumerate_add_match_property(struct udev_enumerate *enumerate, const char *name, const char *value){
+  enumerate->property = g_list_append(enumerate->property, sdsnew(name));
+  enumerate->property = g_list_append(enumerate->property, sdsnew(value));
+  return 0;
+}
+
+// Check the attributes and properties of a device
+static int match_device(struct udev_enumerate *enumerate, const char *syspath){
+  struct udev_device *device;
+  const char *value;
+  int result = true;
+
+  if ( !enumerate->sysattr && !enumerate->property )
+    return true;
+  if ( !(device = udev_device_new_from_syspath(enumerate->udev, syspath)) )
+    return false;
+
+  for (GList *item = enumerate->sysattr; item && result; item = item->next->next) {
+    value = udev_device_get_sysattr_value(device, (sds)item->data);
+    result = value && !fnmatch((sds)item->next->data, value, 0);
+  }
+
+  if ( result && enumerate->property ) {
+    result = false;
+    for (GList *item = enumerate->property; item && !result; item = item->next->next) {
+      value = udev_device_get_property_value(device, (sds)item->data);
+      result = value && !fnmatch((sds)item->next->data, value, 0);
+    }
+  }
+
+  udev_device_unref(device);
+  return result;
+}
+
+struct scan {
+  struct udev_enumerate *enumerate;
+  struct udev_list_entry **last;
+};
+
+static void add_entry(struct scan *scan, const char *syspath){
+  struct udev_list_entry *entry;
+
+  if ( !match_device(scan->enumerate, syspath) )
+    return;
+  entry = (struct udev_list_entry *)calloc(1, sizeof(struct udev_list_entry));
+  entry->name = sdsnew(syspath);
+  *scan->last = entry;
+  scan->last = &entry->next;
+}
+
+// A device below the parent, of the subsystem
+static int visit_child(struct walk_entry *entry, void *context){
+  struct scan *scan = (struct scan *)context;
+  char link[PATH_MAX], target[PATH_MAX];
+  const char *subsystem;
+  ssize_t length;
+
+  snprintf(link, sizeof(link), "%s/subsystem", entry->name);
+  if ( (length = readlinkat(entry->dir_fd, link, target, sizeof(target) - 1)) <= 0 )
+    return WALK_DESCEND;
+  target[length] = '\0';
+  subsystem = strrchr(target, '/') ? strrchr(target, '/') + 1 : target;
+  if ( !strcmp(subsystem, scan->enumerate->subsystem)
+    && ( !scan->enumerate->sysname || !fnmatch(scan->enumerate->sysname, entry->name, 0) ) )
+    add_entry(scan, entry->path);
+  return WALK_DESCEND;
+}
+
+/*
+  List the devices of the class or bus, by their real path. Devices of a bus
+  are listed in its devices directory. With a parent, the tree below the
+  parent is searched instead, as udev does.
+*/
+int udev_enumerate_scan_devices(struct udev_enumerate *enumerate){
+  struct udev_list_entry **last = &enumerate->list, *entry;
+  char path[PATH_MAX], *real;
+  struct dirent *dp;
+  sds directory;
+  DIR *dir;
+
+  if ( !enumerate->subsystem )
+    return -1;
+
+  if ( enumerate->parent ) {
+    struct scan scan = { enumerate, last };
+
+    walk_tree(enumerate->parent->syspath, 1, WALK_DIRECTORIES, visit_child, &scan);
+    return 0;
+  }
+
+  directory = sysfs_path("/sys/class/");
+  directory = sdscat(directory, enumerate->subsystem);
+  if ( !(dir = opendir(directory)) ) {
+    sdsfree(directory);
+    directory = sdscatprintf(sysfs_path("/sys/bus/"), "%s/devices", enumerate->subsystem);
+    if ( !(dir = opendir(directory)) ) {
+      sdsfree(directory);
+      return 0;
+    }
+  }
+
+  while ( (dp = readdir(dir)) ) {
+    if ( dp->d_name[0] == '.' )
+      continue;
+    if ( enumerate->sysname && fnmatch(enumerate->sysname, dp->d_name, 0) )
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", directory, dp->d_name);
+    if ( !(real = realpath(path, NULL)) )
+      continue;
+
+    if ( match_device(enumerate, real) ) {
+      entry = (struct udev_list_entry *)calloc(1, sizeof(struct udev_list_entry));
+      entry->name = sdsnew(real);
+      *last = entry;
+      last = &entry->next;
+    }
+    free(real);
+  }
+  closedir(dir);
+  sdsfree(directory);
+  return 0;
+}
+
+struct udev_list_entry *udev_enumerate_get_list_entry(struct udev_enumerate *enumerate){
+  return enumerate->list;
+}
+
+struct udev_list_entry *udev_list_entry_get_next(struct udev_list_entry *entry){
+  return entry->next;
+}
+
+const char *udev_list_entry_get_name(struct udev_list_entry *entry){
+  return entry->name;
+}
+
+// Read a file of the device directory, without the trailing newline
+static sds read_file(const char *directory, const char *name){
+  char path[PATH_MAX], buffer[4096];
+  int fd, length;
+
+  snprintf(path, sizeof(path), "%s/%s", directory, name);
+  if ( (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 )
+    return NULL;
+  length = read(fd, buffer, sizeof(buffer));
+  close(fd);
+  if ( length < 0 )
+    return NULL;
+  while ( length > 0 && buffer[length - 1] == '\n' )
+    length--;
+  return sdsnewlen(buffer, length);
+}
+
+// The value of KEY=value in a uevent file
+static sds uevent_value(sds uevent, const char *key){
+  size_t length = strlen(key);
+  const char *line;
+
+  for (line = uevent; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL)
+    if ( !strncmp(line, key, length) && line[length] == '=' )
+      return sdsnewlen(line + length + 1, strcspn(line + length + 1, "\n"));
+  return NULL;
+}
+
+struct udev_device *udev_device_new_from_syspath(struct udev *udev, const char *syspath){
+  struct udev_device *device;
+  char link[PATH_MAX], target[PATH_MAX];
+  ssize_t length;
+  sds uevent, devname;
+
+  if ( !(uevent = read_file(syspath, "uevent")) )
+    return NULL;
+
+  device = (struct udev_device *)calloc(1, sizeof(struct udev_device));
+  device->udev = udev;
+  device->refs = 1;
+  device->syspath = sdsnew(syspath);
+  device->attributes = g_hash_table_new_full(g_str_hash, g_str_equal, (GDestroyNotify)sdsfree, (GDestroyNotify)sdsfree);
+
+  snprintf(link, sizeof(link), "%s/subsystem", syspath);
+  if ( (length = readlink(link, target, sizeof(target) - 1)) > 0 ) {
+    target[length] = '\0';
+    device->subsystem = sdsnew(strrchr(target, '/') ? strrchr(target, '/') + 1 : target);
+  }
+
+  device->devtype = uevent_value(uevent, "DEVTYPE");
+  if ( (devname = uevent_value(uevent, "DEVNAME")) ) {
+    device->devnode = sdscatprintf(sdsempty(), "/dev/%s", devname);
+    sdsfree(devname);
+  }
+  device->uevent = uevent;
+  return device;
+}
+
+struct udev_device *udev_device_ref(struct udev_device *device){
+  device->refs++;
+  return device;
+}
+
+struct udev_device *udev_device_unref(struct udev_device *device){
+  if ( !device || --device->refs > 0 )
+    return NULL;
+  udev_device_unref(device->parent);
+  g_hash_table_destroy(device->attributes);
+  sdsfree(device->syspath);
+  sdsfree(device->subsystem);
+  sdsfree(device->devtype);
+  sdsfree(device->devnode);
+  sdsfree(device->uevent);
+  free(device);
+  return NULL;
+}
+
+// The closest directory above, that is a device
+struct udev_device *udev_device_get_parent(struct udev_device *device){
+  sds devices, path;
+
+  if ( device->parent_read )
+    return device->parent;
+  device->parent_read = true;
+
+  devices = sysfs_path("/sys/devices");
+  path = sdsdup(device->syspath);
+  for (;;) {
+    *strrchr(path, '/') = '\0';
+    sdsupdatelen(path);
+    if ( sdslen(path) <= sdslen(devices) )
+      break;
+    if ( (device->parent = udev_device_new_from_syspath(device->udev, path)) )
+      break;
+  }
+  sdsfree(path);
+  sdsfree(devices);
+  return device->parent;
+}
+
+struct udev_device *udev_device_get_parent_with_subsystem_devtype(struct udev_device *device, const char *subsystem, const char *devtype){
+  while ( (device = udev_device_get_parent(device)) )
+    if ( device->subsystem && !strcmp(device->subsystem, subsystem)
+      && ( !devtype || ( device->devtype && !strcmp(device->devtype, devtype) ) ) )
+      return device;
+  return NULL;
+}
+
+const char *udev_device_get_sysattr_value(struct udev_device *device, const char *name){
+  sds value;
+
+  if ( (value = (sds)g_hash_table_lookup(device->attributes, name)) )
+    return value;
+  if ( strchr(name, '/') || !(value = read_file(device->syspath, name)) )
+    return NULL;
+  g_hash_table_insert(device->attributes, sdsnew(name), value);
+  return value;
+}
+
+// The properties are the keys of the uevent file, and the subsystem
+const char *udev_device_get_property_value(struct udev_device *device, const char *name){
+  sds value;
+
+  if ( !strcmp(name, "SUBSYSTEM") )
+    return device->subsystem;
+  if ( !strcmp(name, "DEVTYPE") )
+    return device->devtype;
+  if ( !(value = uevent_value(device->uevent, name)) )
+    return NULL;
+  g_hash_table_insert(device->attributes, sdscat(sdsnew("uevent:"), name), value);
+  return value;
+}
+
+const char *udev_device_get_syspath(struct udev_device *device){
+  return device->syspath;
+}
+
+const char *udev_device_get_sysname(struct udev_device *device){
+  return strrchr(device->syspath, '/') + 1;
+}
+
+const char *udev_device_get_subsystem(struct udev_device *device){
+  return device->subsystem;
+}
+
+const char *udev_device_get_devtype(struct udev_device *device){
+  return device->devtype;
+}
+
+const char *udev_device_get_devnode(struct udev_device *device){
+  return device->devnode;
+}
@@ -0,0 +1,244 @@
+/*
+
+  Batch mode
+
+  Read commands from a file or stdin, one per line:
+    <identifier> <attribute> [<action>]
+
+  All identifiers are resolved from a single probe pass. The commands are
+  grouped by physical device, and each group is executed as one unit.
+  Devices with a batch function (ex. Nuvoton relay controllers) perform all
+  the commands of the group in a single read-modify-write.
+  The groups are executed concurrently.
+
+  Results are printed per line, in the order of the input, followed by the
+  total wall time.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <assert.h>
+
+/* Linux */
+#include <glib.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#include "batch.h"
+#include "dispatch.h"
+#include "monitor.h"
+
+// A command line from the batch input
+struct batch_command {
+  int line;
+  struct _device_identifier id;
+  sds attribute;
+  sds action;
+  GList *calls;                 // Calls to devices, made by this command
+};
+
+// A command performed on one device
+struct batch_call {
+  struct batch_command *command;
+  struct _device_list *device;
+  sds reply;
+};
+
+// All calls to one physical device
+struct batch_group {
+  struct _device_list *device;
+  GList *calls;
+};
+
+static void run_group(void *context, int index){
+  struct batch_group *group = ((struct batch_group **)context)[index];
+  int count = g_list_length(group->calls), i = 0;
+  sds *attribute, *action, *reply;
+  GList *iterator;
+
+  attribute = (sds *)malloc(sizeof(sds) * count);
+  action = (sds *)malloc(sizeof(sds) * count);
+  reply = (sds *)malloc(sizeof(sds) * count);
+
+  for (iterator = group->calls; iterator; iterator = iterator->next, i++) {
+    struct batch_call *call = (struct batch_call *)iterator->data;
+    attribute[i] = call->command->attribute;
+    action[i] = call->command->action;
+    reply[i] = sdsempty();
+  }
+
+  if ( group->device->batch )
+    group->device->batch(group->device, count, attribute, action, reply);
+  else
+    for (i = 0; i < count; i++)
+      group->device->action(group->device, attribute[i], action[i], &reply[i]);
+
+  for (i = 0, iterator = group->calls; iterator; iterator = iterator->next, i++)
+    ((struct batch_call *)iterator->data)->reply = reply[i];
+
+  free(attribute);
+  free(action);
+  free(reply);
+}
+
+// Read and parse commands. Return a list of commands
+static GList * read_commands(FILE *input){
+  GList *commands = NULL;
+  struct batch_command *command;
+  char buffer[1024];
+  sds *argv;
+  int argc, line = 0;
+
+  while ( fgets(buffer, sizeof(buffer), input) ) {
+    line++;
+    argv = sdssplitargs(buffer, &argc);
+    if ( !argv || argc < 1 ) {
+      if ( !argv )
+        fprintf(stderr, "Line %d: Unbalanced quotes\n", line);
+      sdsfreesplitres(argv, argc);
+      continue;
+    }
+
+    command = (struct batch_command *)malloc(sizeof(struct batch_command));
+    memset(command, 0, sizeof(struct batch_command));
+    command->line = line;
+    parse_identifier(argv[0], &command->id);
+    if ( argc > 1 && sdslen(argv[1]) )
+      command->attribute = sdsnew(strtolower(argv[1]));
+    if ( argc > 2 && sdslen(argv[2]) )
+      command->action = sdsnew(strtolower(argv[2]));
+    if ( command->action && argc > 3 )
+      command->action = sdscatprintf(command->action, " %s", argv[3]);
+    commands = g_list_append(commands, command);
+
+    sdsfreesplitres(argv, argc);
+  }
+  return commands;
+}
+
+/*
+  Probe once, for the union of the identifiers: every interface named in the
+  commands is probed in full, or all interfaces, if a command has none.
+*/
+static GList * probe_commands(GList *commands){
+  struct _device_identifier id;
+  GList *device_list = NULL, *interfaces = NULL, *iterator;
+  struct batch_command *command;
+  int all = false;
+
+  for (iterator = commands; iterator; iterator = iterator->next) {
+    command = (struct batch_command *)iterator->data;
+    if ( !command->id.interface || !sdslen(command->id.interface) )
+      all = true;
+    else if ( !g_list_find_custom(interfaces, command->id.interface, (GCompareFunc)strcmp) )
+      interfaces = g_list_append(interfaces, command->id.interface);
+  }
+
+  memset(&id, 0, sizeof(id));
+  if ( all )
+    probe_devices(id, &device_list);
+  else
+    for (iterator = interfaces; iterator; iterator = iterator->next) {
+      id.interface = (sds)iterator->data;
+      probe_devices(id, &device_list);
+    }
+
+  g_list_free(interfaces);
+  return device_list;
+}
+
+int batch_run(FILE *input, int jobs){
+  GList *commands, *device_list, *groups = NULL, *iterator, *matched, *device;
+  struct batch_command *command;
+  struct batch_group *group, **group_array;
+  struct batch_call *call;
+  uint64_t start_ms = monitor_time_ms();
+  int group_count, i, failed = 0;
+
+  commands = read_commands(input);
+  device_list = probe_commands(commands);
+
+  // Resolve commands to devices, and group the calls by device
+  for (iterator = commands; iterator; iterator = iterator->next) {
+    command = (struct batch_command *)iterator->data;
+    matched = resolve_devices(&command->id, &device_list);
+
+    for (device = matched; device; device = device->next) {
+      GList *g;
+
+      call = (struct batch_call *)malloc(sizeof(struct batch_call));
+      memset(call, 0, sizeof(struct batch_call));
+      call->command = command;
+      call->device = (struct _device_list *)device->data;
+      command->calls = g_list_append(command->calls, call);
+
+      for (g = groups; g; g = g->next)
+        if ( ((struct batch_group *)g->data)->device == call->device )
+          break;
+
+      if ( g )
+        group = (struct batch_group *)g->data;
+      else {
+        group = (struct batch_group *)malloc(sizeof(struct batch_group));
+        memset(group, 0, sizeof(struct batch_group));
+        group->device = call->device;
+        groups = g_list_append(groups, group);
+      }
+      group->calls = g_list_append(group->calls, call);
+    }
+    g_list_free(matched);
+  }
+
+  // Execute the groups concurrently
+  group_count = g_list_length(groups);
+  group_array = (struct batch_group **)malloc(sizeof(struct batch_group *) * (group_count + 1));
+  for (i = 0, iterator = groups; iterator; iterator = iterator->next, i++)
+    group_array[i] = (struct batch_group *)iterator->data;
+
+  if ( info )
+    jobs = 1;
+  workpool_run(jobs, group_count, run_group, group_array);
+
+  // Report per line
+  for (iterator = commands; iterator; iterator = iterator->next) {
+    command = (struct batch_command *)iterator->data;
+
+    if ( !command->calls ) {
+      printf("%d: No devices found\n", command->line);
+      failed++;
+    }
+
+    for (GList *c = command->calls; c; c = c->next) {
+      call = (struct batch_call *)c->data;
+      printf("%d: %s %s\n", command->line, call->device->id, call->reply && call->reply[0] ? call->reply : "No reply");
+      sdsfree(call->reply);
+      free(call);
+    }
+    g_list_free(command->calls);
+    free_identifier(&command->id);
+    sdsfree(command->attribute);
+    sdsfree(command->action);
+    free(command);
+  }
+
+  printf("Batch: %d commands on %d devices in %llu ms\n",
+    g_list_length(commands),
+    group_count,
+    (unsigned long long)(monitor_time_ms() - start_ms)
+  );
+
+  for (i = 0; i < group_count; i++) {
+    g_list_free(group_array[i]->calls);
+    free(group_array[i]);
+  }
+  free(group_array);
+  g_list_free(groups);
+  g_list_free(commands);
+
+  return failed ? FAILURE : SUCCESS;
+}
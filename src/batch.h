@@ -0,0 +1,13 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/* C */
+#include <stdio.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+int batch_run(FILE *input, int jobs);
+
+#endif
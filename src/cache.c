@@ -0,0 +1,323 @@
+/*
+
+  Probe cache
+
+  The result of probing is saved in the runtime directory, one file per
+  identifier. Root uses /run/devia. Other users can't write there, and use
+  $XDG_RUNTIME_DIR/devia instead. Most calls rediscover exactly the same hardware, so the next
+  call with the same identifier reads the file, rather than enumerating
+  USB devices, searching sysfs and reading the one-wire bus.
+
+  The cache is valid as long as the devices attached are unchanged. This is
+  checked by comparing the boot id, and the names and modification times of
+  the USB and one-wire bus devices, with the values saved with the cache. A
+  device plugged in or unplugged, adds or removes a bus device.
+
+  The udev event sequence number is not used: Opening a relay controller
+  through libusb detaches its kernel driver, and closing it binds the driver
+  again. That makes events too, and would invalidate the cache after every
+  action. The interface stays on the bus while its driver is detached. The
+  hidraw node of a cached device may have changed, so the hidraw transport
+  verifies it when opening.
+
+  The configuration of simulated boards is part of the state too.
+
+  Function pointers are not saved. They are restored from the supported
+  device table, by index. The cache is invalidated by a new build.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+/* Unix */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+/* Linux */
+#include <glib.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+#include "version.h"
+#include "virtual.h"
+#include "sysfs.h"
+
+#include "cache.h"
+
+#define BOOT_ID "/proc/sys/kernel/random/boot_id"
+#define USB_BUS_DIR "/sys/bus/usb/devices"
+#define W1_BUS_DIR "/sys/bus/w1/devices"
+
+int probe_cache = true;
+static int cache_hits = 0;
+static int cache_misses = 0;
+
+// FNV-1a hash of a string, continued from <hash>
+static uint64_t hash_string(uint64_t hash, const char *str){
+  for ( ; str && *str; str++) {
+    hash ^= (unsigned char)*str;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash * 0x100000001b3ULL;
+}
+
+// Name of the cache file, for this identifier
+static sds cache_filename(struct _device_identifier *id){
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  sds dir, filename;
+
+  hash = hash_string(hash, id->interface);
+  hash = hash_string(hash, id->device_id);
+  hash = hash_string(hash, id->port);
+  hash = hash_string(hash, id->device_path);
+  hash = hash_string(hash, sysfs_list_attributes ? "list" : NULL);
+
+  dir = cache_dir();
+  filename = sdscatprintf(sdsempty(), "%s/probe-%016llx", dir, (unsigned long long)hash);
+  sdsfree(dir);
+  return filename;
+}
+
+/*
+  The directory of the files saved for the next run, created if missing.
+  Root uses DEVIA_RUN_DIR. Other users their own runtime directory, if they have one.
+*/
+sds cache_dir(void){
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  sds dir;
+
+  if ( getuid() && runtime_dir && *runtime_dir ) {
+    dir = sdscatprintf(sdsempty(), "%s/devia", runtime_dir);
+    mkdir(dir, 0700);
+  } else {
+    dir = sdsnew(DEVIA_RUN_DIR);
+    mkdir(dir, 0755);
+  }
+  return dir;
+}
+
+// Add the modification time, number and names of the devices on a bus, to the state
+static sds bus_state(sds state, const char *dir){
+  struct stat stat_buffer;
+  struct dirent *entry;
+  uint64_t names = 0;
+  int count = 0;
+  DIR *bus;
+
+  if ( stat(dir, &stat_buffer) || !(bus = opendir(dir)) )
+    return state;
+
+  // The sum of the hashes doesn't depend on the order of the entries
+  while ( (entry = readdir(bus)) )
+    if ( entry->d_name[0] != '.' ) {
+      names += hash_string(0xcbf29ce484222325ULL, entry->d_name);
+      count++;
+    }
+  closedir(bus);
+
+  return sdscatprintf(state, " %ld.%ld %d %016llx",
+    (long)stat_buffer.st_mtim.tv_sec, stat_buffer.st_mtim.tv_nsec, count, (unsigned long long)names);
+}
+
+// Describe the devices currently attached, as a string
+static sds kernel_state(void){
+  char boot_id[64] = "";
+  sds state;
+  int fd, length;
+
+  if ( (fd = open(BOOT_ID, O_RDONLY | O_CLOEXEC)) >= 0 ) {
+    if ( (length = read(fd, boot_id, sizeof(boot_id) - 1)) > 0 )
+      boot_id[length] = '\0';
+    close(fd);
+  }
+  state = sdscatprintf(sdsempty(), "%s %s", VERSION_SHORT, boot_id);
+  sdstrim(state, "\n ");
+
+  state = bus_state(state, USB_BUS_DIR);
+  state = bus_state(state, W1_BUS_DIR);
+
+  // Simulated boards are configured by the environment
+  if ( getenv(VIRTUAL_ENV) )
+    state = sdscatprintf(state, " %s", getenv(VIRTUAL_ENV));
+  return state;
+}
+
+// Find the index of the device in the supported device table, from its action function
+static int device_index(struct _device_list *entry){
+  const struct _supported_device *device = supported_interface[entry->si_index].device;
+
+  for (int i = 0; device[i].name; i++)
+    if ( device[i].action == entry->action )
+      return i;
+  return FAILURE;
+}
+
+/*
+  Load the device list entries of a previous probe with the same identifier.
+  Return FAILURE if there is no valid cache, and the devices must be probed.
+*/
+int cache_load(struct _device_identifier *id, GList **device_list){
+  struct _device_list *entry;
+  struct stat stat_buffer;
+  GList *loaded = NULL;
+  sds filename, state, *argv;
+  char buffer[2048];
+  FILE *file;
+  int argc, valid = false, interfaces = 0;
+
+  if ( !probe_cache )
+    return FAILURE;
+
+  filename = cache_filename(id);
+  file = fopen(filename, "r");
+  sdsfree(filename);
+
+  // Only trust cache files written by this user or root
+  if ( !file
+    || fstat(fileno(file), &stat_buffer)
+    || ( stat_buffer.st_uid != getuid() && stat_buffer.st_uid != 0 ) ) {
+    if ( file ) fclose(file);
+    cache_misses++;
+    return FAILURE;
+  }
+
+  for (interfaces = 0; supported_interface[interfaces].name; interfaces++);
+
+  // The first line is the kernel state, at the time of the probe
+  if ( fgets(buffer, sizeof(buffer), file) ) {
+    state = kernel_state();
+    valid = !strncmp(buffer, state, sdslen(state)) && buffer[sdslen(state)] == '\n';
+    sdsfree(state);
+  }
+
+  while ( valid && fgets(buffer, sizeof(buffer), file) ) {
+    const struct _supported_device *device;
+    int si_index, sdl_index;
+
+    argv = sdssplitargs(buffer, &argc);
+    if ( !argv || argc != 7 ) {
+      sdsfreesplitres(argv, argc);
+      valid = false;
+      break;
+    }
+
+    si_index = atoi(argv[0]);
+    sdl_index = atoi(argv[1]);
+    if ( si_index < 0 || si_index >= interfaces || sdl_index < 0 ) {
+      sdsfreesplitres(argv, argc);
+      valid = false;
+      break;
+    }
+    for (int i = 0; i <= sdl_index; i++)
+      if ( !supported_interface[si_index].device[i].name ) {
+        valid = false;
+        break;
+      }
+    if ( !valid ) {
+      sdsfreesplitres(argv, argc);
+      break;
+    }
+    device = &supported_interface[si_index].device[sdl_index];
+
+    entry = (struct _device_list *) malloc(sizeof(struct _device_list));
+    memset(entry, 0, sizeof(struct _device_list));
+    entry->si_index = si_index;
+    entry->name = sdsdup(argv[2]);
+    entry->id = sdsdup(argv[3]);
+    entry->port = sdsdup(argv[4]);
+    entry->path = sdsdup(argv[5]);
+    entry->group = sdsdup(argv[6]);
+    entry->action = device->action;
+    entry->batch = device->batch;
+    entry->watch = device->watch;
+    loaded = g_list_append(loaded, entry);
+
+    sdsfreesplitres(argv, argc);
+  }
+  fclose(file);
+
+  if ( !valid ) {
+    g_list_free_full(loaded, (GDestroyNotify)free_device_entry);
+    cache_misses++;
+    return FAILURE;
+  }
+
+  if ( info )
+    printf("Using cached probe of %d devices\n", g_list_length(loaded));
+
+  *device_list = g_list_concat(*device_list, loaded);
+  cache_hits++;
+  return SUCCESS;
+}
+
+// Append a string to a cache line, quoted
+static sds cat_field(sds line, const char *str){
+  line = sdscat(line, " ");
+  return sdscatrepr(line, str ? str : "", str ? strlen(str) : 0);
+}
+
+/*
+  Save the entries of a probe with this identifier.
+  The cache file is replaced atomically.
+*/
+int cache_save(struct _device_identifier *id, GList *device_list){
+  struct _device_list *entry;
+  GList *iterator;
+  sds filename, temp_filename, content;
+  int fd, sdl_index, result;
+
+  if ( !probe_cache )
+    return FAILURE;
+
+  content = kernel_state();
+  content = sdscat(content, "\n");
+  for (iterator = device_list; iterator; iterator = iterator->next) {
+    entry = (struct _device_list *)iterator->data;
+
+    // Devices, that can't be restored from the table, are not cached
+    if ( (sdl_index = device_index(entry)) < 0 ) {
+      sdsfree(content);
+      return FAILURE;
+    }
+    content = sdscatprintf(content, "%d %d", entry->si_index, sdl_index);
+    content = cat_field(content, entry->name);
+    content = cat_field(content, entry->id);
+    content = cat_field(content, entry->port);
+    content = cat_field(content, entry->path);
+    content = cat_field(content, entry->group);
+    content = sdscat(content, "\n");
+  }
+
+  filename = cache_filename(id);
+  temp_filename = sdscatprintf(sdsdup(filename), ".%d", getpid());
+
+  result = FAILURE;
+  if ( (fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0 ) {
+    if ( write(fd, content, sdslen(content)) == (ssize_t)sdslen(content) )
+      result = SUCCESS;
+    close(fd);
+    if ( result == SUCCESS && rename(temp_filename, filename) )
+      result = FAILURE;
+    if ( result != SUCCESS )
+      unlink(temp_filename);
+  } else
+    fprintf(stderr, "Unable to write probe cache %s: %s\n", temp_filename, strerror(errno));
+
+  sdsfree(temp_filename);
+  sdsfree(filename);
+  sdsfree(content);
+  return result;
+}
+
+void cache_print_statistics(void){
+  printf("Probe cache: %d hits, %d misses\n", cache_hits, cache_misses);
+}
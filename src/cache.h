@@ -0,0 +1,15 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+extern int probe_cache;
+
+sds cache_dir(void);
+int cache_load(struct _device_identifier *id, GList **device_list);
+int cache_save(struct _device_identifier *id, GList *device_list);
+void cache_print_statistics(void);
+
+#endif
@@ -17,6 +17,10 @@
 #define SUCCESS 0
 #define FAILURE -1
 
+// Runtime directory for the daemon socket and other volatile state
+#define DEVIA_RUN_DIR "/run/devia"
+#define DEVIA_SOCKET DEVIA_RUN_DIR "/devia.sock"
+
 // unique device identifier format: <interface>+<vendor_id>:<product_id>+<serial_number>+<port>+<manufacturer string>
 struct _device_identifier {
   sds interface;
@@ -33,7 +37,10 @@ struct _device_list {
   sds path;
   sds group;
   int (* action)( struct _device_list *, sds, sds, sds *);
+  int (* watch)( struct _device_list *, sds); // Optional: Return a file descriptor, that signals changes with POLLPRI
+  int (* batch)( struct _device_list *, int, sds *, sds *, sds *); // Optional: Perform several actions as one
   sds reply;
+  int si_index;   // Index of the interface in supported_interface[]
 };
 
 extern int info;
@@ -45,17 +52,41 @@ struct _supported_device {
   const char * description;
   int (*recognize)(int sdl_index, void *dev_info );
   int (*action)(struct _device_list *device, sds attribute, sds action, sds *reply);
+  int (*batch)(struct _device_list *device, int count, sds *attribute, sds *action, sds *reply);
+  int (*watch)(struct _device_list *device, sds attribute);
 };
 
+struct udev_device;
+struct _hid_transport;
+
 struct _supported_interface {
   const char *name;
   const char *description;
   int (*probe)(int si_index, struct _device_identifier id, GList **device_list);
   const struct _supported_device *device;
+  // Optional: Handle a udev add/remove event. Unlink removed entries from the device list, and create entries for added devices
+  int (*hotplug)(int si_index, struct udev_device *device, GList **device_list, GList **added, GList **removed);
+  // Optional: Open the device named by a fully qualified identifier, without probing. Return FAILURE if not verified
+  int (*direct)(int si_index, struct _device_identifier id, GList **device_list);
+  // Optional: How drivers exchange HID reports with devices on this interface. Default the selected USB HID transport
+  const struct _hid_transport *transport;
 };
 
 extern const struct _supported_interface supported_interface[];
 
+// Device list handling
+int probe_devices(struct _device_identifier id, GList **device_list);
+int open_devices(struct _device_identifier id, GList **device_list);
+int parse_identifier(const char *str, struct _device_identifier *id);
+void free_identifier(struct _device_identifier *id);
+int match_identifier(struct _device_list *entry, struct _device_identifier *id);
+GList *resolve_devices(struct _device_identifier *id, GList **device_list);
+int hotplug_devices(struct udev_device *device, struct _device_identifier *id, GList **device_list, GList **added, GList **removed);
+void free_device_entry(struct _device_list *entry);
+const char *sysfs_root(void);
+void sysfs_set_root(const char *root);
+sds sysfs_path(const char *path);
+
 
 
 #ifndef true
@@ -0,0 +1,474 @@
+/*
+
+  Daemon mode
+
+  Probe devices once, and keep the device list resident, while serving
+  requests on a local unix domain socket.
+
+  A request is a single line: [<option>...] <identifier> [<attribute> [<action>]]
+  The options are --reconcile=<ms> and --coalesce=<ms>, given to the client.
+  They apply to that request only. The reply is the same lines devia would
+  print, after which the connection is closed.
+
+  The client side forwards a command line request to a running daemon, so
+  the cost of a request is a socket round trip, rather than a process start
+  and a full probe.
+
+  Each request is served on its own thread, so requests from several clients
+  to the same device can be performed as one. No more than
+  DAEMON_MAX_CLIENTS are served at once; further connections wait in the
+  listen queue.
+
+  The resident device list follows udev events: Devices plugged in are
+  added, and devices unplugged are removed. Requests in progress may still
+  use a removed entry, so it's freed when no request is in progress.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <signal.h>
+
+/* Unix */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+/* Linux */
+#include <glib.h>
+#include <libudev.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#include "daemon.h"
+#include "dispatch.h"
+#include "cache.h"
+#include "hid_transport.h"
+#include "sysfs_index.h"
+
+#define MAX_REQUEST_LENGTH 4096
+#define DAEMON_MAX_CLIENTS 16           // Clients served at once, each with up to <jobs> workers
+
+static char listen_path[108];
+
+// Clients being served
+static int clients = 0;
+static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t client_done = PTHREAD_COND_INITIALIZER;
+
+// A client connection, served on its own thread
+struct client {
+  int fd;
+  GList **device_list;
+  int jobs;
+};
+
+// Protects the resident device list, that requests may add to, and the entries retired from it
+static pthread_mutex_t device_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GList *retired = NULL;           // Entries removed, while requests were in progress
+static int requests = 0;                // Requests using entries of the device list
+
+// Remove the socket when terminated
+static void daemon_terminate(int signal_number){
+  unlink(listen_path);
+  _exit(0);
+}
+
+// Connect to the daemon socket. Return file descriptor or FAILURE
+static int daemon_connect(const char *socket_path){
+  struct sockaddr_un address;
+  int fd;
+
+  if ( strlen(socket_path) >= sizeof(address.sun_path) )
+    return FAILURE;
+
+  if ( (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 )
+    return FAILURE;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_path);
+
+  if ( connect(fd, (struct sockaddr *)&address, sizeof(address)) ) {
+    close(fd);
+    return FAILURE;
+  }
+  return fd;
+}
+
+// Create the listening socket. Refuse to steal the socket of a running daemon.
+static int daemon_listen(const char *socket_path){
+  struct sockaddr_un address;
+  int fd;
+
+  if ( strlen(socket_path) >= sizeof(address.sun_path) ) {
+    fprintf(stderr, "Socket path too long: %s\n", socket_path);
+    return FAILURE;
+  }
+
+  if ( (fd = daemon_connect(socket_path)) >= 0 ) {
+    fprintf(stderr, "A daemon is already running on %s\n", socket_path);
+    close(fd);
+    return FAILURE;
+  }
+
+  // Create the default runtime directory
+  if ( !strncmp(socket_path, DEVIA_RUN_DIR "/", strlen(DEVIA_RUN_DIR) + 1) )
+    mkdir(DEVIA_RUN_DIR, 0755);
+
+  // Remove stale socket
+  unlink(socket_path);
+
+  if ( (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ) {
+    perror("Unable to create socket");
+    return FAILURE;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_path);
+
+  if ( bind(fd, (struct sockaddr *)&address, sizeof(address)) || listen(fd, 16) ) {
+    perror(socket_path);
+    close(fd);
+    return FAILURE;
+  }
+
+  // Only owner and group may interact with devices through the daemon
+  chmod(socket_path, 0660);
+
+  return fd;
+}
+
+// Read one request line. Return NULL on error or empty request
+static sds read_request(int fd){
+  sds request = sdsempty();
+  char buffer[256];
+  int length;
+
+  while ( sdslen(request) < MAX_REQUEST_LENGTH ) {
+    length = read(fd, buffer, sizeof(buffer));
+    if ( length < 0 && errno == EINTR )
+      continue;
+    if ( length <= 0 )
+      break;
+    request = sdscatlen(request, buffer, length);
+    if ( memchr(buffer, '\n', length) )
+      break;
+  }
+
+  if ( strchr(request, '\n') )
+    sdsrange(request, 0, strchr(request, '\n') - request - 1);
+
+  if ( !sdslen(request) ) {
+    sdsfree(request);
+    return NULL;
+  }
+  return request;
+}
+
+static int write_all(int fd, const char *data, size_t length){
+  ssize_t written;
+
+  while ( length > 0 ) {
+    written = write(fd, data, length);
+    if ( written < 0 && errno == EINTR )
+      continue;
+    if ( written <= 0 )
+      return FAILURE;
+    data += written;
+    length -= written;
+  }
+  return SUCCESS;
+}
+
+// Parse an option of a request. Return FAILURE if it's unknown
+static int parse_option(const char *option, struct dispatch_options *options){
+  int value;
+
+  if ( sscanf(option, "--reconcile=%d", &value) == 1 )
+    options->reconcile_ms = value > 0 ? value : 0;
+  else if ( sscanf(option, "--coalesce=%d", &value) == 1 )
+    options->coalesce_ms = value > 0 ? value : 0;
+  else
+    return FAILURE;
+  return SUCCESS;
+}
+
+// Serve a single request from a client
+static void serve_request(int fd, GList **device_list, int jobs){
+  struct _device_identifier id;
+  struct dispatch_options options = { -1, -1 };
+  GList *matched, *iterator;
+  struct _device_list *entry;
+  sds request, output, attribute = NULL, action = NULL;
+  sds *argv, *arg, *reply;
+  int argc, args, i;
+
+  if ( !(request = read_request(fd)) )
+    return;
+
+  if ( info )
+    printf("Request: %s\n", request);
+
+  argv = sdssplitargs(request, &argc);
+  sdsfree(request);
+
+  // Options precede the identifier
+  for (arg = argv, args = argc; args > 0 && !strncmp(arg[0], "--", 2); arg++, args--)
+    if ( parse_option(arg[0], &options) )
+      break;
+
+  if ( !argv || args < 1 || !strncmp(arg[0], "--", 2) ) {
+    write_all(fd, "Invalid request\n", 16);
+    sdsfreesplitres(argv, argc);
+    return;
+  }
+
+  parse_identifier(arg[0], &id);
+  if ( args > 1 && sdslen(arg[1]) )
+    attribute = strtolower(arg[1]);
+  if ( args > 2 && sdslen(arg[2]) )
+    action = strtolower(arg[2]);
+  if ( action && args > 3 )
+    action = arg[2] = sdscatprintf(arg[2], " %s", arg[3]);
+
+  output = sdsempty();
+  pthread_mutex_lock(&device_list_mutex);
+  matched = resolve_devices(&id, device_list);
+  requests++;
+  pthread_mutex_unlock(&device_list_mutex);
+  if ( !matched )
+    output = sdscat(output, "No devices found\n");
+
+  reply = dispatch_actions(matched, attribute, action, jobs, &options);
+  for (i = 0, iterator = matched; iterator; iterator = iterator->next, i++) {
+    entry = (struct _device_list *)iterator->data;
+    output = sdscatprintf(output, "%s %s\n", entry->id, reply[i][0] ? reply[i] : "No reply");
+  }
+  dispatch_free(reply);
+
+  // Free the entries unplugged while in use, when the last request is done with them
+  pthread_mutex_lock(&device_list_mutex);
+  if ( !--requests ) {
+    g_list_free_full(retired, (GDestroyNotify)free_device_entry);
+    retired = NULL;
+  }
+  pthread_mutex_unlock(&device_list_mutex);
+
+  write_all(fd, output, sdslen(output));
+
+  if ( info )
+    cache_print_statistics();
+
+  sdsfree(output);
+  g_list_free(matched);
+  free_identifier(&id);
+  sdsfreesplitres(argv, argc);
+}
+
+// Listen for devices plugged in and unplugged. Return NULL if udev is not available
+static struct udev_monitor * hotplug_open(struct udev *udev){
+  struct udev_monitor *monitor;
+
+  if ( !udev || !(monitor = udev_monitor_new_from_netlink(udev, "udev")) )
+    return NULL;
+
+  udev_monitor_filter_add_match_subsystem_devtype(monitor, "hidraw", NULL);
+  udev_monitor_filter_add_match_subsystem_devtype(monitor, "usb", NULL);
+  udev_monitor_filter_add_match_subsystem_devtype(monitor, "w1", NULL);
+  if ( udev_monitor_enable_receiving(monitor) < 0 ) {
+    udev_monitor_unref(monitor);
+    return NULL;
+  }
+  return monitor;
+}
+
+// Apply udev events to the resident device list
+static void hotplug_event(struct udev_monitor *monitor, GList **device_list){
+  struct udev_device *device;
+  GList *added, *removed, *iterator;
+
+  while ( (device = udev_monitor_receive_device(monitor)) ) {
+    added = removed = NULL;
+    pthread_mutex_lock(&device_list_mutex);
+    hotplug_devices(device, NULL, device_list, &added, &removed);
+    udev_device_unref(device);
+
+    if ( info ) {
+      for (iterator = removed; iterator; iterator = iterator->next)
+        printf("Removed %s\n", ((struct _device_list *)iterator->data)->id);
+      for (iterator = added; iterator; iterator = iterator->next)
+        printf("Added %s\n", ((struct _device_list *)iterator->data)->id);
+    }
+
+    if ( requests )
+      retired = g_list_concat(retired, removed);
+    else
+      g_list_free_full(removed, (GDestroyNotify)free_device_entry);
+    pthread_mutex_unlock(&device_list_mutex);
+    g_list_free(added);
+  }
+}
+
+static void *serve_client(void *param){
+  struct client *client = (struct client *)param;
+
+  serve_request(client->fd, client->device_list, client->jobs);
+  close(client->fd);
+  free(client);
+
+  pthread_mutex_lock(&clients_mutex);
+  clients--;
+  pthread_cond_signal(&client_done);
+  pthread_mutex_unlock(&clients_mutex);
+  return NULL;
+}
+
+/*
+  Run as daemon: probe all interfaces once, and serve requests until killed.
+*/
+int daemon_serve(const char *socket_path, int jobs){
+  struct _device_identifier any;
+  GList *device_list = NULL;
+  struct client *client;
+  struct udev *udev;
+  struct udev_monitor *hotplug;
+  pthread_attr_t detached;
+  pthread_t thread;
+  int listen_fd, fd;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if ( (listen_fd = daemon_listen(socket_path)) < 0 )
+    return FAILURE;
+
+  strncpy(listen_path, socket_path, sizeof(listen_path) - 1);
+  signal(SIGTERM, daemon_terminate);
+  signal(SIGINT, daemon_terminate);
+
+  // Keep the sysfs index up to date, while running
+  sysfs_index_watch();
+
+  // Listen for hotplug before probing, so no device is missed
+  udev = udev_new();
+  if ( !(hotplug = hotplug_open(udev)) && info )
+    puts("Unable to listen for devices plugged in. The device list is left as probed");
+
+  memset(&any, 0, sizeof(any));
+  probe_devices(any, &device_list);
+
+  if ( info )
+    printf("Daemon listening on %s with %d resident devices\n", socket_path, g_list_length(device_list));
+
+  pthread_attr_init(&detached);
+  pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+
+  for(;;) {
+    struct pollfd listener[2] = {
+      { listen_fd, POLLIN, 0 },
+      { hotplug ? udev_monitor_get_fd(hotplug) : -1, POLLIN, 0 }
+    };
+
+    // Close HID devices, that has been idle while waiting
+    if ( poll(listener, 2, HID_POOL_IDLE_MS) == 0 ) {
+      hid_pool_expire();
+      continue;
+    }
+
+    if ( listener[1].revents & POLLIN )
+      hotplug_event(hotplug, &device_list);
+    if ( !( listener[0].revents & POLLIN ) )
+      continue;
+
+    fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if ( fd < 0 ) {
+      if ( errno == EINTR || errno == ECONNABORTED )
+        continue;
+      perror("Daemon accept failed");
+      break;
+    }
+
+    // Wait for a client to finish, when the limit is reached
+    pthread_mutex_lock(&clients_mutex);
+    while ( clients >= DAEMON_MAX_CLIENTS )
+      pthread_cond_wait(&client_done, &clients_mutex);
+    clients++;
+    pthread_mutex_unlock(&clients_mutex);
+
+    client = (struct client *)malloc(sizeof(struct client));
+    client->fd = fd;
+    client->device_list = &device_list;
+    client->jobs = jobs;
+    if ( pthread_create(&thread, &detached, serve_client, client) )
+      serve_client(client);
+  }
+
+  if ( hotplug )
+    udev_monitor_unref(hotplug);
+  if ( udev )
+    udev_unref(udev);
+  close(listen_fd);
+  unlink(socket_path);
+  return FAILURE;
+}
+
+/*
+  Forward a request to a running daemon, and print the reply.
+  The options given (not negative) are forwarded with the request.
+  Return FAILURE if no daemon is running, so the caller can do the work itself.
+*/
+int daemon_forward(const char *socket_path, const struct dispatch_options *options, const char *identifier, const char *attribute, const char *action){
+  sds request;
+  char buffer[1024];
+  int fd, length;
+
+  if ( (fd = daemon_connect(socket_path)) < 0 )
+    return FAILURE;
+
+  request = sdsempty();
+  if ( options->reconcile_ms >= 0 )
+    request = sdscatprintf(request, "--reconcile=%d ", options->reconcile_ms);
+  if ( options->coalesce_ms >= 0 )
+    request = sdscatprintf(request, "--coalesce=%d ", options->coalesce_ms);
+  request = sdscatrepr(request, identifier, strlen(identifier));
+  if ( attribute ) {
+    request = sdscat(request, " ");
+    request = sdscatrepr(request, attribute, strlen(attribute));
+  }
+  if ( attribute && action ) {
+    request = sdscat(request, " ");
+    request = sdscatrepr(request, action, strlen(action));
+  }
+  request = sdscat(request, "\n");
+
+  if ( write_all(fd, request, sdslen(request)) ) {
+    sdsfree(request);
+    close(fd);
+    return FAILURE;
+  }
+  sdsfree(request);
+
+  while ( (length = read(fd, buffer, sizeof(buffer))) != 0 ) {
+    if ( length < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      perror("Daemon connection");
+      break;
+    }
+    fwrite(buffer, 1, length, stdout);
+  }
+
+  close(fd);
+  return SUCCESS;
+}
@@ -0,0 +1,12 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+#include "dispatch.h"
+
+int daemon_serve(const char *socket_path, int jobs);
+int daemon_forward(const char *socket_path, const struct dispatch_options *options, const char *identifier, const char *attribute, const char *action);
+
+#endif
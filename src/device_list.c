@@ -1,6 +1,8 @@
 /* C */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <assert.h>
 
 // Application
@@ -9,9 +11,14 @@
 // Device headers
 #include "dummy_device.h"
 #include "relay_nuvoton.h"
+#include "relay_sainsmart16.h"
 #include "hidusb.h"
 #include "sysfs.h"
 #include "w1.h"
+#include "virtual.h"
+#include "hid_transport.h"
+#include "cache.h"
+#include "stats.h"
 
 // Dummy devices
 const struct _supported_device dummy_device[] = 
@@ -32,13 +39,15 @@ const struct _supported_device hidusb_device[] =
     "Nuvoton relay controler",
     "USB HID Relay controller 8-16 channels. Nuvoton/Winbond Electronics Corp",
     recognize_nuvoton,
-    action_nuvoton
+    action_nuvoton,
+    batch_nuvoton
   },
   {
-    "SaintSmart",
-    "USB HID Relay controller 8-16 channels. Sant smart devices",
-    NULL,
-    NULL
+    "Sainsmart 16 relay controler",
+    "USB HID Relay controller 16 channels. Sainsmart",
+    recognize_sainsmart16,
+    action_sainsmart16,
+    batch_sainsmart16
   },
   {
     "Not Nuvoton",
@@ -55,7 +64,9 @@ const struct _supported_device sysfs_device[] =
     "SysFS",
     "System kernel file system enabled device",
     NULL,
-    action_sysfs
+    action_sysfs,
+    NULL,
+    watch_sysfs
   },
   { NULL }
 };
@@ -71,6 +82,26 @@ const struct _supported_device onewire_device[] =
   { NULL }
 };
 
+// Simulated relay controllers. Indexed by board type
+const struct _supported_device virtual_device[] = 
+{
+  {
+    "Nuvoton relay controler",
+    "Simulated Nuvoton USB HID relay controller, 16 channels",
+    NULL,
+    action_nuvoton,
+    batch_nuvoton
+  },
+  {
+    "Sainsmart 16 relay controler",
+    "Simulated Sainsmart USB HID relay controller, 16 channels",
+    NULL,
+    action_sainsmart16,
+    batch_sainsmart16
+  },
+  { NULL }
+};
+
 const struct _supported_device serial_device[] = 
 {
   { NULL }
@@ -84,10 +115,269 @@ const struct _supported_device usb_device[] =
 const struct _supported_interface supported_interface[] =
 {
   {"dummy", "Internal test devices", probe_dummy, dummy_device},
-  {"hidusb", "HID USB devices", probe_hidusb, hidusb_device},
-  {"sysfs", "System kernel file system access",probe_sysfs, sysfs_device},
+  {"hidusb", "HID USB devices", probe_hidusb, hidusb_device, hotplug_hidusb, direct_hidusb, NULL},
+  {"sysfs", "System kernel file system access",probe_sysfs, sysfs_device, NULL, direct_sysfs},
   {"serial", "Serial (com/tty) devices", NULL, serial_device},
-  {"w1","one-wire interfaced devices", probe_w1, onewire_device},
+  {"w1","one-wire interfaced devices", probe_w1, onewire_device, hotplug_w1, direct_w1},
+  {"virtual", "Simulated relay controllers", probe_virtual, virtual_device, NULL, direct_virtual, &virtual_transport},
   {NULL}
 };
 
+
+/* 
+  Probe all interfaces that match the identifier, and add the recognized 
+  devices to the device list.
+*/
+int probe_devices(struct _device_identifier id, GList **device_list){
+  GList *last, *iterator, *probed = NULL;
+  uint64_t start = stats_start();
+
+  // Reuse the result of an identical probe, if the hardware is unchanged
+  if ( cache_load(&id, device_list) == SUCCESS ) {
+    stats_stop("cache load", NULL, start);
+    return SUCCESS;
+  }
+
+  last = g_list_last(*device_list);
+
+  for(int i = 0; supported_interface[i].name; i++) {
+    // Skip unwanted interfaces  
+    if ( id.interface && sdslen(id.interface) 
+      && strcmp(id.interface, supported_interface[i].name) ) 
+        continue;    
+
+    if ( !supported_interface[i].probe )
+      continue;
+
+    if ( info )
+      printf("Probing %s\n",  supported_interface[i].name);
+
+    start = stats_start();
+    supported_interface[i].probe(i, id, &probed);
+    stats_stop("probe", supported_interface[i].name, start);
+
+    // Remember which interface the new entries belong to
+    for (iterator = probed; iterator; iterator = iterator->next) 
+      ((struct _device_list *)iterator->data)->si_index = i;
+    *device_list = g_list_concat(*device_list, probed);
+    probed = NULL;
+  }
+
+  start = stats_start();
+  cache_save(&id, last ? last->next : *device_list);
+  stats_stop("cache save", NULL, start);
+  return SUCCESS;
+}
+
+/*
+  Fast path for an identifier, that names exactly one device: The interface
+  opens and verifies the device directly, without probing.
+  Return FAILURE if the interface can't, so the caller must probe.
+*/
+int open_devices(struct _device_identifier id, GList **device_list){
+  GList *opened = NULL;
+  uint64_t start = stats_start();
+
+  if ( !id.interface || !sdslen(id.interface) )
+    return FAILURE;
+
+  for(int i = 0; supported_interface[i].name; i++) {
+    if ( strcmp(id.interface, supported_interface[i].name) )
+      continue;
+
+    if ( !supported_interface[i].direct || supported_interface[i].direct(i, id, &opened) )
+      break;
+
+    stats_stop("open direct", supported_interface[i].name, start);
+    if ( info )
+      printf("Opened %s directly\n", supported_interface[i].name);
+    for (GList *iterator = opened; iterator; iterator = iterator->next) 
+      ((struct _device_list *)iterator->data)->si_index = i;
+    *device_list = g_list_concat(*device_list, opened);
+    return SUCCESS;
+  }
+
+  g_list_free_full(opened, (GDestroyNotify)free_device_entry);
+  return FAILURE;
+}
+
+/*
+  Update the device list, from a single udev add or remove event.
+  Only the affected entries are changed. Entries that are removed from the
+  device list are appended to <removed>, and must be freed by the caller.
+  New entries that match the identifier, are added to the device list and to
+  <added>. No interfaces are probed.
+*/
+int hotplug_devices(struct udev_device *device, struct _device_identifier *id, GList **device_list, GList **added, GList **removed){
+  GList *created, *iterator;
+  struct _device_list *entry;
+
+  for(int i = 0; supported_interface[i].name; i++) {
+    if ( !supported_interface[i].hotplug )
+      continue;
+
+    created = NULL;
+    supported_interface[i].hotplug(i, device, device_list, &created, removed);
+
+    for (iterator = created; iterator; iterator = iterator->next) {
+      entry = (struct _device_list *)iterator->data;
+      entry->si_index = i;
+      if ( id && !match_identifier(entry, id) ) {
+        free_device_entry(entry);
+        continue;
+      }
+      *device_list = g_list_append(*device_list, entry);
+      *added = g_list_append(*added, entry);
+    }
+    g_list_free(created);
+  }
+  return SUCCESS;
+}
+
+// Split a <interface>#<device id>#<port>#<device path> string into an identifier
+int parse_identifier(const char *str, struct _device_identifier *id){
+  int length;
+  sds *sds_array;
+
+  memset(id, 0, sizeof(struct _device_identifier));
+  if ( !str ) 
+    return FAILURE;
+
+  sds_array = sdssplitlen(str, strlen(str), "#", 1, &length);
+  do {
+    if(length < 1) break;
+    id->interface = sdsnew(sds_array[0]);
+    if(length < 2) break;
+    id->device_id = sdsnew(sds_array[1]);
+    if(length < 3) break; 
+    id->port = sdsnew(sds_array[2]);            
+    if(length < 4) break; 
+    id->device_path = sdsnew(sds_array[3]);
+  }while ( 0 );
+  sdsfreesplitres(sds_array, length); 
+
+  return SUCCESS;
+}
+
+void free_identifier(struct _device_identifier *id){
+  sdsfree(id->interface);
+  sdsfree(id->device_id);
+  sdsfree(id->port);
+  sdsfree(id->device_path);
+  memset(id, 0, sizeof(struct _device_identifier));
+}
+
+/* 
+  Test if an already probed device, matches the identifier.
+  Empty parts of the identifier are wildcards. The device id parts are 
+  compared field by field, separated by ':' 
+*/
+int match_identifier(struct _device_list *entry, struct _device_identifier *id){
+  int length, id_length;
+  sds *sds_array, *id_array;
+  const char *device_id;
+  int match = true;
+
+  if ( id->interface && sdslen(id->interface) 
+    && strcmp(id->interface, supported_interface[entry->si_index].name) )
+    return false;
+
+  // Skip the interface part of the entry id
+  device_id = strchr(entry->id, '#') ? strchr(entry->id, '#') + 1 : entry->id;
+  sds_array = sdssplitlen(device_id, strlen(device_id), "#", 1, &length);
+
+  if ( id->device_id && sdslen(id->device_id) ) {
+    sds *fields;
+    int fields_length;
+
+    fields = length ? sdssplitlen(sds_array[0], sdslen(sds_array[0]), ":", 1, &fields_length) : NULL;
+    if ( !fields ) fields_length = 0;
+    id_array = sdssplitlen(id->device_id, sdslen(id->device_id), ":", 1, &id_length);
+    for(int i = 0; match && i < id_length; i++) 
+      if ( sdslen(id_array[i]) && ( i >= fields_length || strcasecmp(id_array[i], fields[i]) ) )
+        match = false;
+    sdsfreesplitres(id_array, id_length); 
+    sdsfreesplitres(fields, fields_length); 
+  }
+
+  if ( match && id->port && sdslen(id->port) 
+    && ( length < 2 || strcmp(id->port, sds_array[1]) ) )
+    match = false;
+
+  if ( match && id->device_path && sdslen(id->device_path) 
+    && ( !entry->path || strcmp(id->device_path, entry->path) ) )
+    match = false;
+
+  sdsfreesplitres(sds_array, length); 
+  return match;
+}
+
+/*
+  Find already probed devices matching the identifier.
+  If there are none (ex. sysfs paths, that are only probed on request) the
+  identifier is probed, and new devices are added to the device list.
+  Return a list of matched devices. Free it with g_list_free()
+*/
+GList * resolve_devices(struct _device_identifier *id, GList **device_list){
+  GList *matched = NULL, *probed = NULL, *iterator, *resident;
+  struct _device_list *entry;
+
+  for (iterator = *device_list; iterator; iterator = iterator->next)
+    if ( match_identifier((struct _device_list *)iterator->data, id) )
+      matched = g_list_append(matched, iterator->data);
+
+  if ( matched )
+    return matched;
+
+  if ( open_devices(*id, &probed) )
+    probe_devices(*id, &probed);
+  for (iterator = probed; iterator; iterator = iterator->next) {
+    entry = (struct _device_list *)iterator->data;
+
+    for (resident = *device_list; resident; resident = resident->next)
+      if ( !strcmp(entry->id, ((struct _device_list *)resident->data)->id)
+        && !strcmp(entry->name, ((struct _device_list *)resident->data)->name) )
+        break;
+
+    if ( resident ) {
+      free_device_entry(entry);
+      entry = (struct _device_list *)resident->data;
+    } else
+      *device_list = g_list_append(*device_list, entry);
+
+    matched = g_list_append(matched, entry);
+  }
+  g_list_free(probed);
+
+  return matched;
+}
+
+void free_device_entry(struct _device_list *entry){
+  sdsfree(entry->name);
+  sdsfree(entry->id);
+  sdsfree(entry->port);
+  sdsfree(entry->path);
+  sdsfree(entry->group);
+  sdsfree(entry->reply);
+  free(entry);
+}
+
+static const char *sysfs_root_path = "";
+
+/*
+  Relocate the sysfs tree, to a synthetic tree. Only called by the benchmark;
+  devia itself always uses /sys.
+*/
+void sysfs_set_root(const char *root){
+  sysfs_root_path = root;
+}
+
+// Root of the sysfs tree. Empty, unless relocated by the benchmark
+const char * sysfs_root(void){
+  return sysfs_root_path;
+}
+
+// Return the path to a sysfs file, ex. "/sys/devices", within the sysfs root
+sds sysfs_path(const char *path){
+  return sdscatprintf(sdsempty(), "%s%s", sysfs_root(), path);
+}
@@ -0,0 +1,313 @@
+/*
+
+  Dispatch actions to multiple devices
+
+  When an identifier matches several devices, the actions are run
+  concurrently on a bounded pool of worker threads, so the total time
+  approaches that of the slowest device, rather than the sum of all.
+
+  Replies are returned in the order of the device list, regardless of
+  the order in which the devices finish.
+
+  Actions on a device that can perform several actions as one, are queued
+  per device. When several requests hit the same device at about the same
+  time (ex. concurrent daemon clients), the first waits coalesce_ms for
+  more to arrive, and then performs all queued actions as one. It only waits
+  if other callers are on their way to the same queue. Actions that arrive
+  while the device is busy, are performed together next. Each caller gets
+  its own reply. A queue is freed, when its last caller is done.
+
+  A request may have its own --reconcile and --coalesce settings. Actions
+  performed as one, trust the shadow relay state for the shortest time any
+  of them asked for.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+
+/* Unix */
+#include <unistd.h>
+#include <pthread.h>
+
+/* Linux */
+#include <glib.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#include "hid_transport.h"
+#include "dispatch.h"
+
+// Actions waiting to be performed on a device
+struct action_queue {
+  sds id;
+  pthread_mutex_t mutex;
+  pthread_cond_t done;
+  GList *pending;
+  int busy;                             // Actions are being performed
+  int users;                            // Callers holding the queue (queues_mutex)
+};
+
+struct queued_action {
+  sds attribute;
+  sds action;
+  sds reply;
+  int reconcile_ms;
+  int done;
+};
+
+int coalesce_ms = 0;
+
+static GList *queues = NULL;
+static pthread_mutex_t queues_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct workpool {
+  pthread_mutex_t mutex;
+  int next;                             // Next work item to hand out
+  int count;
+  void (*work)(void *context, int index);
+  void *context;
+};
+
+static void *worker(void *param){
+  struct workpool *pool = (struct workpool *)param;
+  int index;
+
+  for(;;) {
+    pthread_mutex_lock(&pool->mutex);
+    index = pool->next < pool->count ? pool->next++ : -1;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if ( index < 0 )
+      break;
+    pool->work(pool->context, index);
+  }
+  return NULL;
+}
+
+/*
+  Call work(context, index) for index 0 to count-1, on at most <jobs> threads.
+  The calling thread is one of the workers. Return when all work is done.
+*/
+int workpool_run(int jobs, int count, void (*work)(void *context, int index), void *context){
+  struct workpool pool;
+  pthread_t *threads;
+  int started = 0;
+
+  if ( jobs > count )
+    jobs = count;
+
+  // Nothing to gain from threads
+  if ( jobs <= 1 ) {
+    for (int i = 0; i < count; i++)
+      work(context, i);
+    return SUCCESS;
+  }
+
+  memset(&pool, 0, sizeof(pool));
+  pthread_mutex_init(&pool.mutex, NULL);
+  pool.count = count;
+  pool.work = work;
+  pool.context = context;
+
+  threads = (pthread_t *)malloc(sizeof(pthread_t) * (jobs - 1));
+  for (int i = 0; i < jobs - 1; i++)
+    if ( !pthread_create(&threads[started], NULL, worker, &pool) )
+      started++;
+
+  worker(&pool);
+
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  free(threads);
+  pthread_mutex_destroy(&pool.mutex);
+  return SUCCESS;
+}
+
+struct action_context {
+  struct _device_list **device;
+  sds attribute;
+  sds action;
+  sds *reply;
+  struct dispatch_options options;
+};
+
+// Find or create the action queue of a device. Release it with release_queue
+static struct action_queue * action_queue(struct _device_list *device){
+  struct action_queue *queue = NULL;
+  GList *iterator;
+
+  pthread_mutex_lock(&queues_mutex);
+  for (iterator = queues; iterator; iterator = iterator->next) {
+    queue = (struct action_queue *)iterator->data;
+    if ( !strcmp(queue->id, device->id) )
+      break;
+  }
+  if ( !iterator ) {
+    queue = (struct action_queue *)malloc(sizeof(struct action_queue));
+    memset(queue, 0, sizeof(struct action_queue));
+    queue->id = sdsdup(device->id);
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->done, NULL);
+    queues = g_list_prepend(queues, queue);
+  }
+  queue->users++;
+  pthread_mutex_unlock(&queues_mutex);
+  return queue;
+}
+
+// Free the queue, when the last caller is done with it
+static void release_queue(struct action_queue *queue){
+  pthread_mutex_lock(&queues_mutex);
+  if ( --queue->users == 0 ) {
+    queues = g_list_remove(queues, queue);
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->done);
+    sdsfree(queue->id);
+    free(queue);
+  }
+  pthread_mutex_unlock(&queues_mutex);
+}
+
+// Return true if other callers hold the queue, and may add actions to it
+static int other_users(struct action_queue *queue){
+  int others;
+
+  pthread_mutex_lock(&queues_mutex);
+  others = queue->users > 1;
+  pthread_mutex_unlock(&queues_mutex);
+  return others;
+}
+
+/*
+  Queue an action on a device, and wait for it to be performed, together with
+  the other actions queued on the device.
+*/
+static void coalesce_action(struct _device_list *device, sds attribute, sds action, sds *reply, const struct dispatch_options *options){
+  struct action_queue *queue = action_queue(device);
+  struct queued_action queued, **batch;
+  sds *attributes, *actions, *replies;
+  GList *taken, *iterator;
+  int count, i, reconcile_ms;
+
+  memset(&queued, 0, sizeof(queued));
+  queued.attribute = attribute;
+  queued.action = action;
+  queued.reply = *reply;
+  queued.reconcile_ms = options->reconcile_ms;
+
+  pthread_mutex_lock(&queue->mutex);
+  queue->pending = g_list_append(queue->pending, &queued);
+  while ( !queued.done && queue->busy )
+    pthread_cond_wait(&queue->done, &queue->mutex);
+
+  if ( queued.done ) {
+    pthread_mutex_unlock(&queue->mutex);
+    release_queue(queue);
+    *reply = queued.reply;
+    return;
+  }
+
+  // Perform the queued actions, after waiting for more to arrive
+  queue->busy = true;
+  if ( options->coalesce_ms > 0 && other_users(queue) ) {
+    pthread_mutex_unlock(&queue->mutex);
+    usleep(options->coalesce_ms * 1000);
+    pthread_mutex_lock(&queue->mutex);
+  }
+  taken = queue->pending;
+  queue->pending = NULL;
+  pthread_mutex_unlock(&queue->mutex);
+
+  count = g_list_length(taken);
+  batch = (struct queued_action **)malloc(sizeof(struct queued_action *) * count);
+  attributes = (sds *)malloc(sizeof(sds) * count * 3);
+  actions = attributes + count;
+  replies = attributes + count * 2;
+  reconcile_ms = options->reconcile_ms;
+  for (i = 0, iterator = taken; iterator; iterator = iterator->next, i++) {
+    batch[i] = (struct queued_action *)iterator->data;
+    attributes[i] = batch[i]->attribute;
+    actions[i] = batch[i]->action;
+    replies[i] = batch[i]->reply;
+    if ( batch[i]->reconcile_ms < reconcile_ms )
+      reconcile_ms = batch[i]->reconcile_ms;
+  }
+  if ( info && count > 1 )
+    printf("Performing %d queued actions on %s as one\n", count, device->id);
+
+  hid_reconcile_thread(reconcile_ms);
+  device->batch(device, count, attributes, actions, replies);
+  hid_reconcile_thread(-1);
+
+  pthread_mutex_lock(&queue->mutex);
+  for (i = 0; i < count; i++) {
+    batch[i]->reply = replies[i];
+    batch[i]->done = true;
+  }
+  queue->busy = false;
+  pthread_cond_broadcast(&queue->done);
+  pthread_mutex_unlock(&queue->mutex);
+
+  g_list_free(taken);
+  free(attributes);
+  free(batch);
+  release_queue(queue);
+  *reply = queued.reply;
+}
+
+static void action_work(void *param, int index){
+  struct action_context *context = (struct action_context *)param;
+  struct _device_list *device = context->device[index];
+
+  context->reply[index] = sdsempty();
+  if ( device->batch )
+    coalesce_action(device, context->attribute, context->action, &context->reply[index], &context->options);
+  else {
+    hid_reconcile_thread(context->options.reconcile_ms);
+    device->action(device, context->attribute, context->action, &context->reply[index]);
+    hid_reconcile_thread(-1);
+  }
+}
+
+/*
+  Run the action on all devices in the list, using up to <jobs> threads.
+  <options> may be NULL, to use the settings of the process.
+  Return an array of replies, in list order. Free with dispatch_free()
+*/
+sds *dispatch_actions(GList *device_list, sds attribute, sds action, int jobs, const struct dispatch_options *options){
+  struct action_context context;
+  GList *iterator;
+  int count = g_list_length(device_list), i = 0;
+
+  context.device = (struct _device_list **)malloc(sizeof(struct _device_list *) * (count + 1));
+  context.reply = (sds *)malloc(sizeof(sds) * (count + 1));
+  context.attribute = attribute;
+  context.action = action;
+  context.options.reconcile_ms = options && options->reconcile_ms >= 0 ? options->reconcile_ms : hid_reconcile_ms;
+  context.options.coalesce_ms = options && options->coalesce_ms >= 0 ? options->coalesce_ms : coalesce_ms;
+
+  for (iterator = device_list; iterator; iterator = iterator->next)
+    context.device[i++] = (struct _device_list *)iterator->data;
+
+  // Keep diagnostic output readable
+  if ( info )
+    jobs = 1;
+
+  workpool_run(jobs, count, action_work, &context);
+
+  context.reply[count] = NULL;
+  free(context.device);
+  return context.reply;
+}
+
+void dispatch_free(sds *reply){
+  for (int i = 0; reply[i]; i++)
+    sdsfree(reply[i]);
+  free(reply);
+}
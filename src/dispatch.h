@@ -0,0 +1,23 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+// Default number of devices interacted with concurrently
+#define DEFAULT_JOBS 8
+
+extern int coalesce_ms;
+
+// Settings of a single request, ex. from a daemon client. Negative values use the settings of the process
+struct dispatch_options {
+  int reconcile_ms;             // --reconcile
+  int coalesce_ms;              // --coalesce
+};
+
+int workpool_run(int jobs, int count, void (*work)(void *context, int index), void *context);
+sds *dispatch_actions(GList *device_list, sds attribute, sds action, int jobs, const struct dispatch_options *options);
+void dispatch_free(sds *reply);
+
+#endif
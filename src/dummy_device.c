@@ -35,10 +35,11 @@ int probe_dummy(int si_index, struct _device_identifier id, GList **device_list)
     if ( supported_interface[si_index].device[sdl_index].name ) {
       // Create a new entry in active device list, and push it infront of the list
       entry = (struct _device_list*)malloc(sizeof(struct _device_list)); 
+      memset(entry, 0, sizeof(struct _device_list));
       entry->name   = sdscatprintf(sdsnew(supported_device->name), " - Device #%d",i);
       entry->id     = sdscatprintf(sdsempty(), "123-%d",i);
       entry->path   = sdsnew("no path");
-      entry->group   = (char *)"No group";
+      entry->group   = sdsnew("No group");
       entry->action = supported_device->action;
       *device_list = g_list_append(*device_list, entry);
 
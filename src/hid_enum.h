@@ -0,0 +1,59 @@
+#ifndef HID_ENUM_H
+#define HID_ENUM_H
+
+/* Linux */
+#include <libudev.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+// A USB HID device, as described by udev
+struct hidraw_device_info {
+  sds sysfs_path;                 // Kernel path to the hidraw device
+  sds port;                       // USB interface, the device is attached to (ex. 1-1.4:1.0)
+  sds device_node;                // hidraw device node (ex. /dev/hidraw0)
+  sds parent_device_node;         // USB device node (ex. /dev/bus/usb/001/004)
+  unsigned short vendor_id;
+  unsigned short product_id;
+  unsigned short release_number;
+  int interface_number;
+  sds serial_number;              // NULL if the device has none
+  sds manufacturer;               // NULL if the device has none
+  sds product;                    // NULL if the device has none
+  struct hidraw_device_info *next;
+};
+
+/*
+  The criterias of a device identifier, compiled once for the enumerators.
+  Zero or NULL criterias match any device.
+*/
+struct hid_match {
+  unsigned short vendor_id;
+  unsigned short product_id;
+  sds port;                       // USB interface (ex. 1-1.4:1.0)
+  sds serial_number;
+  sds manufacturer;
+};
+
+struct hid_device_info;
+
+void hid_match_compile(struct _device_identifier *id, struct hid_match *match);
+void hid_match_free(struct hid_match *match);
+struct hidraw_device_info * hidraw_device_info_new(struct udev_device *hidraw);
+int enumerate_hidraw_devices(const struct hid_match *match, struct hidraw_device_info **list);
+void free_enumerate_hid_devices(struct hidraw_device_info *device);
+
+// Extension of hidapi (libusb): hid_enumerate with all the criterias
+#ifdef __cplusplus
+extern "C"
+#endif
+struct hid_device_info * hid_enumerate_matching(const struct hid_match *match);
+
+// Extension of hidapi (libusb): Count the input reports queued and dropped
+#ifdef __cplusplus
+extern "C"
+#endif
+int hid_get_input_statistics(hid_device *dev, unsigned long *received, unsigned long *dropped);
+
+#endif
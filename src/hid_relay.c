@@ -0,0 +1,264 @@
+/*
+  HID relay protocol codec
+
+  Nuvoton, Sainsmart and similar USB HID relay controllers exchange the same
+  16 byte reports:
+
+    0:      Command: 0xD2 read relay state, 0xC3 set relay state
+    1:      Length, excluding the checksum (14)
+    2-3:    Relay bitmap
+    4-9:    Reserved. A read request is padded with 0x11
+    10-13:  Signature "HIDC"
+    14-15:  Checksum: 16 bit sum of byte 0-13, LSB first
+
+  The boards differ only in the byte order of the bitmap, and the bit
+  position of each relay in it, when reading and when writing. A board is
+  described by an entry in hid_relay_protocol[].
+
+  From the description, tables are computed on first use: Lookup tables that
+  translate each bitmap byte to relays and back, with the byte order and bit
+  permutation folded in, and report templates with a precomputed checksum.
+  Encoding a report is then a copy, two lookups and an add.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Unix */
+#include <pthread.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+#include "stats.h"
+#include "hid_transport.h"
+#include "relay_command.h"
+#include "pulse.h"
+
+#include "hid_relay.h"
+
+// Bit position of each Sainsmart relay, in the bitmap it replies with
+static const uint8_t sainsmart16_read_bit_pos[] = {7 , 8 , 6 , 9 , 5 , 10, 4 , 11, 3 , 12, 2 , 13, 1 , 14, 0 , 15};
+
+// Indexed by HID_RELAY_<board>
+struct _hid_relay_protocol hid_relay_protocol[] = {
+  { "Nuvoton", HID_RELAY_MSB_FIRST, HID_RELAY_LSB_FIRST, NULL, NULL },
+  { "Sainsmart16", HID_RELAY_LSB_FIRST, HID_RELAY_LSB_FIRST, sainsmart16_read_bit_pos, NULL },
+  { NULL }
+};
+
+static unsigned char write_template[HID_RELAY_REPORT_SIZE];
+static unsigned char reply_template[HID_RELAY_REPORT_SIZE];
+static pthread_once_t prepared = PTHREAD_ONCE_INIT;
+
+// Sum of byte 0-13
+static uint16_t checksum(const unsigned char *report){
+  uint16_t sum = 0;
+
+  for (int i = 0; i < HID_RELAY_REPORT_SIZE - 2; i++)
+    sum += report[i];
+  return sum;
+}
+
+static void set_checksum(unsigned char *report, uint16_t sum){
+  report[14] = sum & 0xFF;
+  report[15] = sum >> 8;
+}
+
+// A report without checksum. The bitmap is padding too
+static void frame(unsigned char *report, uint8_t cmd, uint8_t padding){
+  memset(report, padding, HID_RELAY_REPORT_SIZE);
+  report[0] = cmd;
+  report[1] = HID_RELAY_REPORT_SIZE - 2;
+  memcpy(report + 10, "HIDC", 4);
+}
+
+/*
+  Fill the tables that translate between the relay state and the two bitmap
+  bytes of a report (byte 2 and 3). <encode> gives the bitmap bytes as byte 2 in
+  the low and byte 3 in the high byte.
+*/
+static void build_tables(int order, const uint8_t *bit_pos, uint16_t decode[2][256], uint16_t encode[2][256]){
+  int bit, byte;
+
+  memset(decode, 0, sizeof(uint16_t) * 2 * 256);
+  memset(encode, 0, sizeof(uint16_t) * 2 * 256);
+  for (int relay = 0; relay < 16; relay++) {
+    bit = bit_pos ? bit_pos[relay] : relay;
+    byte = ( bit >> 3 ) ^ ( order == HID_RELAY_MSB_FIRST );
+    for (int value = 0; value < 256; value++) {
+      if ( value & ( 1 << ( bit & 7 ) ) )
+        decode[byte][value] |= 1 << relay;
+      if ( value & ( 1 << ( relay & 7 ) ) )
+        encode[relay >> 3][value] |= 1 << ( byte * 8 + ( bit & 7 ) );
+    }
+  }
+}
+
+static void prepare(void){
+  struct _hid_relay_protocol *protocol;
+
+  frame(write_template, HID_RELAY_WRITE, 0x00);
+  frame(reply_template, HID_RELAY_READ, 0x00);
+
+  for (protocol = hid_relay_protocol; protocol->name; protocol++) {
+    build_tables(protocol->read_order, protocol->read_bit_pos, protocol->read_decode, protocol->read_encode);
+    build_tables(protocol->write_order, protocol->write_bit_pos, protocol->write_decode, protocol->write_encode);
+
+    frame(protocol->read_request, HID_RELAY_READ, 0x11);
+    set_checksum(protocol->read_request, checksum(protocol->read_request));
+    protocol->write_sum = checksum(write_template);
+    protocol->reply_sum = checksum(reply_template);
+  }
+}
+
+// Put the bitmap of the relay state and the checksum into a report template
+static void encode(const unsigned char *report_template, uint16_t sum, uint16_t table[2][256], int relay_state, unsigned char *report){
+  uint16_t bitmap = table[0][relay_state & 0xFF] | table[1][( relay_state >> 8 ) & 0xFF];
+
+  memcpy(report, report_template, HID_RELAY_REPORT_SIZE);
+  report[2] = bitmap & 0xFF;
+  report[3] = bitmap >> 8;
+  set_checksum(report, sum + report[2] + report[3]);
+}
+
+void hid_relay_read_request(struct _hid_relay_protocol *protocol, unsigned char *report){
+  pthread_once(&prepared, prepare);
+  memcpy(report, protocol->read_request, HID_RELAY_REPORT_SIZE);
+}
+
+void hid_relay_write_request(struct _hid_relay_protocol *protocol, int relay_state, unsigned char *report){
+  pthread_once(&prepared, prepare);
+  encode(write_template, protocol->write_sum, protocol->write_encode, relay_state, report);
+}
+
+// Relay state of a reply to a read request
+int hid_relay_decode_reply(struct _hid_relay_protocol *protocol, const unsigned char *report){
+  pthread_once(&prepared, prepare);
+  return protocol->read_decode[0][report[2]] | protocol->read_decode[1][report[3]];
+}
+
+// Check the length, signature and checksum of a report. Return FAILURE if invalid
+int hid_relay_verify(const unsigned char *report, size_t length){
+  if ( length != HID_RELAY_REPORT_SIZE || memcmp(report + 10, "HIDC", 4) )
+    return FAILURE;
+  if ( ( report[14] | ( report[15] << 8 ) ) != checksum(report) )
+    return FAILURE;
+  return SUCCESS;
+}
+
+// The reply of a board to a read request
+void hid_relay_reply(struct _hid_relay_protocol *protocol, int relay_state, unsigned char *report){
+  pthread_once(&prepared, prepare);
+  encode(reply_template, protocol->reply_sum, protocol->read_encode, relay_state, report);
+}
+
+// Relay state of a write request
+int hid_relay_decode_write(struct _hid_relay_protocol *protocol, const unsigned char *report){
+  pthread_once(&prepared, prepare);
+  return protocol->write_decode[0][report[2]] | protocol->write_decode[1][report[3]];
+}
+
+static int get_relay_state(struct _hid_relay_protocol *protocol, struct _hid_connection *connection, int *relay_state){
+  unsigned char request[HID_RELAY_REPORT_SIZE], reply[HID_RELAY_REPORT_SIZE];
+
+  hid_relay_read_request(protocol, request);
+  if ( info )
+    printf("Sending HID repport:  %s\n", sdsbytes2hex(request, sizeof(request), 4));
+
+  memset(reply, 0, sizeof(reply));
+  if ( hid_request(connection, request, sizeof(request), reply, sizeof(reply)) <= 0 )
+    return FAILURE;
+
+  *relay_state = hid_relay_decode_reply(protocol, reply);
+
+  if ( info ) {
+    printf("Recieved HID repport: %s\n", sdsbytes2hex(reply, sizeof(reply), 4));
+    printf("Relay state = %s\n", sdsint2bin(*relay_state, 16));
+  }
+  return SUCCESS;
+}
+
+static int set_relay_state(struct _hid_relay_protocol *protocol, struct _hid_connection *connection, int relay_state){
+  unsigned char request[HID_RELAY_REPORT_SIZE];
+  uint64_t start;
+
+  hid_relay_write_request(protocol, relay_state, request);
+
+  if ( info ) {
+    printf("Send HID repport:     %s\n", sdsbytes2hex(request, sizeof(request), 4));
+    printf("Relay state = %s\n", sdsint2bin(relay_state, 16));
+  }
+
+  start = stats_start();
+  if ( hid_send(connection, request, sizeof(request)) < 0 )
+    return FAILURE;
+  stats_stop("hid write", NULL, start);
+  return SUCCESS;
+}
+
+/*
+  Perform a list of actions on a relay controller, as a single read-modify-write of the relay state.
+  Each reply reflects the relay state after its action.
+*/
+int hid_relay_batch(struct _hid_relay_protocol *protocol, struct _device_list *device, int count, sds *attribute, sds *action, sds *reply){
+  int relay_state;
+  int changed = false;
+  int result = SUCCESS;
+  struct _hid_connection *connection;
+  struct _relay_command *command;
+
+  if ( !(connection = hid_connect(device)) ) {
+    fprintf(stderr, "Unable to open HID device %s\n", device->port);
+    return FAILURE;
+  }
+
+  // Read the relay state, unless the shadow is recent
+  if ( hid_shadow_get(connection, &relay_state) ) {
+    if ( info )
+      puts("Reading relay state:");
+    if ( get_relay_state(protocol, connection, &relay_state) ) {
+      fprintf(stderr, "Unable to read HID device %s\n", device->port);
+      hid_disconnect(connection, true);
+      return FAILURE;
+    }
+    hid_shadow_set(connection, relay_state, true);
+  }
+
+  command = (struct _relay_command *)malloc(sizeof(struct _relay_command) * count);
+  for (int i = 0; i < count; i++) {
+    if ( relay_command_parse(attribute[i], action[i], &command[i]) ) {
+      reply[i] = sdscatprintf(reply[i], "Invalid relay %s %s", attribute[i] ? : "", action[i] ? : "");
+      memset(&command[i], 0, sizeof(struct _relay_command));
+      result = FAILURE;
+      continue;
+    }
+    relay_state = relay_command_apply(&command[i], relay_state);
+    if ( relay_command_changes(&command[i]) )
+      changed = true;
+    reply[i] = relay_command_reply(reply[i], attribute[i], &command[i], relay_state);
+  }
+
+  if ( changed ) {
+    if ( info )
+      puts("Setting relay state:");
+    if ( set_relay_state(protocol, connection, relay_state) ) {
+      fprintf(stderr, "Unable to write to HID device %s\n", device->port);
+      hid_disconnect(connection, true);
+      free(command);
+      return FAILURE;
+    }
+    hid_shadow_set(connection, relay_state, false);
+  }
+
+  hid_disconnect(connection, false);
+
+  // Time the pulses from the write, that started them
+  for (int i = 0; i < count; i++)
+    pulse_schedule(device, &command[i]);
+  free(command);
+  return result;
+}
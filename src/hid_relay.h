@@ -0,0 +1,58 @@
+#ifndef HID_RELAY_H
+#define HID_RELAY_H
+
+/* C */
+#include <stdint.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#define HID_RELAY_REPORT_SIZE 16
+#define HID_RELAY_READ  0xD2        // Read relay state command
+#define HID_RELAY_WRITE 0xC3        // Set relay state command
+
+// Byte order of the relay bitmap in a report
+#define HID_RELAY_LSB_FIRST 0
+#define HID_RELAY_MSB_FIRST 1
+
+// Index of each protocol in hid_relay_protocol[]
+#define HID_RELAY_NUVOTON     0
+#define HID_RELAY_SAINSMART16 1
+
+/*
+  Wire format of a family of 16 byte "HIDC" relay controllers.
+  Variants differ only in the byte order of the relay bitmap, and in the bit
+  position of each relay in it.
+*/
+struct _hid_relay_protocol {
+  const char *name;
+  int read_order;                 // Byte order of the bitmap replied to a read request
+  int write_order;                // Byte order of the bitmap written
+  const uint8_t *read_bit_pos;    // Bit of each relay in the bitmap read. NULL if bit n is relay n
+  const uint8_t *write_bit_pos;   // Bit of each relay in the bitmap written. NULL if bit n is relay n
+
+  // Computed from the above, on first use
+  uint16_t read_decode[2][256];   // Relays set by each of the two bitmap bytes of a reply
+  uint16_t read_encode[2][256];   // Bitmap bytes of a reply, from each byte of the relay state
+  uint16_t write_decode[2][256];  // Relays set by each of the two bitmap bytes written
+  uint16_t write_encode[2][256];  // Bitmap bytes written, from each byte of the relay state
+  unsigned char read_request[HID_RELAY_REPORT_SIZE];
+  uint16_t write_sum;             // Checksum of a write request, without the bitmap
+  uint16_t reply_sum;             // Checksum of a reply, without the bitmap
+};
+
+extern struct _hid_relay_protocol hid_relay_protocol[];
+
+// Host side
+void hid_relay_read_request(struct _hid_relay_protocol *protocol, unsigned char *report);
+void hid_relay_write_request(struct _hid_relay_protocol *protocol, int relay_state, unsigned char *report);
+int hid_relay_decode_reply(struct _hid_relay_protocol *protocol, const unsigned char *report);
+
+// Device side
+int hid_relay_verify(const unsigned char *report, size_t length);
+void hid_relay_reply(struct _hid_relay_protocol *protocol, int relay_state, unsigned char *report);
+int hid_relay_decode_write(struct _hid_relay_protocol *protocol, const unsigned char *report);
+
+int hid_relay_batch(struct _hid_relay_protocol *protocol, struct _device_list *device, int count, sds *attribute, sds *action, sds *reply);
+#endif
@@ -0,0 +1,345 @@
+/*
+  HID report transport
+
+  Relay drivers exchange reports with their device through the transport of
+  the interface, the device was found on. Real USB devices are reached through
+  HIDAPI, or directly through the kernel hidraw device with --transport=hidraw.
+  Simulated devices answer in process.
+
+  Opening a HIDAPI device is expensive: The USB devices are listed, the kernel
+  driver detached, the interface claimed and its input transfer started. Open
+  devices are therefore kept in a pool, keyed by port, and reused by the next
+  action on the same device. A connection that fails is closed, and reopened
+  by the next user. Connections that are idle for HID_POOL_IDLE_MS are closed
+  by hid_pool_expire().
+
+  A request is answered, as soon as the input report arrives. The time to
+  wait for it is learned from the round trip times of the device, the way
+  TCP does: The smoothed round trip time plus four times its variation. A
+  request that times out is sent again, with the double timeout.
+
+  The connection also keeps a shadow of the relay state. Drivers use it in
+  place of reading the state before a write, and to answer reads. It's read
+  from the device again after hid_reconcile_ms, to catch changes made by
+  others, and whenever the connection has failed. A thread may trust the
+  shadow for a different time, ex. the daemon serving a client that gave
+  --reconcile.
+
+  HIDAPI queues the input reports of a device, and drops them if the queue is
+  full. The reports received and dropped are counted when the device is
+  closed, and printed with --stats.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Unix */
+#include <pthread.h>
+
+/* Linux */
+#include <hidapi/hidapi.h>
+#include <glib.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+#include "stats.h"
+#include "hid_enum.h"
+
+#include "hid_transport.h"
+
+int hid_reconcile_ms = HID_RECONCILE_MS;
+static __thread int thread_reconcile_ms = -1;
+const struct _hid_transport *hid_usb_transport = &hidapi_transport;
+
+static GList *pool = NULL;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Input reports of the HIDAPI devices closed
+static struct {
+  pthread_mutex_t mutex;
+  unsigned long received;
+  unsigned long dropped;
+} input = { PTHREAD_MUTEX_INITIALIZER };
+
+static void * hidapi_open(struct _device_list *device){
+  return hid_open_path(device->port);
+}
+
+static int hidapi_write(void *handle, const unsigned char *data, size_t length){
+  return hid_write((hid_device *)handle, data, length);
+}
+
+static int hidapi_read_timeout(void *handle, unsigned char *data, size_t length, int milliseconds){
+  return hid_read_timeout((hid_device *)handle, data, length, milliseconds);
+}
+
+static void hidapi_close(void *handle){
+  unsigned long received, dropped;
+
+  if ( !hid_get_input_statistics((hid_device *)handle, &received, &dropped) ) {
+    pthread_mutex_lock(&input.mutex);
+    input.received += received;
+    input.dropped += dropped;
+    pthread_mutex_unlock(&input.mutex);
+  }
+  hid_close((hid_device *)handle);
+}
+
+const struct _hid_transport hidapi_transport = {
+  "hidapi",
+  hidapi_open,
+  hidapi_write,
+  hidapi_read_timeout,
+  hidapi_close
+};
+
+// Select the transport used for USB HID devices, by name
+int hid_select_transport(const char *name){
+  const struct _hid_transport *transports[] = { &hidapi_transport, &hidraw_transport, NULL };
+
+  for (int i = 0; transports[i]; i++)
+    if ( !strcmp(transports[i]->name, name) ) {
+      hid_usb_transport = transports[i];
+      return SUCCESS;
+    }
+  return FAILURE;
+}
+
+// The transport of the interface, the device belongs to. USB HID devices use the selected transport
+const struct _hid_transport * hid_transport(struct _device_list *device){
+  const struct _hid_transport *transport = supported_interface[device->si_index].transport;
+
+  return transport ? transport : hid_usb_transport;
+}
+
+// Close the device of a connection, that no one holds
+static void close_connection(struct _hid_connection *connection){
+  uint64_t start;
+
+  if ( !connection->handle )
+    return;
+
+  start = stats_start();
+  connection->transport->close(connection->handle);
+  stats_stop("hid close", NULL, start);
+  connection->handle = NULL;
+  connection->shadow_read = 0;
+}
+
+/*
+  Get exclusive use of an open connection to the device. 
+  Waits while another thread uses it. Return NULL if the device can't be opened.
+  Must be returned with hid_disconnect()
+*/
+struct _hid_connection * hid_connect(struct _device_list *device){
+  const struct _hid_transport *transport = hid_transport(device);
+  struct _hid_connection *connection = NULL;
+  GList *iterator;
+  uint64_t start;
+
+  pthread_mutex_lock(&pool_mutex);
+  for (iterator = pool; iterator; iterator = iterator->next) {
+    connection = (struct _hid_connection *)iterator->data;
+    if ( connection->transport == transport && !strcmp(connection->port, device->port) )
+      break;
+  }
+
+  if ( !iterator ) {
+    connection = (struct _hid_connection *) malloc(sizeof(struct _hid_connection));
+    memset(connection, 0, sizeof(struct _hid_connection));
+    connection->transport = transport;
+    connection->port = sdsnew(device->port);
+    pthread_mutex_init(&connection->mutex, NULL);
+    pool = g_list_prepend(pool, connection);
+  }
+  connection->users++;
+  pthread_mutex_unlock(&pool_mutex);
+
+  pthread_mutex_lock(&connection->mutex);
+  if ( !connection->handle ) {
+    start = stats_start();
+    connection->handle = transport->open(device);
+    stats_stop("hid open", NULL, start);
+    if ( !connection->handle ) {
+      hid_disconnect(connection, true);
+      return NULL;
+    }
+  } else if ( info )
+    printf("Reusing open HID device %s\n", device->port);
+
+  return connection;
+}
+
+/*
+  Return the connection to the pool. 
+  The device is closed, if the caller failed to communicate with it.
+*/
+void hid_disconnect(struct _hid_connection *connection, int failed){
+  if ( failed )
+    close_connection(connection);
+  connection->last_used = stats_time_us();
+  pthread_mutex_unlock(&connection->mutex);
+
+  pthread_mutex_lock(&pool_mutex);
+  connection->users--;
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+int hid_send(struct _hid_connection *connection, const unsigned char *data, size_t length){
+  return connection->transport->write(connection->handle, data, length);
+}
+
+int hid_receive(struct _hid_connection *connection, unsigned char *data, size_t length, int milliseconds){
+  return connection->transport->read_timeout(connection->handle, data, length, milliseconds);
+}
+
+// Time to wait for a reply, from the round trip times measured
+static int reply_timeout(struct _hid_connection *connection){
+  int timeout;
+
+  if ( !connection->srtt )
+    return HID_TIMEOUT_INITIAL_MS;
+
+  timeout = ( connection->srtt + 4 * connection->rttvar + 999 ) / 1000;
+  if ( timeout < HID_TIMEOUT_MIN_MS ) 
+    return HID_TIMEOUT_MIN_MS;
+  if ( timeout > HID_TIMEOUT_MAX_MS ) 
+    return HID_TIMEOUT_MAX_MS;
+  return timeout;
+}
+
+// Update the round trip time estimate with a new measurement
+static void measure_rtt(struct _hid_connection *connection, uint32_t rtt){
+  int32_t error;
+
+  if ( !connection->srtt ) {
+    connection->srtt = rtt ? rtt : 1;
+    connection->rttvar = rtt / 2;
+    return;
+  }
+  error = (int32_t)rtt - (int32_t)connection->srtt;
+  connection->srtt += error / 8;
+  if ( !connection->srtt ) 
+    connection->srtt = 1;
+  connection->rttvar += ( ( error < 0 ? -error : error ) - (int32_t)connection->rttvar ) / 4;
+}
+
+/*
+  Send a request, and wait for the reply.
+  Reports left over from earlier requests are discarded first. 
+  Return the length of the reply, or FAILURE after HID_RETRIES attempts.
+*/
+int hid_request(struct _hid_connection *connection, const unsigned char *request, size_t length, unsigned char *reply, size_t reply_length){
+  int timeout = reply_timeout(connection);
+  unsigned char discard[64];
+  int result = 0;
+  uint64_t start;
+
+  while ( hid_receive(connection, discard, sizeof(discard), 0) > 0 );
+
+  for (int attempt = 1; attempt <= HID_RETRIES; attempt++) {
+    start = stats_start();
+    if ( hid_send(connection, request, length) <= 0 ) {
+      result = FAILURE;
+      continue;
+    }
+    stats_stop("hid write", NULL, start);
+
+    start = stats_time_us();
+    result = hid_receive(connection, reply, reply_length, timeout);
+    if ( result > 0 ) {
+      // A reply to a repeated request, might be the answer to the first
+      if ( attempt == 1 )
+        measure_rtt(connection, stats_time_us() - start);
+      stats_stop("hid read", NULL, start);
+      return result;
+    }
+
+    if ( info )
+      printf("No reply from %s in %d ms\n", connection->port, timeout);
+    timeout = timeout * 2 > HID_TIMEOUT_MAX_MS ? HID_TIMEOUT_MAX_MS : timeout * 2;
+  }
+  return FAILURE;
+}
+
+/*
+  Get the shadow relay state. 
+  Return FAILURE if it must be read from the device.
+*/
+int hid_shadow_get(struct _hid_connection *connection, int *state){
+  int reconcile_ms = thread_reconcile_ms < 0 ? hid_reconcile_ms : thread_reconcile_ms;
+
+  if ( !connection->shadow_read 
+    || stats_time_us() - connection->shadow_read >= reconcile_ms * 1000ULL )
+    return FAILURE;
+
+  if ( info )
+    printf("Using shadow relay state of %s\n", connection->port);
+  *state = connection->shadow;
+  return SUCCESS;
+}
+
+// Trust the shadow relay state for <milliseconds> on the calling thread, or hid_reconcile_ms if negative
+void hid_reconcile_thread(int milliseconds){
+  thread_reconcile_ms = milliseconds;
+}
+
+// Update the shadow relay state, after it's <read> from or written to the device
+void hid_shadow_set(struct _hid_connection *connection, int state, int read){
+  connection->shadow = state;
+  if ( read )
+    connection->shadow_read = stats_time_us();
+}
+
+// Close and forget connections, that no one has used for HID_POOL_IDLE_MS
+void hid_pool_expire(void){
+  uint64_t now = stats_time_us();
+  struct _hid_connection *connection;
+  GList *iterator, *next;
+
+  pthread_mutex_lock(&pool_mutex);
+  for (iterator = pool; iterator; iterator = next) {
+    next = iterator->next;
+    connection = (struct _hid_connection *)iterator->data;
+    if ( connection->users || now - connection->last_used < HID_POOL_IDLE_MS * 1000ULL )
+      continue;
+
+    if ( info && connection->handle )
+      printf("Closing idle HID device %s\n", connection->port);
+    close_connection(connection);
+    pool = g_list_delete_link(pool, iterator);
+    pthread_mutex_destroy(&connection->mutex);
+    sdsfree(connection->port);
+    free(connection);
+  }
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+// Close all pooled connections. No connection may be in use
+void hid_pool_close(void){
+  struct _hid_connection *connection;
+
+  pthread_mutex_lock(&pool_mutex);
+  for (GList *iterator = pool; iterator; iterator = iterator->next) {
+    connection = (struct _hid_connection *)iterator->data;
+    close_connection(connection);
+    pthread_mutex_destroy(&connection->mutex);
+    sdsfree(connection->port);
+    free(connection);
+  }
+  g_list_free(pool);
+  pool = NULL;
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+// Print the input reports received and dropped by the HIDAPI devices closed
+void hid_print_statistics(void){
+  pthread_mutex_lock(&input.mutex);
+  if ( input.received || input.dropped )
+    printf("HID input reports: %lu received, %lu dropped\n", input.received, input.dropped);
+  pthread_mutex_unlock(&input.mutex);
+}
@@ -0,0 +1,69 @@
+#ifndef HID_TRANSPORT_H
+#define HID_TRANSPORT_H
+
+/* C */
+#include <stddef.h>
+#include <stdint.h>
+
+/* Unix */
+#include <pthread.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+// Close pooled handles, that hasn't been used for this long
+#define HID_POOL_IDLE_MS 10000
+
+// Time to wait for a reply. Adapted to the measured round trip time of each device
+#define HID_TIMEOUT_INITIAL_MS 100
+#define HID_TIMEOUT_MIN_MS 2
+#define HID_TIMEOUT_MAX_MS 1000
+#define HID_RETRIES 3           // Requests sent, before giving up
+
+// Default time the shadow relay state is trusted, before it's read from the device again
+#define HID_RECONCILE_MS 1000
+
+// How relay drivers exchange HID reports with a device
+struct _hid_transport {
+  const char *name;
+  void * (*open)(struct _device_list *device);   // Return a handle or NULL
+  int (*write)(void *handle, const unsigned char *data, size_t length);
+  int (*read_timeout)(void *handle, unsigned char *data, size_t length, int milliseconds);
+  void (*close)(void *handle);
+};
+
+// A pooled, open device. Only one user at a time
+struct _hid_connection {
+  const struct _hid_transport *transport;
+  sds port;
+  void *handle;
+  int users;              // Holding or waiting for the connection
+  uint64_t last_used;     // µs
+  uint32_t srtt;          // Smoothed round trip time in µs. 0 until measured
+  uint32_t rttvar;        // Round trip time variation in µs
+  int shadow;             // Relay state, as last read or written
+  uint64_t shadow_read;   // When the shadow was last read from the device, in µs. 0 if unknown
+  pthread_mutex_t mutex;
+};
+
+extern const struct _hid_transport hidapi_transport;
+extern const struct _hid_transport hidraw_transport;
+extern const struct _hid_transport *hid_usb_transport;
+extern int hid_reconcile_ms;
+
+int hid_select_transport(const char *name);
+const struct _hid_transport * hid_transport(struct _device_list *device);
+struct _hid_connection * hid_connect(struct _device_list *device);
+void hid_disconnect(struct _hid_connection *connection, int failed);
+int hid_send(struct _hid_connection *connection, const unsigned char *data, size_t length);
+int hid_receive(struct _hid_connection *connection, unsigned char *data, size_t length, int milliseconds);
+int hid_request(struct _hid_connection *connection, const unsigned char *request, size_t length, unsigned char *reply, size_t reply_length);
+int hid_shadow_get(struct _hid_connection *connection, int *state);
+void hid_shadow_set(struct _hid_connection *connection, int state, int read);
+void hid_reconcile_thread(int milliseconds);
+void hid_pool_expire(void);
+void hid_pool_close(void);
+void hid_print_statistics(void);
+
+#endif
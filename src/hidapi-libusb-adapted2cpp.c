@@ -52,67 +52,7 @@
 #endif
 
 #include "hidapi.h"
-
-#if defined(__ANDROID__) && __ANDROID_API__ < __ANDROID_API_N__
-
-/* Barrier implementation because Android/Bionic don't have pthread_barrier.
-   This implementation came from Brent Priddy and was posted on
-   StackOverflow. It is used with his permission. */
-typedef int pthread_barrierattr_t;
-typedef struct pthread_barrier {
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-    int count;
-    int trip_count;
-} pthread_barrier_t;
-
-static int pthread_barrier_init(pthread_barrier_t *barrier, const pthread_barrierattr_t *attr, unsigned int count)
-{
-	if(count == 0) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	if(pthread_mutex_init(&barrier->mutex, 0) < 0) {
-		return -1;
-	}
-	if(pthread_cond_init(&barrier->cond, 0) < 0) {
-		pthread_mutex_destroy(&barrier->mutex);
-		return -1;
-	}
-	barrier->trip_count = count;
-	barrier->count = 0;
-
-	return 0;
-}
-
-static int pthread_barrier_destroy(pthread_barrier_t *barrier)
-{
-	pthread_cond_destroy(&barrier->cond);
-	pthread_mutex_destroy(&barrier->mutex);
-	return 0;
-}
-
-static int pthread_barrier_wait(pthread_barrier_t *barrier)
-{
-	pthread_mutex_lock(&barrier->mutex);
-	++(barrier->count);
-	if(barrier->count >= barrier->trip_count)
-	{
-		barrier->count = 0;
-		pthread_cond_broadcast(&barrier->cond);
-		pthread_mutex_unlock(&barrier->mutex);
-		return 1;
-	}
-	else
-	{
-		pthread_cond_wait(&barrier->cond, &(barrier->mutex));
-		pthread_mutex_unlock(&barrier->mutex);
-		return 0;
-	}
-}
-
-#endif
+#include "hid_enum.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -136,11 +76,17 @@ libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
+/* Input reports received from the device are queued in a ring of
+   preallocated buffers. The event thread is the only producer, and the
+   reader of the device the only consumer, so the ring is lock free. When
+   the ring is full, newly received reports are dropped and counted. The
+   reader may then still read the reports queued, in the order received.
+   Must be a power of 2. */
+#define INPUT_RING_SIZE 32
+
 struct input_report {
 	uint8_t *data;
 	size_t len;
-	struct input_report *next;
 };
 
 
@@ -164,17 +110,23 @@ struct hid_device_ {
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 
-	/* Read thread objects */
-	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
+	/* Input transfer objects. The transfer is handled by the shared
+	   event thread */
+	pthread_mutex_t mutex; /* Protects the condition and the transfer state */
 	pthread_cond_t condition;
-	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 	int shutdown_thread;
 	int transfer_loop_finished;
 	struct libusb_transfer *transfer;
 
-	/* List of received input reports. */
-	struct input_report *input_reports;
+	/* Ring of received input reports. Head is written by the event
+	   thread only and tail by the reader only. Both count forever. */
+	struct input_report input_ring[INPUT_RING_SIZE];
+	uint8_t *input_ring_buffer;
+	unsigned int input_head;
+	unsigned int input_tail;
+	int reader_waiting; /* The reader is, or is about to, wait on the condition */
+	unsigned long reports_received;
+	unsigned long reports_dropped;
 
 	/* Was kernel driver detached by libusb */
 #ifdef DETACH_KERNEL_DRIVER
@@ -190,17 +142,32 @@ static struct hid_api_version api_version = {
 
 static libusb_context *usb_context = NULL;
 
+/* A single thread handles the libusb events of all open devices, and the
+   input transfer of each device is completed into the queue of that
+   device. The thread is started when the first device is opened, and
+   stopped when the last one is closed. */
+static pthread_t event_thread;
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int event_users = 0;
+static int event_thread_stop = 0;	/* Set and read atomically */
+
 uint16_t get_usb_code_for_current_locale(void);
 static int return_data(hid_device *dev, unsigned char *data, size_t length);
+static int input_available(hid_device *dev);
 
 static hid_device *new_hid_device(void)
 {
 	hid_device *dev = (hid_device*) calloc(1, sizeof(hid_device));
+	pthread_condattr_t condattr;
 	dev->blocking = 1;
 
 	pthread_mutex_init(&dev->mutex, NULL);
-	pthread_cond_init(&dev->condition, NULL);
-	pthread_barrier_init(&dev->barrier, NULL, 2);
+	/* Timed waits for input reports must not be affected by changes
+	   to the wall clock */
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&dev->condition, &condattr);
+	pthread_condattr_destroy(&condattr);
 
 	return dev;
 }
@@ -208,7 +175,6 @@ static hid_device *new_hid_device(void)
 static void free_hid_device(hid_device *dev)
 {
 	/* Clean up the thread objects */
-	pthread_barrier_destroy(&dev->barrier);
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
 
@@ -522,35 +488,69 @@ HID_API_EXPORT const char* HID_API_CALL hid_version_str()
 	return HID_API_VERSION_STR;
 }
 
+/* Devices are opened from several threads at once (dispatch workers and
+   daemon clients). The context must be created once, as the event thread
+   only handles the events of usb_context. */
+static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 int HID_API_EXPORT hid_init(void)
 {
+	int res = 0;
+
+	pthread_mutex_lock(&init_mutex);
 	if (!usb_context) {
 		const char *locale;
 
 		/* Init Libusb */
-		if (libusb_init(&usb_context))
-			return -1;
-
-		/* Set the locale if it's not set. */
-		locale = setlocale(LC_CTYPE, NULL);
-		if (!locale)
-			setlocale(LC_CTYPE, "");
+		if (libusb_init(&usb_context)) {
+			usb_context = NULL;
+			res = -1;
+		}
+		else {
+			/* Set the locale if it's not set. */
+			locale = setlocale(LC_CTYPE, NULL);
+			if (!locale)
+				setlocale(LC_CTYPE, "");
+		}
 	}
+	pthread_mutex_unlock(&init_mutex);
 
-	return 0;
+	return res;
 }
 
 int HID_API_EXPORT hid_exit(void)
 {
+	pthread_mutex_lock(&init_mutex);
 	if (usb_context) {
 		libusb_exit(usb_context);
 		usb_context = NULL;
 	}
+	pthread_mutex_unlock(&init_mutex);
 
 	return 0;
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+/* Compare a string descriptor to a criteria. A NULL criteria matches anything */
+static int string_matches(const char *criteria, const wchar_t *value)
+{
+	char str[512];
+
+	if (!criteria)
+		return 1;
+	if (!value || snprintf(str, sizeof(str), "%ls", value) < 0)
+		return 0;
+	return strcmp(criteria, str) == 0;
+}
+
+/*
+  Enumerate the HID interfaces that match. The criterias are checked in the
+  order they are cheapest to read: VID/PID from the device descriptor, the
+  port from the bus topology, and whether the device has the string
+  descriptors asked for at all. Only then is the device opened, and the
+  string descriptors requested. A device that doesn't match is closed as
+  soon as a string differs, without requesting the rest.
+*/
+static struct hid_device_info *enumerate(const struct hid_match *match)
 {
 	libusb_device **devs;
 	libusb_device *dev;
@@ -577,6 +577,16 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 		unsigned short dev_vid = desc.idVendor;
 		unsigned short dev_pid = desc.idProduct;
 
+		/* Check the VID/PID against the criterias */
+		if ((match->vendor_id && match->vendor_id != dev_vid) ||
+		    (match->product_id && match->product_id != dev_pid))
+			continue;
+
+		/* A string can't match, if the device doesn't have it */
+		if ((match->serial_number && desc.iSerialNumber == 0) ||
+		    (match->manufacturer && desc.iManufacturer == 0))
+			continue;
+
 		res = libusb_get_active_config_descriptor(dev, &conf_desc);
 		if (res < 0)
 			libusb_get_config_descriptor(dev, 0, &conf_desc);
@@ -585,132 +595,154 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 				const struct libusb_interface *intf = &conf_desc->interface[j];
 				for (k = 0; k < intf->num_altsetting; k++) {
 					const struct libusb_interface_descriptor *intf_desc;
-					intf_desc = &intf->altsetting[k];
-					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-						interface_num = intf_desc->bInterfaceNumber;
-
-						/* Check the VID/PID against the arguments */
-						if ((vendor_id == 0x0 || vendor_id == dev_vid) &&
-						    (product_id == 0x0 || product_id == dev_pid)) {
-							struct hid_device_info *tmp;
-
-							/* VID/PID match. Create the record. */
-							tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
-							if (cur_dev) {
-								cur_dev->next = tmp;
-							}
-							else {
-								root = tmp;
-							}
-							cur_dev = tmp;
+					struct hid_device_info *tmp;
+					wchar_t *serial_number = NULL, *manufacturer_string = NULL;
+					char *path;
 
-							/* Fill out the record */
-							cur_dev->next = NULL;
-							cur_dev->path = make_path(dev, interface_num, conf_desc->bConfigurationValue);
+					intf_desc = &intf->altsetting[k];
+					if (intf_desc->bInterfaceClass != LIBUSB_CLASS_HID)
+						continue;
+					interface_num = intf_desc->bInterfaceNumber;
+
+					/* Check the port against the criterias */
+					path = make_path(dev, interface_num, conf_desc->bConfigurationValue);
+					if (match->port && strcmp(match->port, path)) {
+						free(path);
+						continue;
+					}
 
-							res = libusb_open(dev, &handle);
+					res = libusb_open(dev, &handle);
 
-							if (res >= 0) {
+					if (res >= 0) {
 #ifdef __ANDROID__
-								/* There is (a potential) libusb Android backend, in which
-								   device descriptor is not accurate up until the device is opened.
-								   https://github.com/libusb/libusb/pull/874#discussion_r632801373
-								   A workaround is to re-read the descriptor again.
-								   Even if it is not going to be accepted into libusb master,
-								   having it here won't do any harm, since reading the device descriptor
-								   is as cheap as copy 18 bytes of data. */
-								libusb_get_device_descriptor(dev, &desc);
+						/* There is (a potential) libusb Android backend, in which
+						   device descriptor is not accurate up until the device is opened.
+						   https://github.com/libusb/libusb/pull/874#discussion_r632801373
+						   A workaround is to re-read the descriptor again.
+						   Even if it is not going to be accepted into libusb master,
+						   having it here won't do any harm, since reading the device descriptor
+						   is as cheap as copy 18 bytes of data. */
+						libusb_get_device_descriptor(dev, &desc);
 #endif
 
-								/* Serial Number */
-								if (desc.iSerialNumber > 0)
-									cur_dev->serial_number =
-										get_usb_string(handle, desc.iSerialNumber);
+						/* Serial Number and Manufacturer, checked as they are read */
+						if (desc.iSerialNumber > 0)
+							serial_number = get_usb_string(handle, desc.iSerialNumber);
+						if (string_matches(match->serial_number, serial_number) &&
+						    desc.iManufacturer > 0)
+							manufacturer_string = get_usb_string(handle, desc.iManufacturer);
+
+						if (!string_matches(match->serial_number, serial_number) ||
+						    !string_matches(match->manufacturer, manufacturer_string)) {
+							libusb_close(handle);
+							free(serial_number);
+							free(manufacturer_string);
+							free(path);
+							continue;
+						}
+					}
+					else if (match->serial_number || match->manufacturer) {
+						/* The strings can't be read */
+						free(path);
+						continue;
+					}
+
+					/* Match. Create the record. */
+					tmp = (struct hid_device_info*) calloc(1, sizeof(struct hid_device_info));
+					if (cur_dev) {
+						cur_dev->next = tmp;
+					}
+					else {
+						root = tmp;
+					}
+					cur_dev = tmp;
+
+					/* Fill out the record */
+					cur_dev->next = NULL;
+					cur_dev->path = path;
+					cur_dev->serial_number = serial_number;
+					cur_dev->manufacturer_string = manufacturer_string;
 
-								/* Manufacturer and Product strings */
-								if (desc.iManufacturer > 0)
-									cur_dev->manufacturer_string =
-										get_usb_string(handle, desc.iManufacturer);
-								if (desc.iProduct > 0)
-									cur_dev->product_string =
-										get_usb_string(handle, desc.iProduct);
+					if (res >= 0) {
+						/* Product string */
+						if (desc.iProduct > 0)
+							cur_dev->product_string =
+								get_usb_string(handle, desc.iProduct);
 
 #ifdef INVASIVE_GET_USAGE
 {
-							/*
-							This section is removed because it is too
-							invasive on the system. Getting a Usage Page
-							and Usage requires parsing the HID Report
-							descriptor. Getting a HID Report descriptor
-							involves claiming the interface. Claiming the
-							interface involves detaching the kernel driver.
-							Detaching the kernel driver is hard on the system
-							because it will unclaim interfaces (if another
-							app has them claimed) and the re-attachment of
-							the driver will sometimes change /dev entry names.
-							It is for these reasons that this section is
-							#if 0. For composite devices, use the interface
-							field in the hid_device_info struct to distinguish
-							between interfaces. */
-								unsigned char data[256];
+					/*
+					This section is removed because it is too
+					invasive on the system. Getting a Usage Page
+					and Usage requires parsing the HID Report
+					descriptor. Getting a HID Report descriptor
+					involves claiming the interface. Claiming the
+					interface involves detaching the kernel driver.
+					Detaching the kernel driver is hard on the system
+					because it will unclaim interfaces (if another
+					app has them claimed) and the re-attachment of
+					the driver will sometimes change /dev entry names.
+					It is for these reasons that this section is
+					#if 0. For composite devices, use the interface
+					field in the hid_device_info struct to distinguish
+					between interfaces. */
+						unsigned char data[256];
 #ifdef DETACH_KERNEL_DRIVER
-								int detached = 0;
-								/* Usage Page and Usage */
-								res = libusb_kernel_driver_active(handle, interface_num);
-								if (res == 1) {
-									res = libusb_detach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
-									else
-										detached = 1;
-								}
+						int detached = 0;
+						/* Usage Page and Usage */
+						res = libusb_kernel_driver_active(handle, interface_num);
+						if (res == 1) {
+							res = libusb_detach_kernel_driver(handle, interface_num);
+							if (res < 0)
+								LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
+							else
+								detached = 1;
+						}
 #endif
-								res = libusb_claim_interface(handle, interface_num);
-								if (res >= 0) {
-									/* Get the HID Report Descriptor. */
-									res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
-									if (res >= 0) {
-										unsigned short page=0, usage=0;
-										/* Parse the usage and usage page
-										   out of the report descriptor. */
-										get_usage(data, res,  &page, &usage);
-										cur_dev->usage_page = page;
-										cur_dev->usage = usage;
-									}
-									else
-										LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
-
-									/* Release the interface */
-									res = libusb_release_interface(handle, interface_num);
-									if (res < 0)
-										LOG("Can't release the interface.\n");
-								}
-								else
-									LOG("Can't claim interface %d\n", res);
+						res = libusb_claim_interface(handle, interface_num);
+						if (res >= 0) {
+							/* Get the HID Report Descriptor. */
+							res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
+							if (res >= 0) {
+								unsigned short page=0, usage=0;
+								/* Parse the usage and usage page
+								   out of the report descriptor. */
+								get_usage(data, res,  &page, &usage);
+								cur_dev->usage_page = page;
+								cur_dev->usage = usage;
+							}
+							else
+								LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
+
+							/* Release the interface */
+							res = libusb_release_interface(handle, interface_num);
+							if (res < 0)
+								LOG("Can't release the interface.\n");
+						}
+						else
+							LOG("Can't claim interface %d\n", res);
 #ifdef DETACH_KERNEL_DRIVER
-								/* Re-attach kernel driver if necessary. */
-								if (detached) {
-									res = libusb_attach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't re-attach kernel driver.\n");
-								}
+						/* Re-attach kernel driver if necessary. */
+						if (detached) {
+							res = libusb_attach_kernel_driver(handle, interface_num);
+							if (res < 0)
+								LOG("Couldn't re-attach kernel driver.\n");
+						}
 #endif
 }
 #endif /* INVASIVE_GET_USAGE */
 
-								libusb_close(handle);
-							}
-							/* VID/PID */
-							cur_dev->vendor_id = dev_vid;
-							cur_dev->product_id = dev_pid;
+						libusb_close(handle);
+					}
+					/* VID/PID */
+					cur_dev->vendor_id = dev_vid;
+					cur_dev->product_id = dev_pid;
 
-							/* Release Number */
-							cur_dev->release_number = desc.bcdDevice;
+					/* Release Number */
+					cur_dev->release_number = desc.bcdDevice;
 
-							/* Interface Number */
-							cur_dev->interface_number = interface_num;
-						}
-					}
+					/* Interface Number */
+					cur_dev->interface_number = interface_num;
 				} /* altsettings */
 			} /* interfaces */
 			libusb_free_config_descriptor(conf_desc);
@@ -722,6 +754,22 @@ struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id,
 	return root;
 }
 
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	struct hid_match match;
+
+	memset(&match, 0, sizeof(match));
+	match.vendor_id = vendor_id;
+	match.product_id = product_id;
+	return enumerate(&match);
+}
+
+/* Extension: Enumerate with all the criterias of a device identifier */
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_matching(const struct hid_match *match)
+{
+	return enumerate(match);
+}
+
 void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 {
 	struct hid_device_info *d = devs;
@@ -772,45 +820,48 @@ hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, const
 	return handle;
 }
 
+/* Stop resubmitting the input transfer of the device, and wake any thread
+   waiting for data (in hid_read_timeout()) or for the transfer to end (in
+   hid_close()). */
+static void finish_transfer_loop(hid_device *dev)
+{
+	pthread_mutex_lock(&dev->mutex);
+	dev->shutdown_thread = 1;
+	dev->transfer_loop_finished = 1;
+	pthread_cond_broadcast(&dev->condition);
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+/* Called by the event thread, when the input transfer of a device completes */
 static void read_callback(struct libusb_transfer *transfer)
 {
 	hid_device *dev = (hid_device*)transfer->user_data;
 	int res;
 
 	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		unsigned int head = dev->input_head;
+		unsigned int tail = __atomic_load_n(&dev->input_tail, __ATOMIC_ACQUIRE);
 
-		struct input_report *rpt = (struct input_report*) malloc(sizeof(*rpt));
-		rpt->data = (uint8_t*) malloc(transfer->actual_length);
-		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
-		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
-
-		pthread_mutex_lock(&dev->mutex);
-
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
-			pthread_cond_signal(&dev->condition);
+		if (head - tail == INPUT_RING_SIZE) {
+			/* The reader is not keeping up. Drop the report */
+			__atomic_fetch_add(&dev->reports_dropped, 1, __ATOMIC_RELAXED);
 		}
 		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			cur->next = rpt;
-
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
+			struct input_report *rpt = &dev->input_ring[head % INPUT_RING_SIZE];
+			memcpy(rpt->data, transfer->buffer, transfer->actual_length);
+			rpt->len = transfer->actual_length;
+			__atomic_fetch_add(&dev->reports_received, 1, __ATOMIC_RELAXED);
+
+			/* Publish the report, then see if the reader needs
+			   waking. The reader sets reader_waiting before it looks
+			   at the ring, so one of them sees the other. */
+			__atomic_store_n(&dev->input_head, head + 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(&dev->reader_waiting, __ATOMIC_SEQ_CST)) {
+				pthread_mutex_lock(&dev->mutex);
+				pthread_cond_signal(&dev->condition);
+				pthread_mutex_unlock(&dev->mutex);
 			}
 		}
-		pthread_mutex_unlock(&dev->mutex);
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
 		dev->shutdown_thread = 1;
@@ -825,90 +876,72 @@ static void read_callback(struct libusb_transfer *transfer)
 		LOG("Unknown transfer code: %d\n", transfer->status);
 	}
 
-	if (dev->shutdown_thread) {
-		dev->transfer_loop_finished = 1;
-		return;
-	}
-
-	/* Re-submit the transfer object. */
-	res = libusb_submit_transfer(transfer);
+	/* Re-submit the transfer object, unless the device is being closed.
+	   This is decided under the mutex, so hid_close() either sees the
+	   transfer submitted, and cancels it, or it's not resubmitted. */
+	pthread_mutex_lock(&dev->mutex);
+	res = dev->shutdown_thread ? -1 : libusb_submit_transfer(transfer);
+	pthread_mutex_unlock(&dev->mutex);
 	if (res != 0) {
-		LOG("Unable to submit URB. libusb error code: %d\n", res);
-		dev->shutdown_thread = 1;
-		dev->transfer_loop_finished = 1;
+		if (!dev->shutdown_thread)
+			LOG("Unable to submit URB. libusb error code: %d\n", res);
+		finish_transfer_loop(dev);
 	}
 }
 
 
-static void *read_thread(void *param)
+/* Handle the libusb events of all open devices, until the last one is closed */
+static void *event_loop(void *param)
 {
-	hid_device *dev = (hid_device*)param;
-	uint8_t *buf;
-	const size_t length = dev->input_ep_max_packet_size;
-
-	/* Set up the transfer object. */
-	buf = (uint8_t*) malloc(length);
-	dev->transfer = libusb_alloc_transfer(0);
-	libusb_fill_interrupt_transfer(dev->transfer,
-		dev->device_handle,
-		dev->input_endpoint,
-		buf,
-		length,
-		read_callback,
-		dev,
-		5000/*timeout*/);
-
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
-
-	/* Notify the main thread that the read thread is up and running. */
-	pthread_barrier_wait(&dev->barrier);
-
-	/* Handle all the events. */
-	while (!dev->shutdown_thread) {
+	(void)param;
+
+	while (!__atomic_load_n(&event_thread_stop, __ATOMIC_ACQUIRE)) {
 		int res;
-		res = libusb_handle_events(usb_context);
+		res = libusb_handle_events_completed(usb_context, &event_thread_stop);
 		if (res < 0) {
 			/* There was an error. */
-			LOG("read_thread(): libusb reports error # %d\n", res);
+			LOG("event_loop(): libusb reports error # %d\n", res);
 
-			/* Break out of this loop only on fatal error.*/
+			/* Don't spin on a persistent error. Transfers of
+			   devices, that are gone, end with LIBUSB_TRANSFER_NO_DEVICE */
 			if (res != LIBUSB_ERROR_BUSY &&
 			    res != LIBUSB_ERROR_TIMEOUT &&
 			    res != LIBUSB_ERROR_OVERFLOW &&
-			    res != LIBUSB_ERROR_INTERRUPTED) {
-				dev->shutdown_thread = 1;
-				break;
-			}
+			    res != LIBUSB_ERROR_INTERRUPTED)
+				usleep(10000);
 		}
 	}
 
-	/* Cancel any transfer that may be pending. This call will fail
-	   if no transfers are pending, but that's OK. */
-	libusb_cancel_transfer(dev->transfer);
-
-	while (!dev->transfer_loop_finished)
-		libusb_handle_events_completed(usb_context, &dev->transfer_loop_finished);
-
-	/* Now that the read thread is stopping, Wake any threads which are
-	   waiting on data (in hid_read_timeout()). Do this under a mutex to
-	   make sure that a thread which is about to go to sleep waiting on
-	   the condition actually will go to sleep before the condition is
-	   signaled. */
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cond_broadcast(&dev->condition);
-	pthread_mutex_unlock(&dev->mutex);
+	return NULL;
+}
 
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
-	   in hid_close(). They are not cleaned up here because this thread
-	   could end either due to a disconnect or due to a user
-	   call to hid_close(). In both cases the objects can be safely
-	   cleaned up after the call to pthread_join() (in hid_close()), but
-	   since hid_close() calls libusb_cancel_transfer(), on these objects,
-	   they can not be cleaned up here. */
+/* Register an open device with the event thread. Start it for the first device */
+static void event_thread_attach(void)
+{
+	pthread_mutex_lock(&event_mutex);
+	if (event_users++ == 0) {
+		__atomic_store_n(&event_thread_stop, 0, __ATOMIC_RELEASE);
+		pthread_create(&event_thread, NULL, event_loop, NULL);
+	}
+	pthread_mutex_unlock(&event_mutex);
+}
 
-	return NULL;
+/* Close the device handle. Stop the event thread, when it's the last device.
+   Closing a handle interrupts the event thread, so it sees the stop flag. */
+static void event_thread_detach(libusb_device_handle *device_handle)
+{
+	pthread_mutex_lock(&event_mutex);
+	if (--event_users == 0) {
+		__atomic_store_n(&event_thread_stop, 1, __ATOMIC_RELEASE);
+		libusb_close(device_handle);
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+		libusb_interrupt_event_handler(usb_context);
+#endif
+		pthread_join(event_thread, NULL);
+	}
+	else
+		libusb_close(device_handle);
+	pthread_mutex_unlock(&event_mutex);
 }
 
 
@@ -1028,10 +1061,41 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 							}
 						}
 
-						pthread_create(&dev->thread, NULL, read_thread, dev);
-
-						/* Wait here for the read thread to be initialized. */
-						pthread_barrier_wait(&dev->barrier);
+						/* Preallocate the input report ring */
+						dev->input_ring_buffer = (uint8_t*) malloc(INPUT_RING_SIZE * dev->input_ep_max_packet_size);
+						for (i = 0; i < INPUT_RING_SIZE; i++)
+							dev->input_ring[i].data = dev->input_ring_buffer + i * dev->input_ep_max_packet_size;
+
+						/* Set up the transfer object. */
+						dev->transfer = libusb_alloc_transfer(0);
+						libusb_fill_interrupt_transfer(dev->transfer,
+							dev->device_handle,
+							dev->input_endpoint,
+							(uint8_t*) malloc(dev->input_ep_max_packet_size),
+							dev->input_ep_max_packet_size,
+							read_callback,
+							dev,
+							5000/*timeout*/);
+
+						/* Make the first submission. Further submissions are
+						   made by the event thread, from inside read_callback() */
+						res = libusb_submit_transfer(dev->transfer);
+						if (res < 0) {
+							LOG("Unable to submit URB. libusb error code: %d\n", res);
+							free(dev->transfer->buffer);
+							libusb_free_transfer(dev->transfer);
+							free(dev->input_ring_buffer);
+							libusb_release_interface(dev->device_handle, dev->interface);
+#ifdef DETACH_KERNEL_DRIVER
+							if (dev->is_driver_detached && libusb_attach_kernel_driver(dev->device_handle, dev->interface) < 0)
+								LOG("Failed to reattach the driver to kernel.\n");
+#endif
+							libusb_close(dev->device_handle);
+							free(dev_path);
+							good_open = 0;
+							break;
+						}
+						event_thread_attach();
 
 					}
 					free(dev_path);
@@ -1112,113 +1176,93 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	}
 }
 
+/* Whether an input report is queued. Called by the reader only */
+static int input_available(hid_device *dev)
+{
+	return __atomic_load_n(&dev->input_head, __ATOMIC_SEQ_CST) != dev->input_tail;
+}
+
 /* Helper function, to simplify hid_read().
-   This should be called with dev->mutex locked. */
+   Called by the reader only, when a report is available. */
 static int return_data(hid_device *dev, unsigned char *data, size_t length)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
+	/* Copy the data out of the ring slot into the return buffer (data),
+	   and hand the slot back to the event thread. */
+	struct input_report *rpt = &dev->input_ring[dev->input_tail % INPUT_RING_SIZE];
 	size_t len = (length < rpt->len)? length: rpt->len;
 	if (len > 0)
 		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
+	__atomic_store_n(&dev->input_tail, dev->input_tail + 1, __ATOMIC_RELEASE);
 	return len;
 }
 
 static void cleanup_mutex(void *param)
 {
 	hid_device *dev = (hid_device*)param;
+	__atomic_store_n(&dev->reader_waiting, 0, __ATOMIC_SEQ_CST);
 	pthread_mutex_unlock(&dev->mutex);
 }
 
 
 int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
 {
-#if 0
-	int transferred;
-	int res = libusb_interrupt_transfer(dev->device_handle, dev->input_endpoint, data, length, &transferred, 5000);
-	LOG("transferred: %d\n", transferred);
-	return transferred;
-#endif
 	/* by initialising this variable right here, GCC gives a compilation warning/error: */
 	/* error: variable ‘bytes_read’ might be clobbered by ‘longjmp’ or ‘vfork’ [-Werror=clobbered] */
 	int bytes_read; /* = -1; */
+	int res;
+	struct timespec ts;
 
-	pthread_mutex_lock(&dev->mutex);
-	pthread_cleanup_push(&cleanup_mutex, dev);
-
-	bytes_read = -1;
-
-	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
-		/* Return the first one */
-		bytes_read = return_data(dev, data, length);
-		goto ret;
-	}
+	/* There's an input report queued up. Return it, without locking. */
+	if (input_available(dev))
+		return return_data(dev, data, length);
 
 	if (dev->shutdown_thread) {
 		/* This means the device has been disconnected.
 		   An error code of -1 should be returned. */
-		bytes_read = -1;
-		goto ret;
+		return -1;
 	}
 
-	if (milliseconds == -1) {
-		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
-			pthread_cond_wait(&dev->condition, &dev->mutex);
-		}
-		if (dev->input_reports) {
-			bytes_read = return_data(dev, data, length);
-		}
+	if (milliseconds == 0) {
+		/* Purely non-blocking */
+		return 0;
 	}
-	else if (milliseconds > 0) {
+
+	if (milliseconds > 0) {
 		/* Non-blocking, but called with timeout. */
-		int res;
-		struct timespec ts;
-		clock_gettime(CLOCK_REALTIME, &ts);
+		clock_gettime(CLOCK_MONOTONIC, &ts);
 		ts.tv_sec += milliseconds / 1000;
 		ts.tv_nsec += (milliseconds % 1000) * 1000000;
 		if (ts.tv_nsec >= 1000000000L) {
 			ts.tv_sec++;
 			ts.tv_nsec -= 1000000000L;
 		}
+	}
 
-		while (!dev->input_reports && !dev->shutdown_thread) {
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	/* Ask the event thread to signal the next report */
+	__atomic_store_n(&dev->reader_waiting, 1, __ATOMIC_SEQ_CST);
+
+	res = 0;
+	while (!input_available(dev) && !dev->shutdown_thread && res == 0) {
+		if (milliseconds == -1)
+			res = pthread_cond_wait(&dev->condition, &dev->mutex);
+		else
 			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
-			if (res == 0) {
-				if (dev->input_reports) {
-					bytes_read = return_data(dev, data, length);
-					break;
-				}
 
-				/* If we're here, there was a spurious wake up
-				   or the read thread was shutdown. Run the
-				   loop again (ie: don't break). */
-			}
-			else if (res == ETIMEDOUT) {
-				/* Timed out. */
-				bytes_read = 0;
-				break;
-			}
-			else {
-				/* Error. */
-				bytes_read = -1;
-				break;
-			}
-		}
+		/* If a report isn't available now, there was a spurious
+		   wake up or the device was shut down. */
 	}
-	else {
-		/* Purely non-blocking */
+
+	if (input_available(dev))
+		bytes_read = return_data(dev, data, length);
+	else if (res == ETIMEDOUT)
 		bytes_read = 0;
-	}
+	else
+		bytes_read = -1;
 
-ret:
-	pthread_mutex_unlock(&dev->mutex);
-	pthread_cleanup_pop(0);
+	pthread_cleanup_pop(1);
 
 	return bytes_read;
 }
@@ -1331,14 +1375,20 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	if (!dev)
 		return;
 
-	/* Cause read_thread() to stop. */
+	/* Cancel the input transfer. This call will fail if the transfer has
+	   already ended, but that's OK. */
+	pthread_mutex_lock(&dev->mutex);
 	dev->shutdown_thread = 1;
 	libusb_cancel_transfer(dev->transfer);
+	pthread_mutex_unlock(&dev->mutex);
 
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+	/* Wait for the event thread to end the transfer. */
+	pthread_mutex_lock(&dev->mutex);
+	while (!dev->transfer_loop_finished)
+		pthread_cond_wait(&dev->condition, &dev->mutex);
+	pthread_mutex_unlock(&dev->mutex);
 
-	/* Clean up the Transfer objects allocated in read_thread(). */
+	/* Clean up the Transfer objects allocated in hid_open_path(). */
 	free(dev->transfer->buffer);
 	libusb_free_transfer(dev->transfer);
 
@@ -1355,19 +1405,24 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 #endif
 
 	/* Close the handle */
-	libusb_close(dev->device_handle);
+	event_thread_detach(dev->device_handle);
 
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	pthread_mutex_unlock(&dev->mutex);
+	LOG("%lu input reports received, %lu dropped\n", dev->reports_received, dev->reports_dropped);
+
+	/* Free the queue of received reports. */
+	free(dev->input_ring_buffer);
 
 	free_hid_device(dev);
 }
 
 
+int HID_API_EXPORT_CALL hid_get_input_statistics(hid_device *dev, unsigned long *received, unsigned long *dropped)
+{
+	*received = __atomic_load_n(&dev->reports_received, __ATOMIC_RELAXED);
+	*dropped = __atomic_load_n(&dev->reports_dropped, __ATOMIC_RELAXED);
+	return 0;
+}
+
 int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
 	return hid_get_indexed_string(dev, dev->manufacturer_index, string, maxlen);
@@ -268,6 +268,21 @@ extern "C" {
 		*/
 		int HID_API_EXPORT HID_API_CALL hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds);
 
+		/** @brief Count the input reports received from a HID device.
+
+			Reports are dropped, when they arrive faster than they are
+			read, and the input queue is full.
+
+			@ingroup API
+			@param dev A device handle returned from hid_open().
+			@param received Set to the number of reports queued.
+			@param dropped Set to the number of reports dropped.
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT_CALL hid_get_input_statistics(hid_device *dev, unsigned long *received, unsigned long *dropped);
+
 		/** @brief Read an Input report from a HID device.
 
 			Input reports are returned
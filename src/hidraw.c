@@ -0,0 +1,118 @@
+/*
+  Native hidraw transport
+
+  Exchanges HID reports with a USB HID device through its kernel hidraw node,
+  with plain write, poll and read on a file descriptor. Unlike HIDAPI (libusb),
+  the kernel driver stays attached, no USB devices are listed on open, and
+  no libusb event thread is needed.
+
+  The hidraw node is the device path found when probing. If it's missing, or
+  no longer belongs to the port (ex. a cached probe, from before the kernel
+  driver was detached and attached again), it's looked up from the port.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Unix */
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+
+/* Linux */
+#include <linux/hidraw.h>
+#include <linux/input.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+#include "hidusb.h"
+
+#include "hid_transport.h"
+
+struct hidraw_handle {
+  int fd;
+};
+
+static void * hidraw_open(struct _device_list *device){
+  struct hidraw_devinfo devinfo;
+  struct hidraw_handle *handle;
+  sds path;
+  int fd;
+
+  if ( device->path && hidraw_at_port(device->path, device->port) )
+    path = sdsdup(device->path);
+  else
+    path = find_hidraw_path(device->port);
+
+  if ( !sdslen(path) || (fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0 ) {
+    if ( info )
+      printf("Unable to open hidraw device of %s: %s\n", device->port, sdslen(path) ? strerror(errno) : "no hidraw node");
+    sdsfree(path);
+    return NULL;
+  }
+
+  // The node must still belong to a USB HID device
+  if ( ioctl(fd, HIDIOCGRAWINFO, &devinfo) < 0 || devinfo.bustype != BUS_USB ) {
+    if ( info )
+      printf("%s is not a USB HID device\n", path);
+    close(fd);
+    sdsfree(path);
+    return NULL;
+  }
+  sdsfree(path);
+
+  handle = (struct hidraw_handle *) malloc(sizeof(struct hidraw_handle));
+  handle->fd = fd;
+  return handle;
+}
+
+static int hidraw_write(void *h, const unsigned char *data, size_t length){
+  struct hidraw_handle *handle = (struct hidraw_handle *)h;
+  ssize_t result;
+
+  while ( (result = write(handle->fd, data, length)) < 0 && errno == EINTR );
+  return result;
+}
+
+/*
+  Read an input report. Wait up to <milliseconds> for it to arrive, forever if -1.
+  Return the length of the report, 0 on timeout or -1 on error.
+*/
+static int hidraw_read_timeout(void *h, unsigned char *data, size_t length, int milliseconds){
+  struct hidraw_handle *handle = (struct hidraw_handle *)h;
+  struct pollfd pollfd = { handle->fd, POLLIN, 0 };
+  ssize_t result;
+  int ready;
+
+  while ( (ready = poll(&pollfd, 1, milliseconds)) < 0 && errno == EINTR );
+  if ( ready < 0 || pollfd.revents & ( POLLERR | POLLHUP | POLLNVAL ) )
+    return -1;
+  if ( !ready )
+    return 0;
+
+  while ( (result = read(handle->fd, data, length)) < 0 && errno == EINTR );
+  if ( result < 0 && errno == EAGAIN )
+    return 0;
+  return result;
+}
+
+static void hidraw_close(void *h){
+  struct hidraw_handle *handle = (struct hidraw_handle *)h;
+
+  close(handle->fd);
+  free(handle);
+}
+
+const struct _hid_transport hidraw_transport = {
+  "hidraw",
+  hidraw_open,
+  hidraw_write,
+  hidraw_read_timeout,
+  hidraw_close
+};
@@ -18,6 +18,7 @@
 #include <assert.h>
 #include <malloc.h>
 #include <stddef.h>
+#include <limits.h>
 #include <wchar.h>
 #include <stdbool.h>
 
@@ -30,18 +31,29 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <grp.h>
+#include <dirent.h>
 
 /* Linux */
 #include <hidapi/hidapi.h>
 #include <glib.h>
 #include <libudev.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
 
 /* Application */
 #include "toolbox.h"
 #include "common.h"
 
+#include "stats.h"
+#include "walk.h"
+#include "hid_enum.h"
+
 #include "hidusb.h"
 
+#define HIDRAW_CLASS_DIR "/sys/class/hidraw"
+
+static int hidusb_enumerator = HIDUSB_ENUMERATE_UDEV;
+
 #ifndef _WCHAR_T_DEFINED
 // VSCode has a problem with using include paths....
 typedef unsigned short wchar_t;
@@ -75,209 +87,388 @@ void print_hid_device_info(struct hid_device_info * dev_info, struct _device_lis
 
 }  
 
-// Extension function for hid_enumerate(vendor_id, product_id) with extra match criterias
-struct hid_device_info * hidusb_enumerate_match(
-  unsigned int vendor_id, 
-  unsigned int product_id, 
-  char * serial_number, 
-  char * manufacturer_string,
-  char * path
-){
-  struct hid_device_info *device, *returned_list, empty_record;
-  wchar_t wstr[256];
-
-  // Make a startingpoint for linked list
-  returned_list = empty_record.next = &empty_record;
-
-  if ( !(device = hid_enumerate(vendor_id, product_id)) 
-    || device->product_string == NULL 
-    || device->path == NULL) { // Test with 0 ,0 
-    return NULL;  
+/*
+  Enumerate USB HID devices with libusb, that match the criterias. Devices
+  that can't be opened are left out, as they are claimed already by another
+  process.
+*/
+static struct hid_device_info * hidusb_enumerate_match(const struct hid_match *match){
+  struct hid_device_info *device, *next, *first = NULL, **last = &first;
+
+  for (device = hid_enumerate_matching(match); device; device = next) {
+    next = device->next;
+    device->next = NULL;
+    if ( !device->path || !device->product_string ) {
+      hid_free_enumeration(device);
+      continue;
+    }
+    *last = device;
+    last = &device->next;
   }
+  return first;
+}
 
-  for ( ; device ; device = device->next) {
-    if( !device->path )
-      continue;
-    
-    if (!device->product_string ) // Claimed already by other process
-      continue;
+struct hidraw_search {
+  const char *port;
+  sds device_path;
+};
 
-    // Match criterias
-    if ( serial_number
-      && !device->serial_number
-      && swprintf(wstr, sizeof(wstr), L"%hs", serial_number)
-      && !wcscmp(wstr, device->serial_number) ) 
-        continue;
+// Return true if the link target of a hidraw class entry is below the USB interface <port>
+static int hidraw_target_at_port(char *target, const char *port){
+  char *component[4];
+  int i;
 
-    if ( manufacturer_string
-      && !device->manufacturer_string
-      && swprintf(wstr, sizeof(wstr), L"%hs", manufacturer_string)
-      && !wcscmp(wstr, device->manufacturer_string) ) 
-        continue;
+  // Split off the last four path components
+  for (i = 0; i < 4; i++) {
+    if ( !(component[i] = strrchr(target, '/')) )
+      break;
+    *component[i]++ = '\0';
+  }
+  return i == 4 && !strcmp(component[1], "hidraw") && !strcmp(component[3], port);
+}
 
-    if ( path && strcmp( path, device->path ) )
-      continue;
+// Match a hidraw class entry to the port. The device path is set on a match
+static int hidraw_visit(struct walk_entry *entry, void *context){
+  struct hidraw_search *search = (struct hidraw_search *)context;
+  char target[PATH_MAX];
+  ssize_t length;
 
-    returned_list = returned_list->next = (struct hid_device_info *) malloc(sizeof(struct hid_device_info));
-    memcpy(returned_list,device,sizeof(struct hid_device_info));
-    returned_list->next = NULL;
+  if ( entry->type != DT_LNK || strncmp("hidraw", entry->name, 6) )
+    return WALK_PRUNE;
+
+  length = readlinkat(entry->dir_fd, entry->name, target, sizeof(target) - 1);
+  if ( length <= 0 )
+    return WALK_PRUNE;
+  target[length] = '\0';
+
+  if ( hidraw_target_at_port(target, search->port) ) {
+    search->device_path = sdscatprintf(search->device_path, "/dev/%s", entry->name);
+    return WALK_STOP;
   }
-  //hid_free_enumeration(device);
+  return WALK_PRUNE;
+}
 
-  if ( empty_record.next == &empty_record) 
-    return NULL;
-  return empty_record.next;
+/*
+  Return true if the hidraw device (ex. /dev/hidraw0) belongs to the port.
+  The node is recreated, maybe with another number, when the kernel driver is
+  detached and attached again.
+*/
+int hidraw_at_port(const char *device_path, const char *port){
+  char target[PATH_MAX];
+  ssize_t length;
+  sds link;
+
+  if ( !port || strncmp(device_path, "/dev/hidraw", 11) )
+    return false;
+
+  link = sysfs_path(HIDRAW_CLASS_DIR);
+  link = sdscatprintf(link, "/%s", device_path + 5);
+  length = readlink(link, target, sizeof(target) - 1);
+  sdsfree(link);
+  if ( length <= 0 )
+    return false;
+  target[length] = '\0';
+  return hidraw_target_at_port(target, port);
 }
 
-// Find path to coorsponding hidraw device kernel pseudo file.
+/*
+  Find path to coorsponding hidraw device kernel pseudo file.
+  Each entry in the hidraw class is a link to the hidraw device in sysfs:
+    ../../devices/<bus>/<USB device>/<USB interface>/<HID device>/hidraw/hidrawN
+  The USB interface is the port. Only the hidraw class is read, and the
+  search stops at the first match.
+*/
 sds find_hidraw_path(char *port){
-  sds device_path = sdsempty();
-  GList *sys_path;
-  char *path;
-  struct dirent *dp;
-  DIR *dir;
+  struct hidraw_search search = { port, sdsempty() };
+  sds class_dir;
 
   if ( !port || !strlen(port) )
-    return device_path;
-
-  // Find path to device kernel pseudo hidraw file 
-  sys_path = finddir( (char *)"/sys/devices", port);
-  if( !sys_path ) {
-    if ( info )
-      puts("  sysfs path not found");
-    return device_path;
-  }
-  if ( g_list_length(sys_path) > 1 ) {
-    if ( info ) 
-      puts("  too many candidates for sysfs path");
-    finddir_free(sys_path);
-    g_list_free(sys_path);
-    return device_path;
-  }
+    return search.device_path;
 
-  path = strdup( (const char*)g_list_nth(sys_path, 0)->data );
-  finddir_free(sys_path);
-  g_list_free(sys_path);
+  class_dir = sysfs_path(HIDRAW_CLASS_DIR);
+  if ( walk_tree(class_dir, 1, 0, hidraw_visit, &search) != SUCCESS && info )
+    puts("  No hidraw devices");
+  sdsfree(class_dir);
 
-  // Find hidraw directory and name of hidraw device
-  sys_path = finddir( path, (char *)"hidraw");
+  if ( info && !sdslen(search.device_path) )
+    puts("  hidraw device not found");
+  return search.device_path;
+}
 
-  if( !sys_path ) {
-    if ( info )
-      puts("  sysfs path not found");
-    return device_path;
+/*
+  Call the recognize function of all devices on this interface. 
+  Return a new device list entry, if the device is recognized, otherwise NULL.
+  If the hidraw path is not known, it's looked up.
+*/
+static struct _device_list * recognize_hidusb(int si_index, struct hid_device_info *hid_device, const char *hidraw_path){
+  const struct _supported_device * supported_device = NULL;
+  struct _device_list *entry;
+  int sdl_index;
+
+  for(sdl_index = 0; supported_interface[si_index].device[sdl_index].name; sdl_index++ ){
+    supported_device = &supported_interface[si_index].device[sdl_index];
+    if ( supported_device->recognize && supported_device->recognize(sdl_index, hid_device ) )
+      break;
   }
-    
-  if ( g_list_length(sys_path) > 1 ) {
+
+  if ( !supported_interface[si_index].device[sdl_index].name ) {
     if ( info ) 
-      puts("  too many candidates for sysfs path");
-    finddir_free(sys_path);
-    g_list_free(sys_path);
-    return device_path;
+      printf(" -- Not recognized\n");
+    return NULL;
   }
 
-  path = strdup( (const char*)g_list_nth(sys_path, 0)->data );
-  finddir_free(sys_path);
-  g_list_free(sys_path);
+  // Create a new entry for the list of active devices
+  entry = (struct _device_list *) malloc(sizeof(struct _device_list)); 
+  memset(entry, 0, sizeof(struct _device_list));
+
+  entry->name = sdsnew(supported_device->name);
+  entry->id = sdscatprintf(sdsempty(),
+            "hidusb#%04X:%04X:%ls:%ls#%s",
+            hid_device->vendor_id,
+            hid_device->product_id,
+            hid_device->serial_number ? : L"",
+            hid_device->manufacturer_string ? : L"",
+            hid_device->path 
+  );
+  entry->port = sdsnew(hid_device->path);
+  entry->path = hidraw_path ? sdsnew(hidraw_path) : find_hidraw_path(entry->port);
+  entry->group = sdsempty();
+  entry->action = supported_device->action;
+  entry->batch = supported_device->batch;
+  entry->si_index = si_index;
+
+  if ( info ) 
+    print_hid_device_info(hid_device, entry);
+
+  return entry;
+}
 
-  if ( !(dir = opendir(path)) ){
-    if ( info )
-      puts("  Unable to read system path");
-    free( path );
-    return device_path;
-  }
+// A string as a wide character string, or NULL. Free with free()
+static wchar_t * wcs(const char *str){
+  wchar_t *wstr;
+  size_t length;
 
-  // Find directory name that starts with hidraw
-  while ((dp = readdir(dir)) != NULL) {
-    if ( dp->d_type != DT_DIR )  
-        continue;
+  if ( !str )
+    return NULL;
+  length = strlen(str) + 1;
+  wstr = (wchar_t *)malloc(sizeof(wchar_t) * length);
+  swprintf(wstr, length, L"%hs", str);
+  return wstr;
+}
 
-    if( !strncmp("hidraw",dp->d_name,6) ) {
-      device_path = sdscatprintf(device_path,"/dev/%s",dp->d_name );
-      break;
-    }
-  }
-  closedir(dir);
-  return device_path;
+/*
+  Recognize a USB HID device, enumerated by udev. 
+  The port is the name of the USB interface, as hidapi (libusb) reports it.
+*/
+static struct _device_list * recognize_hidraw(int si_index, struct hidraw_device_info *hidraw){
+  struct hid_device_info hid_device;
+  struct _device_list *entry;
+
+  memset(&hid_device, 0, sizeof(hid_device));
+  hid_device.path = hidraw->port;
+  hid_device.vendor_id = hidraw->vendor_id;
+  hid_device.product_id = hidraw->product_id;
+  hid_device.release_number = hidraw->release_number;
+  hid_device.interface_number = hidraw->interface_number;
+  hid_device.serial_number = wcs(hidraw->serial_number);
+  hid_device.manufacturer_string = wcs(hidraw->manufacturer);
+  hid_device.product_string = wcs(hidraw->product);
+
+  if ( info ) printf("Found device at %s\n", hid_device.path);
+
+  entry = recognize_hidusb(si_index, &hid_device, hidraw->device_node);
+
+  free(hid_device.serial_number);
+  free(hid_device.manufacturer_string);
+  free(hid_device.product_string);
+  return entry;
+}
+
+// Select how HID USB devices are enumerated. Return FAILURE if the name is unknown
+int hidusb_select_enumerator(const char *name){
+  if ( !strcmp(name, "udev") )
+    hidusb_enumerator = HIDUSB_ENUMERATE_UDEV;
+  else if ( !strcmp(name, "libusb") )
+    hidusb_enumerator = HIDUSB_ENUMERATE_LIBUSB;
+  else
+    return FAILURE;
+  return SUCCESS;
 }
 
 /* 
   probe for HID USB devices that match relay drivers.
   When matched, add aan entry to the device list.
+
+  Devices are enumerated with udev, from sysfs, without opening them. If udev
+  is not available, or libusb is selected, they are enumerated with libusb.
+  The identifier is compiled into criterias, that both enumerators apply
+  while enumerating, so only matching devices are read.
 */  
 int probe_hidusb(int si_index, struct _device_identifier id, GList **device_list){
 
   struct hid_device_info *hid_device, *first_hid_device;
-  sds * sds_array;
-  int length;
-  int vendor_id = 0, product_id = 0;
-  sds serial_number = sdsempty();
-  sds manufacturer_string = sdsempty();
-  const struct _supported_device * supported_device;
+  struct hidraw_device_info *hidraw_device, *first_hidraw_device;
+  struct _device_list *entry;
+  struct hid_match match;
+  uint64_t start;
 
   assert(supported_interface[si_index].name);
 
-  // Split device id argument into components
-  if(id.device_id){
-    sds_array = sdssplitlen(id.device_id,sdslen(id.device_id), ":", 1, &length);
-    if (length >0 )  
-      vendor_id =strtol(sds_array[0],NULL,16);
-    if (length >1 )
-      product_id =strtol(sds_array[1],NULL,16);
-    if (length >2 )
-      serial_number = sdsnew(sds_array[2]);  
-    if (length >3 )
-      manufacturer_string = sdsnew(sds_array[3]);
-    sdsfreesplitres(sds_array, length); 
+  hid_match_compile(&id, &match);
+
+  start = stats_start();
+  if ( hidusb_enumerator == HIDUSB_ENUMERATE_UDEV
+    && !enumerate_hidraw_devices(&match, &first_hidraw_device) ) {
+    stats_stop("hidusb enumerate", "udev", start);
+
+    for (hidraw_device = first_hidraw_device; hidraw_device; hidraw_device = hidraw_device->next)
+      if ( (entry = recognize_hidraw(si_index, hidraw_device)) )
+        *device_list = g_list_append(*device_list, entry);
+
+    free_enumerate_hid_devices(first_hidraw_device);
+
+  } else {
+    // Get a list of USB HID devices (Linked with libusb-hidapi) 
+    first_hid_device = hid_device = hidusb_enumerate_match(&match);
+    stats_stop("hidusb enumerate", "libusb", start);
+    while (hid_device) {
+      if ( info ) printf("Found device at %s\n",hid_device->path);
+
+      if ( (entry = recognize_hidusb(si_index, hid_device, NULL)) )
+        *device_list = g_list_append(*device_list, entry);
+
+      hid_device = hid_device->next; 
+    }
+
+    hid_free_enumeration(first_hid_device);
   }
 
-  // Get a list of USB HID devices (Linked with libusb-hidapi) 
-  first_hid_device = hid_device = hidusb_enumerate_match(vendor_id, product_id, serial_number, manufacturer_string, id.port);
-  while (hid_device) {
-    int sdl_index;
+  hid_match_free(&match);
+  return SUCCESS;
+}   
 
-    if ( info ) printf("Found device at %s\n",hid_device->path);
+/*
+  Handle hotplug of a single HID USB device.
+*/
+int hotplug_hidusb(int si_index, struct udev_device *device, GList **device_list, GList **added, GList **removed){
+  struct udev_device *usb_interface;
+  struct hidraw_device_info *hidraw;
+  struct _device_list *entry;
+  const char *action = udev_device_get_action(device);
+  const char *subsystem = udev_device_get_subsystem(device);
+  const char *sysname = udev_device_get_sysname(device);
+  GList *iterator, *next;
+
+  if ( !action || !subsystem || !sysname )
+    return FAILURE;
+
+  /*
+    The USB interface or device is gone. A hidraw node alone is removed, when
+    a board is opened with libusb, and its kernel driver is detached. The
+    board is still there.
+  */
+  if ( !strcmp(action, "remove") ) {
+    if ( strcmp(subsystem, "usb") )
+      return SUCCESS;
+
+    for (iterator = *device_list; iterator; iterator = next) {
+      next = iterator->next;
+      entry = (struct _device_list *)iterator->data;
+      if ( entry->si_index != si_index || !entry->port )
+        continue;
 
-    // call recognize function for all devices, with this interface
-    for(sdl_index = 0; supported_interface[si_index].device[sdl_index].name; sdl_index++ ){
-      supported_device = &supported_interface[si_index].device[sdl_index];
-      if ( supported_device->recognize && supported_device->recognize(sdl_index, hid_device ) )
-        break;
+      // The port is the interface (1-1.4:1.0) of the device (1-1.4)
+      if ( !strcmp(entry->port, sysname)
+        || ( !strncmp(entry->port, sysname, strlen(sysname)) && entry->port[strlen(sysname)] == ':' ) ) {
+        *device_list = g_list_remove_link(*device_list, iterator);
+        *removed = g_list_concat(*removed, iterator);
+      }
     }
+    return SUCCESS;
+  }
 
-    // Add entry to list of active devices, if recognized        
-    if ( supported_interface[si_index].device[sdl_index].name ) {
-      struct _device_list *entry;
-
-      // Create a new entry in active device list
-      entry = (struct _device_list *) malloc(sizeof(struct _device_list)); 
-      memset(entry, 0, sizeof(struct _device_list));
-      *device_list = g_list_append(*device_list, entry);
-
-      entry->name = sdsnew(supported_device->name);
-      entry->id = sdscatprintf(sdsempty(),
-                "hidusb#%04X:%04X:%ls:%ls#%s",
-                hid_device->vendor_id,
-                hid_device->product_id,
-                hid_device->serial_number ? : L"",
-                hid_device->manufacturer_string ? : L"",
-                hid_device->path 
-      );
-      entry->port = sdsnew(hid_device->path);
-      entry->path = find_hidraw_path(entry->port);
-      entry->group = sdsempty();
-      entry->action = supported_device->action;
+  // The hidraw node is created last, so the device is ready to use when it appears
+  if ( strcmp(action, "add") || strcmp(subsystem, "hidraw") )
+    return SUCCESS;
 
-      if ( info ) 
-        print_hid_device_info(hid_device, entry);
+  if ( !(usb_interface = udev_device_get_parent_with_subsystem_devtype(device, "usb", "usb_interface")) )
+    return FAILURE;
 
-    } else if ( info ) 
-      printf(" -- Not recognized\n");
+  // Ignore devices, that are already in the list
+  for (iterator = *device_list; iterator; iterator = iterator->next) {
+    entry = (struct _device_list *)iterator->data;
+    if ( entry->si_index == si_index && entry->port && !strcmp(entry->port, udev_device_get_sysname(usb_interface)) )
+      return SUCCESS;
+  }
 
-    hid_device = hid_device->next; 
+  if ( (hidraw = hidraw_device_info_new(device)) ) {
+    if ( (entry = recognize_hidraw(si_index, hidraw)) )
+      *added = g_list_append(*added, entry);
+    free_enumerate_hid_devices(hidraw);
   }
 
-  hid_free_enumeration(first_hid_device);
   return SUCCESS;
-}   
+}
+
+/*
+  Open a fully qualified device directly, without enumerating.
+  The identifier must have all parts: vendor and product id, port and hidraw
+  device path. The identity of the device is verified with HIDIOCGRAWINFO, 
+  and the port must be the USB interface of the hidraw node.
+*/
+int direct_hidusb(int si_index, struct _device_identifier id, GList **device_list){
+  struct hidraw_devinfo devinfo;
+  struct udev *udev;
+  struct udev_device *hidraw;
+  struct hidraw_device_info *hidraw_device;
+  struct _device_list *entry = NULL;
+  unsigned int vendor_id, product_id;
+  int fd, result;
+
+  if ( !id.device_id || !id.port || !id.device_path 
+    || sscanf(id.device_id, "%x:%x", &vendor_id, &product_id) != 2
+    || !sdslen(id.port)
+    || strncmp(id.device_path, "/dev/hidraw", 11) )
+    return FAILURE;
+
+  if ( (fd = open(id.device_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0 ) 
+    return FAILURE;
+  result = ioctl(fd, HIDIOCGRAWINFO, &devinfo);
+  close(fd);
+
+  if ( result < 0 
+    || devinfo.bustype != BUS_USB
+    || (unsigned short)devinfo.vendor != vendor_id 
+    || (unsigned short)devinfo.product != product_id ) {
+    if ( info ) 
+      printf("%s is not %s\n", id.device_path, id.device_id);
+    return FAILURE;
+  }
+
+  if ( !(udev = udev_new()) )
+    return FAILURE;
 
+  if ( (hidraw = udev_device_new_from_subsystem_sysname(udev, "hidraw", id.device_path + 5)) ) {
+    if ( (hidraw_device = hidraw_device_info_new(hidraw)) ) {
+      entry = recognize_hidraw(si_index, hidraw_device);
+      free_enumerate_hid_devices(hidraw_device);
+    }
+    udev_device_unref(hidraw);
+  }
+  udev_unref(udev);
+
+  if ( !entry )
+    return FAILURE;
+
+  // The rest of the identifier must match too
+  entry->si_index = si_index;
+  if ( !match_identifier(entry, &id) ) {
+    if ( info ) 
+      printf("%s is not at port %s\n", id.device_path, id.port);
+    free_device_entry(entry);
+    return FAILURE;
+  }
+
+  *device_list = g_list_append(*device_list, entry);
+  return SUCCESS;
+}
@@ -3,6 +3,15 @@
 
 #include "common.h"
 
+// How HID USB devices are enumerated
+#define HIDUSB_ENUMERATE_UDEV   0   // From sysfs, without opening the devices
+#define HIDUSB_ENUMERATE_LIBUSB 1   // Open each device with libusb, to read its string descriptors
+
 int probe_hidusb(int si_index, struct _device_identifier id, GList **device_list);
+int direct_hidusb(int si_index, struct _device_identifier id, GList **device_list);
+sds find_hidraw_path(char *port);
+int hidraw_at_port(const char *device_path, const char *port);
+int hidusb_select_enumerator(const char *name);
+int hotplug_hidusb(int si_index, struct udev_device *device, GList **device_list, GList **added, GList **removed);
 
 #endif  
\ No newline at end of file
@@ -29,6 +29,16 @@
 #include "toolbox.h"
 #include "common.h"
 #include "version.h"
+#include "daemon.h"
+#include "monitor.h"
+#include "dispatch.h"
+#include "batch.h"
+#include "cache.h"
+#include "sysfs.h"
+#include "stats.h"
+#include "hid_transport.h"
+#include "hidusb.h"
+#include "pulse.h"
 
 #define DEBUG
 
@@ -90,6 +100,14 @@ static char args_doc[] = "[<identifier> [<attribute of device> [<action>]]]";
 
   /* Keys for options without short-options. */
 #define OPT_ABORT  1            /* –abort */
+#define OPT_SOCKET 2            /* --socket */
+#define OPT_NO_DAEMON 3         /* --no-daemon */
+#define OPT_NO_CACHE 4          /* --no-cache */
+#define OPT_STATS 5             /* --stats */
+#define OPT_RECONCILE 6         /* --reconcile */
+#define OPT_COALESCE 7          /* --coalesce */
+#define OPT_TRANSPORT 8         /* --transport */
+#define OPT_ENUMERATE 9         /* --enumerate */
 
 /* The options*/
 static struct argp_option options[] = {
@@ -99,6 +117,17 @@ static struct argp_option options[] = {
   {"monitor",   'm', "milliseconds", OPTION_ARG_OPTIONAL, "Monitor device"},
   {"changes",   'c', 0, 0, "Show only changes when monitoring"},
   {"supported", 's', 0, 0, "List supported devices"},
+  {"jobs",      'j', "N", 0, "Interact with up to N matching devices concurrently (default 8)"},
+  {"daemon",    'd', 0, 0, "Run as daemon. Keep devices probed and serve requests on a socket"},
+  {"socket",    OPT_SOCKET, "path", 0, "Daemon socket (default " DEVIA_SOCKET ")"},
+  {"no-daemon", OPT_NO_DAEMON, 0, 0, "Don't forward the request to a running daemon"},
+  {"no-cache",  OPT_NO_CACHE, 0, 0, "Probe devices, even if the result of an identical probe is cached"},
+  {"stats",     OPT_STATS, 0, 0, "Print time spent in each phase. When monitoring, print latency percentiles per device on exit or SIGUSR1"},
+  {"reconcile", OPT_RECONCILE, "milliseconds", 0, "Read the relay state of a controller at least this often (default 1000, 0 when monitoring). In between, the state last read or written is used. 0 reads before every action"},
+  {"coalesce",  OPT_COALESCE, "milliseconds", 0, "Wait this long for more actions on a device, and perform them as one (default 0). For a daemon serving several clients"},
+  {"transport", OPT_TRANSPORT, "hidapi|hidraw", 0, "How to reach USB HID relay controllers: Through libusb (default), or directly through the kernel hidraw device"},
+  {"enumerate", OPT_ENUMERATE, "udev|libusb", 0, "How to find USB HID devices: From sysfs with udev (default), or by opening each device with libusb"},
+  {"batch",     'b', "file", OPTION_ARG_OPTIONAL, "Read commands from file (default stdin), one per line: <identifier> <attribute> [<action>]"},
   { 0 }
 };
 
@@ -110,10 +139,18 @@ struct arguments {
   int monitor; // -m
   int milliseconds;
   int changes; // -c
+  int jobs; // -j
+  int daemon; // -d
+  int no_daemon;
+  char * socket;
+  int batch; // -b
+  char * batch_file;
   int no_arg;
+  char * identifier;
   struct _device_identifier id;
   char * attribute;
   char * action;
+  struct dispatch_options options; // --reconcile and --coalesce, if given
 };
 
 void print_arguments(struct arguments argument) {
@@ -123,6 +160,11 @@ void print_arguments(struct arguments argument) {
   printf("  Show extra info:        %s\n", argument.info ? "true" : "false");
   printf("  Monitor device (%dms):  %s\n", argument.milliseconds, argument.no_arg ? "true" : "false");
   printf("  Changes only:           %s\n", argument.changes ? "true" : "false");
+  printf("  Concurrent jobs:        %d\n", argument.jobs);
+  printf("  Run as daemon:          %s\n", argument.daemon ? "true" : "false");
+  printf("  Use probe cache:        %s\n", probe_cache ? "true" : "false");
+  printf("  Daemon socket:          %s\n", argument.socket);
+  printf("  Batch:                  %s %s\n", argument.batch ? "true" : "false", argument.batch_file ? argument.batch_file : "");
   printf("  no arguments:           %s\n", argument.no_arg ? "true" : "false");
   printf("  device identifier:\n");
   printf("     interface:   %s\n", argument.id.interface); 
@@ -141,6 +183,7 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
   switch (key) {
     case 'l': 
       argument->list = true;
+      sysfs_list_attributes = true;
       break;
      case 'i':
       info = argument->info = true;
@@ -155,6 +198,42 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
     case 'c':
       argument->changes = true;
       break;  
+    case 'j':
+      argument->jobs = atoi(arg) > 0 ? atoi(arg) : 1;
+      break;  
+    case 'd':
+      argument->daemon = true;
+      break;  
+    case OPT_SOCKET:
+      argument->socket = arg;
+      break;  
+    case OPT_NO_DAEMON:
+      argument->no_daemon = true;
+      break;  
+    case OPT_NO_CACHE:
+      probe_cache = false;
+      break;  
+    case OPT_STATS:
+      stats_enabled = true;
+      break;  
+    case OPT_RECONCILE:
+      hid_reconcile_ms = argument->options.reconcile_ms = atoi(arg) > 0 ? atoi(arg) : 0;
+      break;  
+    case OPT_COALESCE:
+      coalesce_ms = argument->options.coalesce_ms = atoi(arg) > 0 ? atoi(arg) : 0;
+      break;  
+    case OPT_TRANSPORT:
+      if ( hid_select_transport(arg) )
+        argp_error(state, "Unknown transport '%s'", arg);
+      break;  
+    case OPT_ENUMERATE:
+      if ( hidusb_select_enumerator(arg) )
+        argp_error(state, "Unknown enumerator '%s'", arg);
+      break;  
+    case 'b':
+      argument->batch = true;
+      argument->batch_file = arg;
+      break;  
     case ARGP_KEY_ARG:
       /* There are remaining arguments not parsed by any parser, which may be found
       starting at (STATE->argv + STATE->next).  If success is returned, but
@@ -162,30 +241,10 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
       otherwise, the parser should adjust STATE->next to reflect any arguments
       consumed.  */
       switch (state->arg_num) {
-        case 0: { // split unique device identifier 
-          int length;
-          sds *sds_array;
-          
-          sds_array = sdssplitlen(arg,strlen(arg), "#", 1, &length);
-          /*
-          printf("unique device identifier Array = {\n");
-          for (int i = 0; i < length; i++)
-            printf("%d %s\n", i, sds_array[i]);
-          printf("}\n");
-          */
-          do {
-            if(length < 1) break;
-            argument->id.interface = sdsnew(sds_array[0]);
-            if(length < 2) break;
-            argument->id.device_id = sdsnew(sds_array[1]);
-            if(length < 3) break; 
-            argument->id.port = sdsnew(sds_array[2]);            
-            if(length < 4) break; 
-            argument->id.device_path = sdsnew(sds_array[3]);
-          }while ( 0 );
-          sdsfreesplitres(sds_array, length); 
+        case 0: // split unique device identifier 
+          argument->identifier = arg;
+          parse_identifier(arg, &argument->id);
           break;
-        }
         
         case 1: // Attribute to operate 
           argument->attribute = arg;
@@ -196,6 +255,10 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
           argument->action = arg;
           strtolower(argument->action);
           break;
+
+        case 3: // Argument of the action. Ex. pulse <ms>
+          argument->action = sdscatprintf(sdsnew(argument->action), " %s", arg);
+          break;
       }  
       break;
 
@@ -204,7 +267,7 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state) {
 
     /* There are no more command line arguments at all.  */
     case ARGP_KEY_END:
-      if ( argument->no_arg && !argument->list && !argument->list_supported_devices) 
+      if ( argument->no_arg && !argument->list && !argument->list_supported_devices && !argument->daemon && !argument->batch) 
         argp_usage(state); // exit
       break;
       /* Because it's common to want to do some special processing if there aren't
@@ -245,82 +308,114 @@ int main (int argc, char **argv) {
   struct arguments argument;
   struct _device_list *entry;
   GList *device_list = NULL, *iterator = NULL;
+  uint64_t start = stats_time_us();
 
   // Parse arguments
   memset(&argument,0,sizeof(argument));
+  argument.socket = (char *)DEVIA_SOCKET;
+  argument.jobs = DEFAULT_JOBS;
+  argument.options.reconcile_ms = argument.options.coalesce_ms = -1;
   argp_parse (&argp, argc, argv, 0, 0, &argument);
+  stats_stop("parse arguments", NULL, start);
+
+  // Monitor polls read the device, to see changes made by others, unless told otherwise
+  if ( argument.monitor && argument.options.reconcile_ms < 0 )
+    hid_reconcile_ms = 0;
   
   if ( info ) 
     print_arguments(argument);
   
-  // loop through supported devices
-  // probe devices and make a list of actual matching devices.
-  for( i = 0; supported_interface[i].name; i++) {
-    
-    // List supported interface and devices
-    if( argument.list_supported_devices ) {
+  // List supported interface and devices
+  if( argument.list_supported_devices ) {
+    for( i = 0; supported_interface[i].name; i++) {
       printf("%s:\n", supported_interface[i].description);
       for(int ii = 0; supported_interface[i].device[ii].name; ii++)
         printf("  %s - %s\n",supported_interface[i].device[ii].name, supported_interface[i].device[ii].description);
+    }
+    exit(0);
+  }
+
+  if ( argument.daemon ) 
+    exit( daemon_serve(argument.socket, argument.jobs) ? 1 : 0 );
+
+  // Execute a list of commands
+  if ( argument.batch ) {
+    FILE *input = stdin;
 
-    // Skip unwanted interfaces  
-    } else if ( argument.id.interface 
-          && strcmp(argument.id.interface, supported_interface[i].name) ) {
-        continue;    
-
-    // Probe and make a list of mathched devices
-    } else { 
-      if ( info )
-        printf("Probing %s\n",  supported_interface[i].name);
-      if ( supported_interface[i].probe )
-        supported_interface[i].probe(i,argument.id, &device_list);
-    }  
+    if ( argument.batch_file && strcmp(argument.batch_file, "-") && !(input = fopen(argument.batch_file, "r")) ) {
+      perror(argument.batch_file);
+      exit(1);
+    }
+    i = batch_run(input, argument.jobs);
+    if ( input != stdin )
+      fclose(input);
+    pulse_wait();
+    hid_pool_close();
+    stats_print();
+    if ( stats_enabled ) {
+      pulse_print_statistics();
+      hid_print_statistics();
+    }
+    exit( i ? 1 : 0 );
   }
 
-  if( argument.list_supported_devices ) 
+  // Let a running daemon do the work 
+  if ( argument.identifier && !argument.no_daemon && !argument.list && !argument.monitor && !info && !stats_enabled
+    && daemon_forward(argument.socket, &argument.options, argument.identifier, argument.attribute, argument.action) == SUCCESS )
     exit(0);
+
+  // Open a fully qualified device directly, or probe devices and make a list of actual matching devices.
+  if ( argument.list || open_devices(argument.id, &device_list) )
+    probe_devices(argument.id, &device_list);
   
   if ( info && argument.list ) 
       puts("----------------------------------------------------------------------");
   
-  if ( !g_list_length(device_list) )
-    puts("No devices found");
+  // Monitor, and wait for matching devices to be plugged in 
+  if ( argument.monitor && !argument.list ) {
+    if ( !g_list_length(device_list) ) {
+      puts("No devices found");
+      fflush(stdout);
+    }
+    monitor_devices(&device_list, &argument.id, argument.attribute, argument.action, argument.milliseconds, argument.changes);
 
-  else do {
-    int start_time_clk = clock();
-    int sleep_time_ms = 0;
+  } else if ( !g_list_length(device_list) ) {
+    puts("No devices found");
 
+  // List device and group owner (to discourage use of root privilliges)  
+  } else if ( argument.list ) {
     for (iterator = device_list; iterator; iterator = iterator->next) {
       entry = (struct _device_list *)iterator->data;
 
       assert(entry->name);
       assert(entry->id);
    
-      // List device and group owner (to discourage use of root privilliges)  
-      if (argument.list) {
-        printf("%s  id: %s",entry->name, entry->id);
-        if ( sdslen(entry->path) ) printf(" Path: %s",entry->path);
-        if ( sdslen(entry->group) ) printf(" Group: %s",entry->group);
-        puts("");
-      // Interact with matched devices
-      } else {
-        sds reply = sdsempty();
-        entry->action(entry, argument.attribute, argument.action, &reply);
-        if ( !argument.changes || !entry->reply || sdscmp(entry->reply, reply) )
-          printf("%s %s\n",entry->id, reply[0] ? reply : "No reply");
-        if ( entry->reply) sdsfree(entry->reply); 
-        entry->reply = reply;
-      }
+      printf("%s  id: %s",entry->name, entry->id);
+      if ( sdslen(entry->path) ) printf(" Path: %s",entry->path);
+      if ( sdslen(entry->group) ) printf(" Group: %s",entry->group);
+      puts("");
     }
 
-    if( argument.monitor || !argument.list ) {
-      sleep_time_ms = argument.milliseconds - ( start_time_clk - clock() ) * 1000 / CLOCKS_PER_SEC;
-      if ( sleep_time_ms > 10 ) usleep( sleep_time_ms * 1000 );
+  // Interact with matched devices
+  } else {
+    sds *reply = dispatch_actions(device_list, argument.attribute, argument.action, argument.jobs, NULL);
 
-    } else
-      break;  
+    for (i = 0, iterator = device_list; iterator; iterator = iterator->next, i++) {
+      entry = (struct _device_list *)iterator->data;
+      printf("%s %s\n",entry->id, reply[i][0] ? reply[i] : "No reply");
+    }
+    dispatch_free(reply);
+  }
 
-  } while ( argument.monitor );
+  pulse_wait();
+  hid_pool_close();
+  if ( info )
+    cache_print_statistics();
+  stats_print();
+  if ( stats_enabled ) {
+    pulse_print_statistics();
+    hid_print_statistics();
+  }
 
   //g_list_free(device_list);
   exit (0);
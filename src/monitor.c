@@ -0,0 +1,475 @@
+/*
+
+  Monitor devices
+
+  Event driven monitor loop, built on epoll.
+
+  Devices that can signal a change on a file descriptor (ex. sysfs attributes
+  that support POLLPRI) are read when the kernel reports a change.
+  Devices that can only be polled, are scheduled on a timer wheel, driven by
+  a one-shot timerfd, armed to the next due poll. An idle system uses no CPU.
+
+  A udev monitor socket is watched too. When hardware is plugged or unplugged,
+  only the affected entries in the device list are updated, by the hotplug
+  function of the interface. New devices are read right away.
+
+  Poll times are measured on the monotonic wall clock, and each device is
+  scheduled independently of the others.
+
+  With --stats, the latency of each device is recorded, and percentiles are
+  printed on SIGUSR1 and when the monitor is interrupted.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+#include <signal.h>
+
+/* Unix */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <fcntl.h>
+
+/* Linux */
+#include <glib.h>
+#include <libudev.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#include "monitor.h"
+#include "stats.h"
+#include "hid_transport.h"
+#include "pulse.h"
+
+#define WHEEL_SLOTS 256         // Number of slots in the timer wheel
+#define WHEEL_TICK_MS 10        // Resolution of the timer wheel
+#define MAX_EVENTS 32
+
+// A monitored device
+struct monitor_watch {
+  struct _device_list *device;
+  int fd;                       // File descriptor that signals changes, or -1 if polled
+  uint64_t due;                 // Tick at which a polled device is due
+  struct stats_window *latency; // Latest action latencies, with --stats
+};
+
+// Hashed timer wheel of polled devices. Each slot holds watches, due at tick % WHEEL_SLOTS
+struct timer_wheel {
+  GList *slot[WHEEL_SLOTS];
+  uint64_t tick;                // Last processed tick
+  int count;                    // Number of scheduled watches
+};
+
+struct monitor {
+  int epoll_fd;
+  int timer_fd;
+  int signal_fd;
+  struct udev *udev;
+  struct udev_monitor *udev_monitor;
+  struct timer_wheel wheel;
+  uint64_t start_ms;
+  int interval_ticks;
+  sds attribute;
+  sds action;
+  int changes;
+  GList *watches;
+  GList *released;              // Watches of removed devices, freed after the current events
+  GList **device_list;
+  struct _device_identifier *id;
+};
+
+// Monotonic wall clock in milliseconds
+uint64_t monitor_time_ms(void){
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static uint64_t current_tick(struct monitor *monitor){
+  return ( monitor_time_ms() - monitor->start_ms ) / WHEEL_TICK_MS;
+}
+
+static void wheel_add(struct timer_wheel *wheel, struct monitor_watch *watch, uint64_t due){
+  watch->due = due;
+  wheel->slot[due % WHEEL_SLOTS] = g_list_prepend(wheel->slot[due % WHEEL_SLOTS], watch);
+  wheel->count++;
+}
+
+// Arm the timer to the earliest due watch, or disarm it if nothing is scheduled
+static void wheel_arm(struct monitor *monitor){
+  struct itimerspec timer;
+  uint64_t tick, next = 0, ms;
+  GList *iterator;
+
+  memset(&timer, 0, sizeof(timer));
+
+  if ( monitor->wheel.count ) {
+    // Find the first slot, within one revolution, with a watch that is due
+    for (tick = monitor->wheel.tick + 1; !next && tick <= monitor->wheel.tick + WHEEL_SLOTS; tick++) 
+      for (iterator = monitor->wheel.slot[tick % WHEEL_SLOTS]; iterator; iterator = iterator->next)
+        if ( ((struct monitor_watch *)iterator->data)->due <= tick ) {
+          next = tick;
+          break;
+        }
+
+    // Nothing due in this revolution. Wake up when passing the last slot
+    if ( !next )
+      next = monitor->wheel.tick + WHEEL_SLOTS;
+
+    ms = monitor->start_ms + next * WHEEL_TICK_MS;
+    timer.it_value.tv_sec = ms / 1000;
+    timer.it_value.tv_nsec = ( ms % 1000 ) * 1000000;
+  }
+
+  timerfd_settime(monitor->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+}
+
+// Print the reply, if it has changed or all replies are wanted
+static void report(struct monitor *monitor, struct _device_list *device, sds reply){
+  if ( !monitor->changes || !device->reply || sdscmp(device->reply, reply) ) {
+    printf("%s %s\n",device->id, reply[0] ? reply : "No reply");
+    fflush(stdout);
+  }
+  sdsfree(device->reply);
+  device->reply = reply;
+}
+
+static void run_action(struct monitor *monitor, struct monitor_watch *watch){
+  sds reply = sdsempty();
+  uint64_t start = stats_start();
+
+  watch->device->action(watch->device, monitor->attribute, monitor->action, &reply);
+  if ( watch->latency )
+    stats_window_add(watch->latency, stats_time_us() - start);
+  report(monitor, watch->device, reply);
+}
+
+// Print latency percentiles of all devices
+static void print_latency(struct monitor *monitor){
+  struct monitor_watch *watch;
+
+  for (GList *iterator = monitor->watches; iterator; iterator = iterator->next) {
+    watch = (struct monitor_watch *)iterator->data;
+    if ( watch->latency )
+      stats_window_print(watch->device->id, watch->latency);
+  }
+  fflush(stdout);
+}
+
+// Print statistics on SIGUSR1. Stop monitoring on SIGINT or SIGTERM
+static int signal_open(struct monitor *monitor){
+  struct epoll_event event;
+  sigset_t mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  if ( sigprocmask(SIG_BLOCK, &mask, NULL) 
+    || (monitor->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 )
+    return FAILURE;
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = &monitor->signal_fd;
+  return epoll_ctl(monitor->epoll_fd, EPOLL_CTL_ADD, monitor->signal_fd, &event);
+}
+
+// Return true if monitoring should stop
+static int signal_event(struct monitor *monitor){
+  struct signalfd_siginfo siginfo;
+  int stop = false;
+
+  while ( read(monitor->signal_fd, &siginfo, sizeof(siginfo)) == sizeof(siginfo) ) {
+    print_latency(monitor);
+    if ( siginfo.ssi_signo == SIGUSR1 )
+      stats_print();
+    else
+      stop = true;
+  }
+  return stop;
+}
+
+// Poll all devices that are due, and reschedule them
+static void wheel_expire(struct monitor *monitor){
+  struct timer_wheel *wheel = &monitor->wheel;
+  GList *due = NULL, *iterator, *next;
+  uint64_t now = current_tick(monitor);
+  struct monitor_watch *watch;
+
+  // Catch up on all slots passed since last time. At most one revolution
+  if ( now - wheel->tick > WHEEL_SLOTS )
+    wheel->tick = now - WHEEL_SLOTS;
+
+  while ( wheel->tick < now ) {
+    int slot = ++wheel->tick % WHEEL_SLOTS;
+    for (iterator = wheel->slot[slot]; iterator; iterator = next) {
+      next = iterator->next;
+      watch = (struct monitor_watch *)iterator->data;
+      if ( watch->due <= now ) {
+        wheel->slot[slot] = g_list_delete_link(wheel->slot[slot], iterator);
+        wheel->count--;
+        due = g_list_append(due, watch);
+      }
+    }
+  }
+
+  for (iterator = due; iterator; iterator = iterator->next) {
+    watch = (struct monitor_watch *)iterator->data;
+    run_action(monitor, watch);
+
+    // Keep the schedule of the device. Skip polls, if the device is too slow to keep up
+    watch->due += monitor->interval_ticks;
+    if ( watch->due <= current_tick(monitor) )
+      watch->due = current_tick(monitor) + 1;
+    wheel_add(wheel, watch, watch->due);
+  }
+  g_list_free(due);
+}
+
+static void wheel_remove(struct timer_wheel *wheel, struct monitor_watch *watch){
+  GList **slot = &wheel->slot[watch->due % WHEEL_SLOTS];
+
+  if ( g_list_find(*slot, watch) ) {
+    *slot = g_list_remove(*slot, watch);
+    wheel->count--;
+  }
+}
+
+// Read a device, and watch it for changes or schedule it for polling
+static void watch_add(struct monitor *monitor, struct _device_list *device){
+  struct monitor_watch *watch;
+  struct epoll_event event;
+
+  watch = (struct monitor_watch *)malloc(sizeof(struct monitor_watch));
+  memset(watch, 0, sizeof(struct monitor_watch));
+  watch->device = device;
+  watch->fd = device->watch ? device->watch(device, monitor->attribute) : -1;
+  if ( stats_enabled ) {
+    watch->latency = (struct stats_window *)malloc(sizeof(struct stats_window));
+    memset(watch->latency, 0, sizeof(struct stats_window));
+  }
+  monitor->watches = g_list_append(monitor->watches, watch);
+
+  run_action(monitor, watch);
+
+  if ( watch->fd >= 0 ) {
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLPRI | EPOLLERR;
+    event.data.ptr = watch;
+    if ( !epoll_ctl(monitor->epoll_fd, EPOLL_CTL_ADD, watch->fd, &event) ) {
+      if ( info )
+        printf("Watching %s\n", device->id);
+      return;
+    }
+    close(watch->fd);
+    watch->fd = -1;
+  }
+  wheel_add(&monitor->wheel, watch, current_tick(monitor) + monitor->interval_ticks);
+}
+
+// Stop watching a device, that is gone. 
+static void watch_remove(struct monitor *monitor, struct _device_list *device){
+  struct monitor_watch *watch;
+  GList *iterator;
+
+  for (iterator = monitor->watches; iterator; iterator = iterator->next)
+    if ( ((struct monitor_watch *)iterator->data)->device == device )
+      break;
+  if ( !iterator )
+    return;
+
+  watch = (struct monitor_watch *)iterator->data;
+  monitor->watches = g_list_delete_link(monitor->watches, iterator);
+  if ( watch->fd >= 0 )
+    close(watch->fd);
+  else
+    wheel_remove(&monitor->wheel, watch);
+
+  // Events for this watch may still be pending
+  watch->device = NULL;
+  free(watch->latency);
+  watch->latency = NULL;
+  monitor->released = g_list_append(monitor->released, watch);
+}
+
+static int udev_monitor_open(struct monitor *monitor){
+  struct epoll_event event;
+  int fd;
+
+  if ( !(monitor->udev = udev_new()) )
+    return FAILURE;
+
+  if ( !(monitor->udev_monitor = udev_monitor_new_from_netlink(monitor->udev, "udev")) ) {
+    udev_unref(monitor->udev);
+    monitor->udev = NULL;
+    return FAILURE;
+  }
+
+  udev_monitor_filter_add_match_subsystem_devtype(monitor->udev_monitor, "hidraw", NULL);
+  udev_monitor_filter_add_match_subsystem_devtype(monitor->udev_monitor, "usb", NULL);
+  udev_monitor_filter_add_match_subsystem_devtype(monitor->udev_monitor, "w1", NULL);
+  udev_monitor_enable_receiving(monitor->udev_monitor);
+
+  if ( (fd = udev_monitor_get_fd(monitor->udev_monitor)) < 0 )
+    return FAILURE;
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = monitor->udev_monitor;
+  return epoll_ctl(monitor->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static void udev_event(struct monitor *monitor){
+  struct udev_device *device;
+  GList *added, *removed, *iterator;
+  struct _device_list *entry;
+
+  while ( (device = udev_monitor_receive_device(monitor->udev_monitor)) ) {
+    if ( info )
+      printf("udev: %s %s %s\n",
+        udev_device_get_action(device),
+        udev_device_get_subsystem(device),
+        udev_device_get_sysname(device)
+      );
+
+    added = removed = NULL;
+    hotplug_devices(device, monitor->id, monitor->device_list, &added, &removed);
+    udev_device_unref(device);
+
+    for (iterator = removed; iterator; iterator = iterator->next) {
+      entry = (struct _device_list *)iterator->data;
+      if ( info )
+        printf("Removed %s\n", entry->id);
+      watch_remove(monitor, entry);
+      free_device_entry(entry);
+    }
+
+    for (iterator = added; iterator; iterator = iterator->next) {
+      if ( info )
+        printf("Added %s\n", ((struct _device_list *)iterator->data)->id);
+      watch_add(monitor, (struct _device_list *)iterator->data);
+    }
+
+    g_list_free(added);
+    g_list_free(removed);
+  }
+}
+
+/*
+  Monitor devices, until interrupted.
+  Devices are read when they signal a change, or polled every <milliseconds>
+  Devices that are plugged in, and match the identifier, are added to the 
+  device list, and devices that are unplugged, are removed.
+*/
+int monitor_devices(GList **device_list, struct _device_identifier *id, sds attribute, sds action, int milliseconds, int changes){
+  struct monitor monitor;
+  struct epoll_event event, events[MAX_EVENTS];
+  struct monitor_watch *watch;
+  GList *iterator;
+  int count, stop = false;
+
+  memset(&monitor, 0, sizeof(monitor));
+  monitor.signal_fd = -1;
+  monitor.device_list = device_list;
+  monitor.id = id;
+  monitor.attribute = attribute;
+  monitor.action = action;
+  monitor.changes = changes;
+  monitor.interval_ticks = milliseconds / WHEEL_TICK_MS > 0 ? milliseconds / WHEEL_TICK_MS : 1;
+  monitor.start_ms = monitor_time_ms();
+
+  if ( (monitor.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0
+    || (monitor.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ) {
+    perror("Unable to create monitor");
+    return FAILURE;
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = &monitor.wheel;
+  epoll_ctl(monitor.epoll_fd, EPOLL_CTL_ADD, monitor.timer_fd, &event);
+
+  if ( udev_monitor_open(&monitor) && info )
+    puts("No udev monitor. Hot plugging is not detected");
+
+  if ( stats_enabled && signal_open(&monitor) )
+    perror("Unable to handle signals");
+
+  // Read all devices once, and set up watches
+  for (iterator = *device_list; iterator; iterator = iterator->next) 
+    watch_add(&monitor, (struct _device_list *)iterator->data);
+
+  while ( !stop ) {
+    wheel_arm(&monitor);
+
+    count = epoll_wait(monitor.epoll_fd, events, MAX_EVENTS, -1);
+    if ( count < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      perror("Monitor failed");
+      break;
+    }
+
+    for (int i = 0; i < count; i++) {
+      if ( events[i].data.ptr == &monitor.wheel ) {
+        uint64_t expirations;
+        if ( read(monitor.timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN )
+          perror("Timer");
+        wheel_expire(&monitor);
+
+      } else if ( monitor.udev_monitor && events[i].data.ptr == monitor.udev_monitor ) {
+        udev_event(&monitor);
+
+      } else if ( events[i].data.ptr == &monitor.signal_fd ) {
+        stop = signal_event(&monitor);
+
+      } else {
+        char buffer[64];
+        watch = (struct monitor_watch *)events[i].data.ptr;
+        if ( !watch->device )
+          continue;
+        // Acknowledge the notification, by rereading the attribute
+        lseek(watch->fd, 0, SEEK_SET);
+        while ( read(watch->fd, buffer, sizeof(buffer)) > 0 );
+        run_action(&monitor, watch);
+      }
+    }
+
+    g_list_free_full(monitor.released, free);
+    monitor.released = NULL;
+    hid_pool_expire();
+  }
+
+  for (iterator = monitor.watches; iterator; iterator = iterator->next) {
+    watch = (struct monitor_watch *)iterator->data;
+    if ( watch->fd >= 0 )
+      close(watch->fd);
+    free(watch->latency);
+    free(watch);
+  }
+  g_list_free(monitor.watches);
+  g_list_free_full(monitor.released, free);
+  for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+    g_list_free(monitor.wheel.slot[slot]);
+
+  if ( monitor.signal_fd >= 0 ) close(monitor.signal_fd);
+  close(monitor.timer_fd);
+  close(monitor.epoll_fd);
+  if ( monitor.udev_monitor ) udev_monitor_unref(monitor.udev_monitor);
+  if ( monitor.udev ) udev_unref(monitor.udev);
+  pulse_wait();
+  hid_pool_close();
+  return stop ? SUCCESS : FAILURE;
+}
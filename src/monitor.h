@@ -0,0 +1,13 @@
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <stdint.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+int monitor_devices(GList **device_list, struct _device_identifier *id, sds attribute, sds action, int milliseconds, int changes);
+uint64_t monitor_time_ms(void);
+
+#endif
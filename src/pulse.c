@@ -0,0 +1,300 @@
+/*
+  Relay pulses
+
+  A pulse switches relays on (or off) and back again after a number of
+  milliseconds. The driver switches the relays, and schedules the end of the
+  pulse here. A timer wheel, driven by a timerfd on its own thread, ends the
+  pulses in time. Pulses on the same controller that end in the same tick are
+  ended with a single write.
+
+  The on-time of each pulse is measured, from the write that started it to
+  the write that ended it, and the error printed with --stats.
+
+  If the write that ends a pulse fails, the relays are still energised. The
+  failure is reported, and the pulse is put back on the wheel, to be ended
+  again a little later, a few times.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Unix */
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+/* Linux */
+#include <glib.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+#include "stats.h"
+
+#include "pulse.h"
+
+struct pulse {
+  struct _device_list *device;  // Copy of the device entry
+  uint16_t on;                  // Relays to switch on, when the pulse ends
+  uint16_t off;                 // Relays to switch off, when the pulse ends
+  int ms;
+  uint64_t started;             // µs
+  uint64_t end;                 // µs, when the pulse is to be ended
+  uint64_t due;                 // Tick
+  int retries;                  // Failed attempts to end the pulse
+};
+
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t idle;
+  int timer_fd;
+  int running;                  // The wheel thread is started
+  int pending;                  // Pulses not yet ended
+  uint64_t origin;              // µs at tick 0
+  uint64_t tick;                // Last tick processed
+  GList *slot[PULSE_SLOTS];
+  struct stats_window error;
+} wheel = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, -1 };
+
+// Copy the fields of a device entry, needed to perform actions on it
+static struct _device_list * copy_device(struct _device_list *device){
+  struct _device_list *copy;
+
+  copy = (struct _device_list *) malloc(sizeof(struct _device_list));
+  memset(copy, 0, sizeof(struct _device_list));
+  copy->name = sdsdup(device->name);
+  copy->id = sdsdup(device->id);
+  copy->port = sdsdup(device->port);
+  copy->path = sdsdup(device->path);
+  copy->group = sdsdup(device->group);
+  copy->action = device->action;
+  copy->batch = device->batch;
+  copy->si_index = device->si_index;
+  return copy;
+}
+
+// Run or stop the timer, while pulses are pending. Ticks are aligned to the origin of the wheel
+static void arm_timer(int run){
+  struct itimerspec period;
+  uint64_t next;
+
+  memset(&period, 0, sizeof(period));
+  if ( run ) {
+    next = wheel.origin + ( ( stats_time_us() - wheel.origin ) / PULSE_TICK_US + 1 ) * PULSE_TICK_US;
+    period.it_value.tv_sec = next / 1000000;
+    period.it_value.tv_nsec = ( next % 1000000 ) * 1000;
+    period.it_interval.tv_nsec = PULSE_TICK_US * 1000;
+  }
+  timerfd_settime(wheel.timer_fd, TFD_TIMER_ABSTIME, &period, NULL);
+}
+
+// Return true if two pulses are on the same controller
+static int same_device(struct _device_list *a, struct _device_list *b){
+  return a->si_index == b->si_index && !strcmp(a->port, b->port);
+}
+
+static void add_pulse(struct pulse *pulse);
+
+// Switch the relays of pulses that ended on the same controller, with one write
+static void end_pulses(GList *ended){
+  struct _device_list *device;
+  struct pulse *pulse;
+  GList *iterator, *next;
+  uint16_t on, off;
+  sds attribute, action = NULL, reply;
+  uint64_t now;
+  int64_t error;
+  int failed, retry;
+
+  while ( ended ) {
+    device = ((struct pulse *)ended->data)->device;
+    on = off = 0;
+    for (iterator = ended; iterator; iterator = iterator->next) {
+      pulse = (struct pulse *)iterator->data;
+      if ( same_device(pulse->device, device) ) {
+        on |= pulse->on;
+        off |= pulse->off;
+      }
+    }
+
+    attribute = sdsempty();
+    for (int relay = 0; relay < RELAYS; relay++)
+      if ( ( on | off ) & ( 1 << relay ) )
+        attribute = sdscatprintf(attribute, "%s%d=%s", sdslen(attribute) ? "," : "", relay + 1, on & ( 1 << relay ) ? "on" : "off");
+
+    reply = sdsempty();
+    failed = device->batch(device, 1, &attribute, &action, &reply);
+    now = stats_time_us();
+    if ( info )
+      printf("Pulse ended on %s: %s\n", device->id, reply);
+
+    // The pulses of a device are ended, or retried, together
+    retry = failed && ((struct pulse *)ended->data)->retries < PULSE_RETRIES;
+    if ( failed )
+      fprintf(stderr, "Unable to end pulse on %s (%s). %s\n", device->id, attribute,
+        retry ? "Retrying" : "Relays are left as they are");
+    sdsfree(reply);
+    sdsfree(attribute);
+
+    // Measure the on-time of the pulses ended, and forget them
+    for (iterator = ended; iterator; iterator = next) {
+      next = iterator->next;
+      pulse = (struct pulse *)iterator->data;
+      if ( !same_device(pulse->device, device) )
+        continue;
+      ended = g_list_delete_link(ended, iterator);
+
+      if ( retry ) {
+        pulse->retries++;
+        pulse->end = now + PULSE_RETRY_MS * 1000ULL;
+        pthread_mutex_lock(&wheel.mutex);
+        add_pulse(pulse);
+        pthread_mutex_unlock(&wheel.mutex);
+        continue;
+      }
+
+      if ( !failed ) {
+        error = (int64_t)( now - pulse->started ) - pulse->ms * 1000LL;
+        if ( info )
+          printf("Pulse of %d ms on %s: %.3f ms error\n", pulse->ms, pulse->device->id, error / 1000.0);
+        pthread_mutex_lock(&wheel.mutex);
+        stats_window_add(&wheel.error, error < 0 ? -error : error);
+        pthread_mutex_unlock(&wheel.mutex);
+      }
+
+      if ( pulse->device != device )
+        free_device_entry(pulse->device);
+      free(pulse);
+    }
+    if ( !retry )
+      free_device_entry(device);
+  }
+}
+
+// End pulses in time
+static void *wheel_thread(void *param){
+  uint64_t expirations, now_tick;
+  struct pulse *pulse;
+  GList *ended, *iterator, *next;
+  int count;
+
+  for (;;) {
+    if ( read(wheel.timer_fd, &expirations, sizeof(expirations)) < 0 )
+      continue;
+
+    ended = NULL;
+    pthread_mutex_lock(&wheel.mutex);
+    now_tick = ( stats_time_us() - wheel.origin ) / PULSE_TICK_US;
+
+    // Visit the slots of the ticks passed. No more than once each
+    count = now_tick - wheel.tick < PULSE_SLOTS ? now_tick - wheel.tick : PULSE_SLOTS;
+    for (int i = 1; i <= count; i++) {
+      int slot = ( wheel.tick + i ) % PULSE_SLOTS;
+
+      for (iterator = wheel.slot[slot]; iterator; iterator = next) {
+        next = iterator->next;
+        pulse = (struct pulse *)iterator->data;
+        if ( pulse->due > now_tick )
+          continue;
+        wheel.slot[slot] = g_list_remove_link(wheel.slot[slot], iterator);
+        ended = g_list_concat(ended, iterator);
+      }
+    }
+    wheel.tick = now_tick;
+    pthread_mutex_unlock(&wheel.mutex);
+
+    count = g_list_length(ended);
+    end_pulses(ended);
+
+    pthread_mutex_lock(&wheel.mutex);
+    wheel.pending -= count;
+    if ( !wheel.pending ) {
+      arm_timer(false);
+      pthread_cond_broadcast(&wheel.idle);
+    }
+    pthread_mutex_unlock(&wheel.mutex);
+  }
+  return NULL;
+}
+
+// Add a pulse to the wheel, in the tick nearest its end. The wheel mutex must be held
+static void add_pulse(struct pulse *pulse){
+  pulse->due = ( pulse->end - wheel.origin + PULSE_TICK_US / 2 ) / PULSE_TICK_US;
+  if ( pulse->due <= wheel.tick )
+    pulse->due = wheel.tick + 1;
+  wheel.slot[pulse->due % PULSE_SLOTS] = g_list_prepend(wheel.slot[pulse->due % PULSE_SLOTS], pulse);
+  if ( !wheel.pending++ )
+    arm_timer(true);
+}
+
+/*
+  Schedule the end of the pulses of a command, that has just been written to the device.
+*/
+void pulse_schedule(struct _device_list *device, struct _relay_command *command){
+  uint64_t now = stats_time_us();
+  uint16_t scheduled = 0, mask;
+  struct pulse *pulse;
+  pthread_t thread;
+
+  if ( !( command->pulse | command->pulse_off ) || !device->batch )
+    return;
+
+  pthread_mutex_lock(&wheel.mutex);
+  if ( !wheel.running ) {
+    wheel.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    wheel.origin = now;
+    wheel.tick = 0;
+    if ( wheel.timer_fd < 0 || pthread_create(&thread, NULL, wheel_thread, NULL) ) {
+      perror("Unable to start pulse timer");
+      pthread_mutex_unlock(&wheel.mutex);
+      return;
+    }
+    pthread_detach(thread);
+    wheel.running = true;
+  }
+
+  // One pulse per duration
+  for (int relay = 0; relay < RELAYS; relay++) {
+    mask = 1 << relay;
+    if ( !( ( command->pulse | command->pulse_off ) & mask ) || ( scheduled & mask ) )
+      continue;
+
+    pulse = (struct pulse *) malloc(sizeof(struct pulse));
+    memset(pulse, 0, sizeof(struct pulse));
+    pulse->device = copy_device(device);
+    pulse->ms = command->pulse_ms[relay];
+    pulse->started = now;
+    pulse->end = now + pulse->ms * 1000ULL;
+    for (int other = relay; other < RELAYS; other++) {
+      if ( command->pulse_ms[other] != pulse->ms )
+        continue;
+      if ( command->pulse & ( 1 << other ) )
+        pulse->off |= 1 << other;
+      else if ( command->pulse_off & ( 1 << other ) )
+        pulse->on |= 1 << other;
+      else
+        continue;
+      scheduled |= 1 << other;
+    }
+    add_pulse(pulse);
+  }
+  pthread_mutex_unlock(&wheel.mutex);
+}
+
+// Wait until all pulses have ended
+void pulse_wait(void){
+  pthread_mutex_lock(&wheel.mutex);
+  while ( wheel.pending )
+    pthread_cond_wait(&wheel.idle, &wheel.mutex);
+  pthread_mutex_unlock(&wheel.mutex);
+}
+
+void pulse_print_statistics(void){
+  pthread_mutex_lock(&wheel.mutex);
+  if ( wheel.error.count )
+    stats_window_print("Pulse on-time error", &wheel.error);
+  pthread_mutex_unlock(&wheel.mutex);
+}
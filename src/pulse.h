@@ -0,0 +1,18 @@
+#ifndef PULSE_H
+#define PULSE_H
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+#include "relay_command.h"
+
+#define PULSE_TICK_US 1000      // Resolution of the timer wheel
+#define PULSE_SLOTS 1024        // Slots in the timer wheel. Longer pulses go round more than once
+#define PULSE_RETRIES 3         // Attempts to end a pulse again, when the write fails
+#define PULSE_RETRY_MS 100      // Time between the attempts
+
+void pulse_schedule(struct _device_list *device, struct _relay_command *command);
+void pulse_wait(void);
+void pulse_print_statistics(void);
+
+#endif
@@ -0,0 +1,157 @@
+/*
+  Relay attributes
+
+  A relay controller attribute is a relay number, "all", or a comma
+  separated list of relays and ranges, each optionally with its own action:
+
+    3               relay 3
+    1,3,5-8         relays 1, 3 and 5 to 8
+    1=on,2=off,3-4=toggle
+
+  The action is on, off, toggle, or "pulse <ms>" and "pulse-off <ms>", that
+  switch the relays on (off) and back again after <ms> milliseconds.
+
+  The attribute and action are compiled into masks, so any pattern of
+  relays is switched with a single write to the controller.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <strings.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#include "relay_command.h"
+
+// Parse a relay number, within the range of relays
+static int relay_number(const char *str, char **end){
+  long relay = strtol(str, end, 10);
+
+  if ( *end == str || relay < 1 || relay > RELAYS )
+    return FAILURE;
+  return relay;
+}
+
+// Add a pulse of <duration> ms, to the relays in <mask>
+static int add_pulse(struct _relay_command *command, const char *duration, uint16_t mask, int off){
+  char *end;
+  long ms = strtol(duration, &end, 10);
+
+  if ( end == duration || *end || ms < 1 || ms > 24 * 3600 * 1000 )
+    return FAILURE;
+
+  for (int relay = 0; relay < RELAYS; relay++)
+    if ( mask & ( 1 << relay ) )
+      command->pulse_ms[relay] = ms;
+  if ( off ) {
+    command->pulse_off |= mask;
+    command->pulse &= ~mask;
+    command->clear |= mask;
+  } else {
+    command->pulse |= mask;
+    command->pulse_off &= ~mask;
+    command->set |= mask;
+  }
+  return SUCCESS;
+}
+
+// Add the action to the masks, for the relays in <mask>
+static int add_action(struct _relay_command *command, const char *action, uint16_t mask){
+  if ( !action || !*action )
+    return SUCCESS;
+  if ( !strncasecmp(action, "pulse-off ", 10) )
+    return add_pulse(command, action + 10, mask, true);
+  if ( !strncasecmp(action, "pulse ", 6) )
+    return add_pulse(command, action + 6, mask, false);
+  if ( !strcasecmp(action, "on") )
+    command->set |= mask;
+  else if ( !strcasecmp(action, "off") )
+    command->clear |= mask;
+  else if ( !strcasecmp(action, "toggle") )
+    command->toggle |= mask;
+  else
+    return FAILURE;
+  return SUCCESS;
+}
+
+/*
+  Compile an attribute and action into masks.
+  Return FAILURE if the attribute or an action is invalid.
+*/
+int relay_command_parse(const char *attribute, const char *action, struct _relay_command *command){
+  sds *item;
+  int count, first, last, result = SUCCESS;
+  char *end;
+
+  memset(command, 0, sizeof(struct _relay_command));
+
+  if ( !attribute || !*attribute || !strcasecmp(attribute, "all") ) {
+    command->all = true;
+    command->select = 0xFFFF;
+    return add_action(command, action, command->select);
+  }
+
+  item = sdssplitlen(attribute, strlen(attribute), ",", 1, &count);
+  for (int i = 0; result == SUCCESS && i < count; i++) {
+    uint16_t mask = 0;
+
+    if ( (first = relay_number(item[i], &end)) < 0 ) {
+      result = FAILURE;
+      break;
+    }
+    last = first;
+    if ( *end == '-' && (last = relay_number(end + 1, &end)) < first ) {
+      result = FAILURE;
+      break;
+    }
+    for (int relay = first; relay <= last; relay++)
+      mask |= 1 << (relay - 1);
+    command->select |= mask;
+
+    if ( *end == '=' )
+      result = add_action(command, end + 1, mask);
+    else if ( *end )
+      result = FAILURE;
+    else
+      result = add_action(command, action, mask);
+  }
+  command->single = result == SUCCESS && count == 1 && !strchr(attribute, '-') && !strchr(attribute, '=');
+  sdsfreesplitres(item, count);
+  return result;
+}
+
+// Return the relay state, after the command
+int relay_command_apply(struct _relay_command *command, int state){
+  return ( ( state & ~command->clear ) | command->set ) ^ command->toggle;
+}
+
+// Return true if the command changes relays
+int relay_command_changes(struct _relay_command *command){
+  return command->set || command->clear || command->toggle;
+}
+
+// Append the state of the relays of the command to the reply
+sds relay_command_reply(sds reply, const char *attribute, struct _relay_command *command, int state){
+  const char *separator = "";
+
+  if ( command->all ) {
+    sds bits = sdsint2bin(state + 0LL, RELAYS);
+    reply = sdscatprintf(reply, "all %s", bits);
+    sdsfree(bits);
+
+  } else if ( command->single ) 
+    reply = sdscatprintf(reply, "%s %s", attribute, command->select & state ? "on" : "off");
+
+  else 
+    for (int relay = 1; relay <= RELAYS; relay++) 
+      if ( command->select & ( 1 << (relay - 1) ) ) {
+        reply = sdscatprintf(reply, "%s%d=%s", separator, relay, state & ( 1 << (relay - 1) ) ? "on" : "off");
+        separator = ",";
+      }
+  return reply;
+}
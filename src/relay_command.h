@@ -0,0 +1,31 @@
+#ifndef RELAY_COMMAND_H
+#define RELAY_COMMAND_H
+
+/* C */
+#include <stdint.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#define RELAYS 16
+
+// A relay attribute and action, compiled into masks. Relay n is bit n-1
+struct _relay_command {
+  uint16_t select;    // Relays named by the attribute
+  uint16_t set;
+  uint16_t clear;
+  uint16_t toggle;
+  uint16_t pulse;     // Relays switched on, and off again after pulse_ms
+  uint16_t pulse_off; // Relays switched off, and on again after pulse_ms
+  int pulse_ms[RELAYS];
+  int all;            // The attribute is "all" or missing
+  int single;         // The attribute is a single relay number
+};
+
+int relay_command_parse(const char *attribute, const char *action, struct _relay_command *command);
+int relay_command_apply(struct _relay_command *command, int state);
+int relay_command_changes(struct _relay_command *command);
+sds relay_command_reply(sds reply, const char *attribute, struct _relay_command *command, int state);
+
+#endif
@@ -139,6 +139,7 @@ typedef enum
 relay_state_t;
 #include "relay_drv.h"
 #include "relay_drv_nuvoton.h"
+#include "hid_relay.h"
 
 #include <argp.h>
 
@@ -151,20 +152,6 @@ relay_state_t;
 #define SUCCESS 0
 #define FAILURE -1
 
-union FRAME {
-  char raw[16];
-  struct {
-    uint8_t  cmd;          // command READ/WRITE  
-    uint8_t  len;          // message length
-    uint8_t  byte1;        // relay state read: MSB, write LSB
-    uint8_t  byte2;        // relay state read: LSB, write MSB
-    uint8_t  reserved[6];  // reserved bytes
-    uint8_t  signature[4]; // command signature
-    uint8_t  chk_lsb;      // LSB checksum 
-    uint8_t  chk_msb;      // MSB checksum 
-  } HID_repport ;
-};
-
 void print_struct(struct usb_device_info_extendet * dev_info){
   printf("Device info:\n");
   printf("  Vendor: %04X:%04X\n",dev_info->vendor_id, dev_info->product_id);
@@ -706,45 +693,34 @@ int detect_relay_controller_nuvoton(char* portname, uint8_t* num_relays, char* s
 static int get_relay_state(hid_device *handle, uint16_t *bitmap)
 {
   int i;
-  union FRAME hid_msg;
-  unsigned int checksum=0;
+  unsigned char hid_msg[HID_RELAY_REPORT_SIZE];
   
   // Create HID repport read status Request
-  memset(&hid_msg.raw, 0x11, sizeof(hid_msg));
-  hid_msg.HID_repport.cmd = 0xD2;
-  hid_msg.HID_repport.len = sizeof(hid_msg) - 2;
-  memcpy(hid_msg.HID_repport.signature, "HIDC", 4);
-
-  // Check sum
-  for(i=0; i<hid_msg.HID_repport.len; i++) 
-    checksum += hid_msg.raw[i];
-  hid_msg.HID_repport.chk_lsb = checksum & 0x00ff;
-  hid_msg.HID_repport.chk_msb = (checksum & 0xff00) >> 8;
+  hid_relay_read_request(&hid_relay_protocol[HID_RELAY_NUVOTON], hid_msg);
 
   #ifdef DEBUG
     printf("Sending HID repport to device (%ld bytes): ",sizeof(hid_msg)); 
-    for (i=0; i<sizeof(hid_msg); i++) printf("%02X ", hid_msg.raw[i]); 
+    for (i=0; i<sizeof(hid_msg); i++) printf("%02X ", hid_msg[i]); 
      printf("\n"); 
   #endif
 
-  if (hid_write(handle, (unsigned char*)hid_msg.raw, sizeof(hid_msg)) <= 0) {
+  if (hid_write(handle, hid_msg, sizeof(hid_msg)) <= 0) {
     perror("Failed to write to HID device");
     return FAILURE;
   }
 
   // Read response
-  memset(hid_msg.raw,0,sizeof(hid_msg));
-  if (hid_read(handle, (unsigned char*)hid_msg.raw, sizeof(hid_msg)) < 0) {
+  memset(hid_msg,0,sizeof(hid_msg));
+  if (hid_read(handle, hid_msg, sizeof(hid_msg)) < 0) {
     perror("Failed to read from HID device");
     return FAILURE;
   }
-  // Big endian
-  *bitmap = hid_msg.HID_repport.byte2 + (hid_msg.HID_repport.byte1 << 8);
+  *bitmap = hid_relay_decode_reply(&hid_relay_protocol[HID_RELAY_NUVOTON], hid_msg);
 
   #ifdef DEBUG
     printf("Recieved HID repport from device: "); 
     for (i=0; i<sizeof(hid_msg); i++) 
-      printf("%02X ", hid_msg.raw[i]); 
+      printf("%02X ", hid_msg[i]); 
     printf("\n"); 
    printf("Relay state = 0x%04x\n", *bitmap); 
   #endif
@@ -755,32 +731,20 @@ static int get_relay_state(hid_device *handle, uint16_t *bitmap)
 
 static int set_relays(hid_device *handle, uint16_t bitmap) 
 {
-  union FRAME hid_msg;
+  unsigned char hid_msg[HID_RELAY_REPORT_SIZE];
   int i;
-  uint16_t checksum=0;
 
   // Create HID repport set relays Request
-  memset(&hid_msg.raw, 0x00, sizeof(hid_msg));
-  // Little endian
-  hid_msg.HID_repport.byte1 = bitmap & 0x00ff;
-  hid_msg.HID_repport.byte2 = (bitmap & 0xff00) >> 8;
-  hid_msg.HID_repport.cmd = 0xC3;
-  hid_msg.HID_repport.len = sizeof(hid_msg) - 2;
-  memcpy(hid_msg.HID_repport.signature, "HIDC", 4);
-
-  // Create checksum
-  for (i=0; i<hid_msg.HID_repport.len; i++) checksum += hid_msg.raw[i];
-  hid_msg.HID_repport.chk_lsb = checksum & 0x00ff;
-  hid_msg.HID_repport.chk_msb = (checksum & 0xff00) >> 8;
+  hid_relay_write_request(&hid_relay_protocol[HID_RELAY_NUVOTON], bitmap, hid_msg);
 
   #ifdef DEBUG
     printf("Sending HID repport to device:    "); 
-    for (i=0; i<sizeof(hid_msg); i++) printf("%02X ", hid_msg.raw[i]); 
+    for (i=0; i<sizeof(hid_msg); i++) printf("%02X ", hid_msg[i]); 
       printf("\n"); 
     printf("Set relays = 0x%04x\n", bitmap);
   #endif
 
-  if (hid_write(handle, (unsigned char*)hid_msg.raw, sizeof(hid_msg)) < 0)
+  if (hid_write(handle, hid_msg, sizeof(hid_msg)) < 0)
     return FAILURE;
 
   return SUCCESS;
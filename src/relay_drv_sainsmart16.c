@@ -107,83 +107,37 @@
 #include <hidapi/hidapi.h>
 
 #include "relay_drv.h"
+#include "hid_relay.h"
+#include "hid_transport.h"
 
 #define VENDOR_ID 0x0416
 #define DEVICE_ID 0x5020
 
-#define CMD_READ  0xD2
-#define CMD_WRITE 0xC3
-#define CMD_SIGNATURE "HIDC"
-
-
-/* USB HID message structure */
-typedef struct
-{
-   uint8_t  cmd;          // command READ/WRITE  
-   uint8_t  len;          // message length
-   uint16_t bitmap;       // relay state bitmap
-   uint8_t  reserved[6];  // reserved bytes
-   uint8_t  signature[4]; // command signature
-   uint16_t chksum;       // 16 bit checksum 
-} hid_msg_t;
-
-/* Association between relay number (array index) and bit position */
-static uint8_t relay_bit_pos[] = {7 , 8 , 6 , 9 , 5 , 10, 4 , 11, 3 , 12, 2 , 13, 1 , 14, 0 , 15};
-
 static uint8_t g_num_relays=SAINSMART16_USB_NUM_RELAYS;
 
 
-static void init_hid_msg(hid_msg_t *hid_msg, uint8_t cmd, uint16_t bitmap)
-{
-   int i;
-   uint16_t checksum=0;
-
-   if (cmd==CMD_READ)
-     memset(hid_msg, 0x11, sizeof(hid_msg_t));
-   else
-     memset(hid_msg, 0x00, sizeof(hid_msg_t));
-
-   hid_msg->cmd = cmd;
-   hid_msg->len = sizeof(hid_msg_t) - 2;
-   hid_msg->bitmap = bitmap;
-   memcpy(hid_msg->signature, CMD_SIGNATURE, 4);
-   for (i=0; i<hid_msg->len; i++) checksum += *(((uint8_t*)hid_msg)+i);
-   hid_msg->chksum = checksum;
-   
-   /* printf("DBG: msg "); */
-   /* for (i=0; i<sizeof(hid_msg_t); i++) printf("%02X ", *(((uint8_t*)hid_msg)+i)); */
-   /* printf("\n"); */
-}
-
-
-static int get_mask(hid_device *handle, uint16_t *bitmap)
+/* The reply is read as soon as it arrives, and the request repeated if it's lost (hid_request) */
+static int get_mask(hid_device *handle, char *portname, uint16_t *bitmap)
 {
-  int i;
-  hid_msg_t  hid_msg;
-  uint16_t mask;
-  
-  init_hid_msg(&hid_msg, CMD_READ, 0x1111);
-
-  if (hid_write(handle, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
-  {
-    return -1;
-  }
-  usleep(1000);
+  struct _hid_connection connection;
+  unsigned char hid_msg[HID_RELAY_REPORT_SIZE], reply[HID_RELAY_REPORT_SIZE];
+  int result;
   
-  if (hid_read(handle, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
+  hid_relay_read_request(&hid_relay_protocol[HID_RELAY_SAINSMART16], hid_msg);
+
+  memset(&connection, 0, sizeof(connection));
+  connection.transport = &hidapi_transport;
+  connection.port = sdsnew(portname);
+  connection.handle = handle;
+  memset(reply, 0, sizeof(reply));
+  result = hid_request(&connection, hid_msg, sizeof(hid_msg), reply, sizeof(reply));
+  sdsfree(connection.port);
+  if (result <= 0)
   {
     return -2;
   }
   
-  mask = 0;
-  for ( i = 0 ; i < g_num_relays; i ++) {
-    if (hid_msg.bitmap & (1 << relay_bit_pos[i])) {
-      mask |= 1 << i;
-    }
-  }
-
-  /* printf("DBG: get_mask = 0x%04x\n", hid_msg.bitmap); */
-  *bitmap = (uint16_t) mask;
+  *bitmap = (uint16_t) hid_relay_decode_reply(&hid_relay_protocol[HID_RELAY_SAINSMART16], reply) & ((1 << g_num_relays) - 1);
 
   return 0;
 }
@@ -191,11 +145,10 @@ static int get_mask(hid_device *handle, uint16_t *bitmap)
 
 static int set_mask(hid_device *handle, uint16_t bitmap) 
 {
-  hid_msg_t  hid_msg;
+  unsigned char hid_msg[HID_RELAY_REPORT_SIZE];
 
-  /* printf("DBG: set_mask = 0x%04x\n", bitmap); */
-  init_hid_msg(&hid_msg, CMD_WRITE, bitmap);
-  if (hid_write(handle, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
+  hid_relay_write_request(&hid_relay_protocol[HID_RELAY_SAINSMART16], bitmap, hid_msg);
+  if (hid_write(handle, hid_msg, sizeof(hid_msg)) < 0)
   {
     return -1;
   }
@@ -307,7 +260,7 @@ int get_relay_sainsmart_16chan(char* portname, uint8_t relay, relay_state_t* rel
    }
    
    /* Read relay states */
-   if (get_mask(hid_dev, &bitmap) < 0)
+   if (get_mask(hid_dev, portname, &bitmap) < 0)
    {
       fprintf(stderr, "unable to read data from device %s (%ls)\n", portname, hid_error(hid_dev));
       return -3;
@@ -360,7 +313,7 @@ int set_relay_sainsmart_16chan(char* portname, uint8_t relay, relay_state_t rela
           portname, relay, relay_state == ON? "ON" : "OFF");
    */
    /* Read relay states */
-   if (get_mask(hid_dev, &bitmap) < 0)
+   if (get_mask(hid_dev, portname, &bitmap) < 0)
    {
       fprintf(stderr, "unable to read data from device %s (%ls)\n", portname, hid_error(hid_dev));
       return -3;
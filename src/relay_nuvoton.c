@@ -41,6 +41,7 @@ A stable path is needed for identificatio, since it has no serial number.
 *   The Nuvoton relay controller has a 16 bit relay state.
 *   When reading relay state, the byte order is MSB, LSB  (Big endian)
 *   When setting the relay state, the byte order is LSB, MSB (Little endian)
+*   The reports are encoded by the HID relay codec (hid_relay.c)
 
 NB: including source code for HIDAPI (libusb version) until version with stabel parth to device, is in curculation.
 
@@ -73,146 +74,19 @@ NB: including source code for HIDAPI (libusb version) until version with stabel
 /* Application */
 #include "toolbox.h"
 #include "common.h"
+#include "hid_relay.h"
 
 
-struct HID_repport 
-{
-  uint8_t  cmd;          // command READ/WRITE  
-  uint8_t  len;          // message length
-  uint8_t  byte1;        // relay state read: MSB, write LSB
-  uint8_t  byte2;        // relay state read: LSB, write MSB
-  uint8_t  reserved[6];  // reserved bytes
-  uint8_t  signature[4]; // command signature
-  uint8_t  chk_lsb;      // LSB checksum 
-  uint8_t  chk_msb;      // MSB checksum 
-};
-
-static int get_nuvoton(hid_device *handle, int *relay_state) 
-{
-  int i;
-  struct HID_repport hid_msg;
-  unsigned int checksum=0;
-  
-  // Create HID repport read status Request
-  memset(&hid_msg, 0x11, sizeof(struct HID_repport));
-  hid_msg.cmd = 0xD2;
-  hid_msg.len = sizeof(struct HID_repport) - 2;
-  memcpy(hid_msg.signature, "HIDC", 4);
-
-  // Check sum
-  for(i=0; i<hid_msg.len; i++) 
-    checksum += *(((uint8_t*)&hid_msg)+i);
-  hid_msg.chk_lsb = checksum & 0x00ff;
-  hid_msg.chk_msb = (checksum & 0xff00) >> 8;
-
-  if ( info )
-    printf("Sending HID repport:  %s\n",sdsbytes2hex(&hid_msg,sizeof(struct HID_repport),4));  // Free sds
-  hid_set_nonblocking(handle, 1);
-
-  if (hid_write(handle, (unsigned char *)&hid_msg, sizeof(hid_msg)) <= 0)
-    return FAILURE;
-
-  usleep(1000);
-
-  // Read response
-  memset((unsigned char *)&hid_msg,0,sizeof(hid_msg));
-  
-  if ( hid_read_timeout(handle, (unsigned char *)&hid_msg, sizeof(hid_msg), 10) <= 0 )
-    return FAILURE;
-
-  // Big endian
-  *relay_state = hid_msg.byte2 + (hid_msg.byte1 << 8);
-
-  if ( info ) {
-    printf("Recieved HID repport: %s\n",sdsbytes2hex(&hid_msg,sizeof(struct HID_repport),4)); 
-    printf("Relay state = %s\n", sdsint2bin(*relay_state ,16));  // free sds
-  }
-
-  return SUCCESS;
-}
-
-static int set_nuvoton(hid_device *handle, int *relay_state) {
-  struct HID_repport  hid_msg;
-  int i;
-  uint16_t checksum=0;
-
-  // Create HID repport set relays Request
-  memset(&hid_msg, 0x00, sizeof(struct HID_repport));
-  // Little endian
-  hid_msg.byte1 = *relay_state & 0x00ff;
-  hid_msg.byte2 = (*relay_state & 0xff00) >> 8;
-  hid_msg.cmd = 0xC3;
-  hid_msg.len = sizeof(struct HID_repport) - 2;
-  memcpy(hid_msg.signature, "HIDC", 4);
-
-  // Create checksum
-  for (i=0; i<hid_msg.len; i++) checksum += *(((uint8_t*)&hid_msg)+i);
-  hid_msg.chk_lsb = checksum & 0x00ff;
-  hid_msg.chk_msb = (checksum & 0xff00) >> 8;
-
-  if ( info ) {
-    printf("Send HID repport:     %s\n",sdsbytes2hex(&hid_msg,sizeof(struct HID_repport),4)); 
-    printf("Relay state = %s\n", sdsint2bin(*relay_state ,16)); 
-  }
-
-  if (hid_write(handle, (unsigned char *)&hid_msg, sizeof(hid_msg)) < 0)
-    return FAILURE;
-
-  return SUCCESS;
+/*
+  Perform a list of actions, as a single read-modify-write of the relay state.
+  Each reply reflects the relay state after its action.
+*/
+int batch_nuvoton(struct _device_list *device, int count, sds *attribute, sds *action, sds *reply) {
+  return hid_relay_batch(&hid_relay_protocol[HID_RELAY_NUVOTON], device, count, attribute, action, reply);
 }
  
 int action_nuvoton(struct _device_list *device, sds attribute, sds action, sds *reply) {
-  int relay_id = 0;
-  int relay_state = -1;
-  int mask;
-  int return_code = SUCCESS;
-  hid_device *handle;
-
-  if ( !(handle = hid_open_path(device->port))) {
-    fprintf(stderr, "Unable to open HID API device %s",device->port);
-    return FAILURE;      
-  }
-
-  if( attribute && strcmp(strtolower(attribute),"all") )
-    relay_id = strtol(attribute,NULL,10);  
-  
-  mask = relay_id ? 1<<(relay_id - 1) : 0xFFFF;
-
-  if ( info ) 
-    puts("Rading relay state:");
-
-  if ( (return_code = get_nuvoton(handle, &relay_state))) { 
-    fprintf(stderr, "Unable to read HID API device %s",device->port);
-    return FAILURE;      
-  }
-
-  if (action) {
-    if ( info ) 
-      puts("Setting relay state:");
-
-    if (!strcmp(strtolower(action), "off") )
-      relay_state &= ~mask; 
-    if (!strcmp(strtolower(action), "on") )
-      relay_state |= mask; 
-    if (!strcmp(strtolower(action), "toggle") )
-      relay_state ^= mask;
-    if ( (return_code = set_nuvoton(handle, &relay_state))) { 
-      fprintf(stderr, "Unable to write to HID API device %s",device->port);
-      return FAILURE;      
-    }
-  } 
-
-  if( relay_id > 0 )
-    *reply = sdscatprintf(sdsempty(),"%s %s",
-      attribute,
-      mask & relay_state ? sdsnew("on") : sdsnew("off")
-    );
-  else      
-    *reply = sdscatprintf(sdsempty(),"all %s", sdsint2bin(relay_state + 0LL,16));
-
-  hid_close(handle);
-
-  return return_code;
+  return batch_nuvoton(device, 1, &attribute, &action, reply);
 }
 
 // The interface scanner, asks if this is your device
@@ -222,6 +96,7 @@ int recognize_nuvoton(int sdl_index, void *dev_info) {
   if ( hid_device_info
     && hid_device_info->vendor_id == 0x0416
     && hid_device_info->product_id == 0x5020
+    && hid_device_info->manufacturer_string
     && !wcscmp(hid_device_info->manufacturer_string,L"Nuvoton" )){
  
     return true;     
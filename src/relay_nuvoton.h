@@ -10,4 +10,5 @@
 
 int recognize_nuvoton(int si_index,  void *dev_info );
 int action_nuvoton(struct _device_list *device, sds attribute, sds action, sds *reply);
+int batch_nuvoton(struct _device_list *device, int count, sds *attribute, sds *action, sds *reply);
 #endif
\ No newline at end of file
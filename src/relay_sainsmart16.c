@@ -0,0 +1,60 @@
+/* 
+Driver for the Sainsmart 16 channel USB-HID relay controller
+
+*
+* Description:
+*   The Sainsmart controller use the same 16 byte reports as the Nuvoton
+*   controller, with the same vendor and product id (0416:5020).
+*   The bitmap is in host byte order (little endian) both ways.
+*
+* Quirk:
+*   When reading, the relays are scrambled in the bitmap:
+*     bit:    15  14  13  12  11  10   9   8   7   6   5   4   3   2   1   0
+*     relay:  15   0  14   1  13   2  12   3  11   4  10   5   9   6   8   7
+*   When writing, bit n is relay n.
+*
+*   Relays are numbered from 1 in devia, as with the Nuvoton driver.
+*   The reports are encoded by the HID relay codec (hid_relay.c)
+*
+*   The controllers can only be told apart by the manufacturer string. The
+*   Nuvoton controller is recognized first, and the rest are Sainsmart.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <wchar.h>
+
+/* Linux */
+#include <hidapi/hidapi.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+#include "hid_relay.h"
+
+#include "relay_sainsmart16.h"
+
+/*
+  Perform a list of actions, as a single read-modify-write of the relay state.
+  Each reply reflects the relay state after its action.
+*/
+int batch_sainsmart16(struct _device_list *device, int count, sds *attribute, sds *action, sds *reply){
+  return hid_relay_batch(&hid_relay_protocol[HID_RELAY_SAINSMART16], device, count, attribute, action, reply);
+}
+
+int action_sainsmart16(struct _device_list *device, sds attribute, sds action, sds *reply){
+  return batch_sainsmart16(device, 1, &attribute, &action, reply);
+}
+
+// The interface scanner, asks if this is your device
+int recognize_sainsmart16(int sdl_index, void *dev_info){
+  struct hid_device_info *hid_device_info = (struct hid_device_info *) dev_info;
+
+  return hid_device_info
+    && hid_device_info->vendor_id == 0x0416
+    && hid_device_info->product_id == 0x5020
+    && !( hid_device_info->manufacturer_string && !wcscmp(hid_device_info->manufacturer_string, L"Nuvoton") );
+}
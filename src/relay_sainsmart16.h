@@ -0,0 +1,11 @@
+#ifndef RELAY_SAINSMART16
+#define RELAY_SAINSMART16
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+int recognize_sainsmart16(int sdl_index, void *dev_info);
+int action_sainsmart16(struct _device_list *device, sds attribute, sds action, sds *reply);
+int batch_sainsmart16(struct _device_list *device, int count, sds *attribute, sds *action, sds *reply);
+#endif
@@ -0,0 +1,152 @@
+/*
+
+  Phase timing statistics
+
+  With --stats, the wall clock duration of each phase is measured: argument
+  parsing, probing, opening devices and each read and write. Durations are
+  summed per phase, and printed when devia exits.
+
+  The monitor keeps a rolling window of the latest action latencies of each
+  device, and prints the 50th, 95th and 99th percentile.
+
+  Phases may be timed from several threads at once.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* Unix */
+#include <pthread.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#include "stats.h"
+
+#define MAX_PHASES 64
+
+struct phase {
+  const char *name;
+  sds detail;
+  int count;
+  uint64_t total_us;
+  uint64_t max_us;
+};
+
+int stats_enabled = false;
+
+static struct phase phase[MAX_PHASES];
+static int phases = 0;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Monotonic wall clock in microseconds
+uint64_t stats_time_us(void){
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Start timing a phase. Return the start time
+uint64_t stats_start(void){
+  return stats_enabled ? stats_time_us() : 0;
+}
+
+/*
+  Add the time since <start> to the phase <name>.
+  <detail> distinguishes instances of the phase, ex. the interface probed. It may be NULL
+*/
+void stats_stop(const char *name, const char *detail, uint64_t start){
+  uint64_t duration;
+  int i;
+
+  if ( !stats_enabled )
+    return;
+
+  duration = stats_time_us() - start;
+
+  pthread_mutex_lock(&stats_mutex);
+  for (i = 0; i < phases; i++)
+    if ( !strcmp(phase[i].name, name)
+      && ( detail ? phase[i].detail && !strcmp(phase[i].detail, detail) : !phase[i].detail ) )
+      break;
+
+  if ( i == phases && phases < MAX_PHASES ) {
+    phase[i].name = name;
+    phase[i].detail = detail ? sdsnew(detail) : NULL;
+    phases++;
+  }
+
+  if ( i < phases ) {
+    phase[i].count++;
+    phase[i].total_us += duration;
+    if ( duration > phase[i].max_us )
+      phase[i].max_us = duration;
+  }
+  pthread_mutex_unlock(&stats_mutex);
+}
+
+// Print time spent in each phase, in the order they first occurred
+void stats_print(void){
+  sds label;
+
+  if ( !stats_enabled )
+    return;
+
+  pthread_mutex_lock(&stats_mutex);
+  printf("%-40s %7s %12s %12s\n", "Phase", "Count", "Total ms", "Max ms");
+  for (int i = 0; i < phases; i++) {
+    label = sdsnew(phase[i].name);
+    if ( phase[i].detail )
+      label = sdscatprintf(label, " %s", phase[i].detail);
+    printf("%-40s %7d %12.3f %12.3f\n",
+      label,
+      phase[i].count,
+      phase[i].total_us / 1000.0,
+      phase[i].max_us / 1000.0
+    );
+    sdsfree(label);
+  }
+  pthread_mutex_unlock(&stats_mutex);
+  fflush(stdout);
+}
+
+void stats_window_add(struct stats_window *window, uint64_t duration_us){
+  window->sample[window->next] = duration_us > UINT32_MAX ? UINT32_MAX : (uint32_t)duration_us;
+  window->next = ( window->next + 1 ) % STATS_WINDOW;
+  if ( window->count < STATS_WINDOW )
+    window->count++;
+}
+
+static int compare_samples(const void *a, const void *b){
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Print the 50th, 95th and 99th percentile latency of the samples in the window
+void stats_window_print(const char *name, struct stats_window *window){
+  uint32_t sorted[STATS_WINDOW];
+  int n = window->count;
+
+  if ( !n ) {
+    printf("%s: no samples\n", name);
+    return;
+  }
+
+  memcpy(sorted, window->sample, sizeof(uint32_t) * n);
+  qsort(sorted, n, sizeof(uint32_t), compare_samples);
+
+  printf("%s: %d samples  p50 %.3f ms  p95 %.3f ms  p99 %.3f ms  max %.3f ms\n",
+    name,
+    n,
+    sorted[(n - 1) * 50 / 100] / 1000.0,
+    sorted[(n - 1) * 95 / 100] / 1000.0,
+    sorted[(n - 1) * 99 / 100] / 1000.0,
+    sorted[n - 1] / 1000.0
+  );
+}
@@ -0,0 +1,28 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#define STATS_WINDOW 1024       // Number of latest samples, percentiles are computed from
+
+// Rolling window of latencies in microseconds
+struct stats_window {
+  uint32_t sample[STATS_WINDOW];
+  int count;
+  int next;
+};
+
+extern int stats_enabled;
+
+uint64_t stats_time_us(void);
+uint64_t stats_start(void);
+void stats_stop(const char *name, const char *detail, uint64_t start);
+void stats_print(void);
+void stats_window_add(struct stats_window *window, uint64_t duration_us);
+void stats_window_print(const char *name, struct stats_window *window);
+
+#endif
@@ -48,6 +48,8 @@
 /* Application */
 #include "toolbox.h"
 #include "common.h"
+#include "stats.h"
+#include "sysfs_index.h"
 
 #include "sysfs.h"
 
@@ -56,9 +58,36 @@
 typedef unsigned short wchar_t;
 #endif
 
+int sysfs_list_attributes = false;
+
+// Test if a path is within the sysfs tree
+static int within_sysfs(const char *path){
+  sds prefix = sysfs_path("/sys/");
+  int within = !strncmp(path, prefix, sdslen(prefix));
+
+  sdsfree(prefix);
+  return within;
+}
+
+// Add an entry for a device directory, that actions are performed on
+static void add_directory(int si_index, const char *path, GList **device_list){
+  struct _device_list *entry;
+
+  entry = (struct _device_list *) malloc(sizeof(struct _device_list)); 
+  memset(entry, 0, sizeof(struct _device_list));
+  entry->name = sdsnew(supported_interface[si_index].device[0].name);
+  entry->id = sdscatprintf(sdsempty(),"sysfs#%s", path);
+  entry->path = sdsnew(path);
+  entry->group = file_permissions_string(entry->path);
+  entry->action = action_sysfs;
+  entry->watch = watch_sysfs;
+  *device_list = g_list_append(*device_list, entry);
+}
+
 /* 
-  probe for HID USB devices that match relay drivers.
-  When matched, add aan entry to the device list.
+  Probe for sysfs device directories, that match the identifier.
+  An entry is made for each directory found. When listing
+  (sysfs_list_attributes), an entry is made for each attribute file instead.
 */  
 int probe_sysfs(int si_index, struct _device_identifier id, GList **device_list){
   struct _device_list *entry;
@@ -69,26 +98,28 @@ int probe_sysfs(int si_index, struct _device_identifier id, GList **device_list)
   char * buffer = NULL;
   struct dirent *dp;
   DIR *dir;
-
+  sds devices_path;
 
   assert(supported_interface[si_index].name);
 
   // Check that /sys/class exists
-  if ( access("/sys/devices", F_OK) ) {
+  devices_path = sysfs_path("/sys/devices");
+  if ( access(devices_path, F_OK) ) {
     if ( info ) printf("No sysFs\n");
+    sdsfree(devices_path);
     return FAILURE;
   }
 
   if(id.device_id){
     // Full path
     if (strchr( id.device_id,'/' ) ) {
-      if ( !strncmp(id.device_id,(char * )"/sys/",5) ){
+      if ( within_sysfs(id.device_id) ){
         buffer = realpath(id.device_id,NULL);
         path = sdsnew(buffer);
         free(buffer);
       // Path relative to /sys/devices/
       } else {
-        sds path1 = sdscatprintf(sdsempty(),"/sys/devices/%s",id.device_id);
+        sds path1 = sdscatprintf(sdsempty(),"%s/%s",devices_path,id.device_id);
         buffer = realpath(path1,NULL);
         sdsfree(path1);
         path = sdsnew(buffer);
@@ -100,11 +131,13 @@ int probe_sysfs(int si_index, struct _device_identifier id, GList **device_list)
     // find dir  
     } else {
 
-      path_list = finddir((char *)"/sys/devices",id.device_id);
+      path_list = sysfs_index_find(devices_path,id.device_id);
     }
+    sdsfree(devices_path);
 
   // Nothing to do  
   }  else {
+    sdsfree(devices_path);
     return SUCCESS;
   }
  
@@ -117,7 +150,7 @@ int probe_sysfs(int si_index, struct _device_identifier id, GList **device_list)
   
     // Check that path is within /sys/
     if ( iterator->data && sdslen( (sds)iterator->data )  ) {      
-      if ( strncmp((char * )iterator->data,(char * )"/sys/",5) ){
+      if ( !within_sysfs((char * )iterator->data) ){
         fprintf(stderr,"%s is out of bounds path.\n",(char *)iterator->data);
         return FAILURE;
       }
@@ -134,6 +167,13 @@ int probe_sysfs(int si_index, struct _device_identifier id, GList **device_list)
       continue;
     }
 
+    if ( !sysfs_list_attributes ) {
+      add_directory(si_index, (char *)iterator->data, device_list);
+      if ( info ) 
+        printf(" -- Recognized %s\n", (char *)iterator->data);
+      continue;
+    }
+
     // List files
     dir = opendir((char *)iterator->data);
     if (!dir) {
@@ -155,6 +195,7 @@ int probe_sysfs(int si_index, struct _device_identifier id, GList **device_list)
       entry->path = sdscatprintf(sdsempty(),"%s/%s",(char *)iterator->data, dp->d_name);
       entry->group = file_permissions_string(entry->path);
       entry->action = action_sysfs;
+      entry->watch = watch_sysfs;
 
 
       if ( info ) 
@@ -162,23 +203,55 @@ int probe_sysfs(int si_index, struct _device_identifier id, GList **device_list)
     }
     closedir(dir);
   }
+  finddir_free(path_list);
+  g_list_free(path_list);
   return SUCCESS;
 } 
 
+/*
+  Open a device directory directly, given by its absolute path.
+  A single entry is made for the directory, as when probing for an action.
+*/
+int direct_sysfs(int si_index, struct _device_identifier id, GList **device_list){
+  struct stat stat_buffer;
+  char *path;
+
+  if ( !id.device_id || !within_sysfs(id.device_id) )
+    return FAILURE;
+
+  // Verify that the path resolves to a directory within /sys/
+  if ( !(path = realpath(id.device_id, NULL)) )
+    return FAILURE;
+  if ( !within_sysfs(path) || stat(path, &stat_buffer) || !S_ISDIR(stat_buffer.st_mode) ) {
+    free(path);
+    return FAILURE;
+  }
+
+  add_directory(si_index, path, device_list);
+  free(path);
+  return SUCCESS;
+}
+
+// The device directory is the device id part of the identifier
+static const char *sysfs_directory(struct _device_list *device){
+  return strchr(device->id, '#') ? strchr(device->id, '#') + 1 : device->id;
+}
+
 int action_sysfs(struct _device_list *device, sds attribute, sds action, sds *reply){
   struct stat stat_buffer;
+  const char *directory = sysfs_directory(device);
 
   if ( info )
     printf("SysFs on: %s  Action: %s\n",attribute, action);
 
   // Check that device id is a valid direstory in SysFs
-  if (stat(device->id, &stat_buffer) ){
-    perror(device->id);
+  if (stat(directory, &stat_buffer) ){
+    perror(directory);
     return FAILURE;
   }
 
   if( !S_ISDIR(stat_buffer.st_mode)) {
-    fprintf(stderr, "%s is not a valid path to a SysFS device\n", device->id);
+    fprintf(stderr, "%s is not a valid path to a SysFS device\n", directory);
     return FAILURE;
   }
 
@@ -186,8 +259,9 @@ int action_sysfs(struct _device_list *device, sds attribute, sds action, sds *re
     int fd;
     int length;
     char input[1025];
+    uint64_t start;
     
-    sds file_path = sdscatprintf(sdsempty(), "%s/%s",device->id, attribute); 
+    sds file_path = sdscatprintf(sdsempty(), "%s/%s",directory, attribute); 
     
     // Check permissions
     sds permission_needed = file_permission_needed(file_path, action ? W_OK : R_OK );
@@ -199,16 +273,20 @@ int action_sysfs(struct _device_list *device, sds attribute, sds action, sds *re
     sdsfree(permission_needed);
     
     // open device attribute
+    start = stats_start();
     if( (fd = open(file_path, action ? O_WRONLY : O_RDONLY)) < 0) {
       perror("Failed to open sysfs file");
       *reply = sdsnew("Off-line");
       return FAILURE;
     }
+    stats_stop("sysfs open", NULL, start);
 
     // Write to device attribute
     if ( action ) {
+      start = stats_start();
       printf("Writing to %s : %s\n", attribute, action);
       length = write( fd , action, sdslen(action) );
+      stats_stop("sysfs write", NULL, start);
       if ( length < 0 ) {
         perror( "unable to write to attribute" );
         *reply = sdsnew("**output error**");
@@ -218,14 +296,16 @@ int action_sysfs(struct _device_list *device, sds attribute, sds action, sds *re
 
     // read from device attribute
     } else { 
+      start = stats_start();
       *reply = sdscatprintf(sdsempty(),"%s ", attribute);
     	do {
         length = read(fd,input, sizeof(input)-1 );
         if( length >= 0 ) {
-          input[length+1] = 0;
+          input[length] = 0;
           *reply = sdscat(*reply,input);
         }
       }while (length == sizeof(input)-1 );
+      stats_stop("sysfs read", NULL, start);
 
       if ( length < 0 ) {
     		perror("Failed to read attribute");
@@ -235,10 +315,48 @@ int action_sysfs(struct _device_list *device, sds attribute, sds action, sds *re
       }  
     } 
 
+    start = stats_start();
    	close(fd);
+    stats_stop("sysfs close", NULL, start);
     sdsfree(file_path);
   }
 
   return SUCCESS;
 }
 
+/*
+  Return a file descriptor for the attribute, if the kernel signals changes
+  to it with POLLPRI. Otherwise the attribute must be polled.
+
+  Only attributes with an edge setting (ex. GPIO value) are notified.
+*/
+int watch_sysfs(struct _device_list *device, sds attribute){
+  sds file_path;
+  char edge[16];
+  int fd, length;
+
+  if ( !attribute )
+    return FAILURE;
+
+  file_path = sdscatprintf(sdsempty(), "%s/edge", sysfs_directory(device));
+  fd = open(file_path, O_RDONLY);
+  sdsfree(file_path);
+  if ( fd < 0 )
+    return FAILURE;
+
+  length = read(fd, edge, sizeof(edge) - 1);
+  close(fd);
+  if ( length <= 0 || !strncmp(edge, "none", 4) )
+    return FAILURE;
+
+  file_path = sdscatprintf(sdsempty(), "%s/%s", sysfs_directory(device), attribute);
+  fd = open(file_path, O_RDONLY | O_CLOEXEC);
+  sdsfree(file_path);
+  if ( fd < 0 )
+    return FAILURE;
+
+  // Read once, to arm the notification
+  while ( read(fd, edge, sizeof(edge)) > 0 );
+
+  return fd;
+}
@@ -8,8 +8,12 @@
 #include "toolbox.h"
 #include "common.h"
 
+extern int sysfs_list_attributes;   // Probe an entry per attribute file, for --list
+
 int probe_sysfs(int si_index, struct _device_identifier id, GList **device_list);
+int direct_sysfs(int si_index, struct _device_identifier id, GList **device_list);
 int recognize_sysfs(int si_index,  void * dev_info );
 int action_sysfs(struct _device_list *device, sds attribute, sds action, sds *reply);
+int watch_sysfs(struct _device_list *device, sds attribute);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,522 @@
+/*
+
+  Sysfs name index
+
+  Finding a device directory by name, in the /sys/devices hierarchy, takes a
+  walk of tens of thousands of directories. Instead the directories are
+  indexed once, by name, in a hash table of lists of paths. A lookup is then a
+  hash probe.
+
+  The index is built on the first lookup below a base directory. Symbolic
+  links are not followed, so links back up the tree (subsystem, driver etc.)
+  are never walked, and attribute groups that never hold devices (ex. power)
+  are indexed, but not descended into.
+
+  The index is valid as long as the kernel device state is unchanged. That is
+  when the udev event sequence number is the same as when the index was
+  built, or if the sequence number is not available, the base directory is
+  unchanged. The index is saved in the runtime directory and reused by the
+  next run, until the kernel state changes or the system is rebooted.
+
+  A long running process (the daemon) can watch kernel events instead. Each
+  event then updates the index: Added devices are scanned, and removed devices
+  pruned. If an event is missed, the index is rebuilt.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+
+/* Unix */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+/* Linux */
+#include <glib.h>
+#include <libudev.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+#include "cache.h"
+#include "walk.h"
+
+#include "sysfs_index.h"
+
+#define UEVENT_SEQNUM "/sys/kernel/uevent_seqnum"
+#define BOOT_ID "/proc/sys/kernel/random/boot_id"
+#define UEVENT_BUFFER_SIZE (1024 * 1024)
+
+// Attribute groups, that are indexed, but not searched
+static const char *skip_subtree[] = { "power", "msi_irqs", NULL };
+
+// Paths of the directories with the same name
+struct name_entry {
+  GList *paths;
+};
+
+struct sysfs_index {
+  sds base;
+  GHashTable *names;              // Directory name -> struct name_entry
+  int directories;
+  int built;
+  unsigned long long seqnum;      // Event sequence number, the index is up to date with
+  ino_t base_inode;
+  struct timespec base_mtime;
+};
+
+static GList *indexes = NULL;
+static pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct udev *udev = NULL;
+static struct udev_monitor *uevents = NULL;
+
+static void free_name_entry(struct name_entry *entry){
+  g_list_free_full(entry->paths, (GDestroyNotify)sdsfree);
+  free(entry);
+}
+
+// Test if path is prefix or below it
+static int within(const char *path, const char *prefix, size_t length){
+  return !strncmp(path, prefix, length) && ( path[length] == '\0' || path[length] == '/' );
+}
+
+// Current udev event sequence number, or 0 if not available
+static unsigned long long read_seqnum(void){
+  sds filename = sysfs_path(UEVENT_SEQNUM);
+  char buffer[32];
+  int fd, length;
+  unsigned long long seqnum = 0;
+
+  if ( (fd = open(filename, O_RDONLY | O_CLOEXEC)) >= 0 ) {
+    if ( (length = read(fd, buffer, sizeof(buffer) - 1)) > 0 ) {
+      buffer[length] = '\0';
+      seqnum = strtoull(buffer, NULL, 10);
+    }
+    close(fd);
+  }
+  sdsfree(filename);
+  return seqnum;
+}
+
+static void stamp_base(struct sysfs_index *index){
+  struct stat stat_buffer;
+
+  memset(&stat_buffer, 0, sizeof(stat_buffer));
+  stat(index->base, &stat_buffer);
+  index->base_inode = stat_buffer.st_ino;
+  index->base_mtime = stat_buffer.st_mtim;
+}
+
+// Test if the index reflects the current kernel device state
+static int index_current(struct sysfs_index *index){
+  struct stat stat_buffer;
+  unsigned long long seqnum;
+
+  if ( !index->built )
+    return false;
+  if ( (seqnum = read_seqnum()) )
+    return index->seqnum == seqnum;
+  return !stat(index->base, &stat_buffer)
+    && stat_buffer.st_ino == index->base_inode
+    && stat_buffer.st_mtim.tv_sec == index->base_mtime.tv_sec
+    && stat_buffer.st_mtim.tv_nsec == index->base_mtime.tv_nsec;
+}
+
+static void index_add(struct sysfs_index *index, const char *path, const char *name){
+  struct name_entry *entry;
+
+  if ( !(entry = (struct name_entry *)g_hash_table_lookup(index->names, name)) ) {
+    entry = (struct name_entry *)malloc(sizeof(struct name_entry));
+    entry->paths = NULL;
+    g_hash_table_insert(index->names, sdsnew(name), entry);
+  }
+  entry->paths = g_list_prepend(entry->paths, sdsnew(path));
+  index->directories++;
+}
+
+static int index_contains(struct sysfs_index *index, const char *path){
+  struct name_entry *entry;
+  GList *iterator;
+
+  if ( !(entry = (struct name_entry *)g_hash_table_lookup(index->names, strrchr(path, '/') + 1)) )
+    return false;
+  for (iterator = entry->paths; iterator; iterator = iterator->next)
+    if ( !strcmp((sds)iterator->data, path) )
+      return true;
+  return false;
+}
+
+// Remove a directory and everything below it
+static void index_remove(struct sysfs_index *index, const char *path){
+  struct name_entry *entry;
+  GHashTableIter iter;
+  GList *link, *next;
+  size_t length = strlen(path);
+
+  g_hash_table_iter_init(&iter, index->names);
+  while ( g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry) )
+    for (link = entry->paths; link; link = next) {
+      next = link->next;
+      if ( within((sds)link->data, path, length) ) {
+        sdsfree((sds)link->data);
+        entry->paths = g_list_delete_link(entry->paths, link);
+        index->directories--;
+      }
+    }
+}
+
+static int skipped(const char *name){
+  for (int i = 0; skip_subtree[i]; i++)
+    if ( !strcmp(name, skip_subtree[i]) )
+      return true;
+  return false;
+}
+
+struct scan_context {
+  struct sysfs_index *index;
+  pthread_mutex_t mutex;
+};
+
+static int scan_visit(struct walk_entry *entry, void *context){
+  struct scan_context *scan = (struct scan_context *)context;
+
+  pthread_mutex_lock(&scan->mutex);
+  index_add(scan->index, entry->path, entry->name);
+  pthread_mutex_unlock(&scan->mutex);
+  return skipped(entry->name) ? WALK_PRUNE : WALK_DESCEND;
+}
+
+// Index the directories below path
+static void scan(struct sysfs_index *index, const char *path){
+  struct scan_context context;
+
+  context.index = index;
+  pthread_mutex_init(&context.mutex, NULL);
+  walk_tree(path, 0, WALK_DIRECTORIES, scan_visit, &context);
+  pthread_mutex_destroy(&context.mutex);
+}
+
+static void index_build(struct sysfs_index *index){
+  g_hash_table_remove_all(index->names);
+  index->directories = 0;
+
+  // Events after this, are applied to the index
+  index->seqnum = read_seqnum();
+  stamp_base(index);
+
+  scan(index, index->base);
+  index->built = true;
+
+  if ( info )
+    printf("Indexed %d directories below %s\n", index->directories, index->base);
+}
+
+/*
+  Index a new or changed directory: Its parents, if they are not indexed, the
+  directory and everything below it.
+*/
+static void index_update(struct sysfs_index *index, const char *path){
+  struct stat stat_buffer;
+  size_t base_length = sdslen(index->base), length = strlen(path);
+  char buffer[PATH_MAX];
+
+  if ( length >= sizeof(buffer) || length <= base_length )
+    return;
+
+  index_remove(index, path);
+  strcpy(buffer, path);
+
+  for (char *p = buffer + base_length + 1; (p = strchr(p, '/')); p++) {
+    *p = '\0';
+    if ( !index_contains(index, buffer) && !lstat(buffer, &stat_buffer) && S_ISDIR(stat_buffer.st_mode) )
+      index_add(index, buffer, strrchr(buffer, '/') + 1);
+    *p = '/';
+  }
+
+  if ( !lstat(buffer, &stat_buffer) && S_ISDIR(stat_buffer.st_mode) ) {
+    index_add(index, buffer, strrchr(buffer, '/') + 1);
+    if ( !skipped(strrchr(buffer, '/') + 1) )
+      scan(index, buffer);
+  }
+}
+
+// Name of the saved index of a base directory
+static sds index_filename(struct sysfs_index *index){
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  sds dir, filename;
+
+  for (const char *p = index->base; *p; p++) {
+    hash ^= (unsigned char)*p;
+    hash *= 0x100000001b3ULL;
+  }
+
+  dir = cache_dir();
+  filename = sdscatprintf(sdsempty(), "%s/sysfs-index-%016llx", dir, (unsigned long long)hash);
+  sdsfree(dir);
+  return filename;
+}
+
+// The state, a saved index is valid in
+static sds index_state(unsigned long long seqnum, ino_t inode, struct timespec mtime){
+  char boot_id[64] = "";
+  int fd, length;
+  sds state;
+
+  if ( (fd = open(BOOT_ID, O_RDONLY | O_CLOEXEC)) >= 0 ) {
+    if ( (length = read(fd, boot_id, sizeof(boot_id) - 1)) > 0 )
+      boot_id[length] = '\0';
+    close(fd);
+  }
+  state = sdstrim(sdsnew(boot_id), "\n ");
+  return sdscatprintf(state, " %llu %lu %ld.%ld", seqnum, (unsigned long)inode, (long)mtime.tv_sec, mtime.tv_nsec);
+}
+
+/*
+  Load the index saved by a previous run. Each line is a path relative to the
+  base directory. Return FAILURE if there is no valid saved index.
+*/
+static int index_load(struct sysfs_index *index){
+  struct stat stat_buffer;
+  char buffer[PATH_MAX + 2];
+  sds filename, state, path;
+  size_t length;
+  FILE *file;
+  int valid = false;
+
+  if ( !probe_cache )
+    return FAILURE;
+
+  filename = index_filename(index);
+  file = fopen(filename, "r");
+  sdsfree(filename);
+
+  // Only trust files written by this user or root
+  if ( !file
+    || fstat(fileno(file), &stat_buffer)
+    || ( stat_buffer.st_uid != getuid() && stat_buffer.st_uid != 0 ) ) {
+    if ( file ) fclose(file);
+    return FAILURE;
+  }
+
+  index->seqnum = read_seqnum();
+  stamp_base(index);
+  if ( fgets(buffer, sizeof(buffer), file) ) {
+    state = index_state(index->seqnum, index->base_inode, index->base_mtime);
+    valid = !strncmp(buffer, state, sdslen(state)) && buffer[sdslen(state)] == '\n';
+    sdsfree(state);
+  }
+
+  g_hash_table_remove_all(index->names);
+  index->directories = 0;
+  path = sdsdup(index->base);
+  while ( valid && fgets(buffer, sizeof(buffer), file) ) {
+    length = strlen(buffer);
+    if ( length < 2 || buffer[0] != '/' || buffer[length - 1] != '\n' || strstr(buffer, "/..") ) {
+      valid = false;
+      break;
+    }
+    buffer[length - 1] = '\0';
+    sdsrange(path, 0, sdslen(index->base) - 1);
+    path = sdscat(path, buffer);
+    index_add(index, path, strrchr(path, '/') + 1);
+  }
+  sdsfree(path);
+  fclose(file);
+
+  if ( !valid ) {
+    g_hash_table_remove_all(index->names);
+    index->directories = 0;
+    index->built = false;
+    return FAILURE;
+  }
+  index->built = true;
+
+  if ( info )
+    printf("Loaded index of %d directories below %s\n", index->directories, index->base);
+  return SUCCESS;
+}
+
+// Save the index for the next run. The file is replaced atomically
+static int index_save(struct sysfs_index *index){
+  struct name_entry *entry;
+  GHashTableIter iter;
+  GList *iterator;
+  sds filename, temp_filename, content;
+  int fd, result = FAILURE;
+
+  if ( !probe_cache )
+    return FAILURE;
+
+  content = index_state(index->seqnum, index->base_inode, index->base_mtime);
+  content = sdscat(content, "\n");
+  g_hash_table_iter_init(&iter, index->names);
+  while ( g_hash_table_iter_next(&iter, NULL, (gpointer *)&entry) )
+    for (iterator = entry->paths; iterator; iterator = iterator->next) {
+      content = sdscat(content, (sds)iterator->data + sdslen(index->base));
+      content = sdscat(content, "\n");
+    }
+
+  filename = index_filename(index);
+  temp_filename = sdscatprintf(sdsdup(filename), ".%d", getpid());
+
+  if ( (fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0 ) {
+    if ( write(fd, content, sdslen(content)) == (ssize_t)sdslen(content) )
+      result = SUCCESS;
+    close(fd);
+    if ( result == SUCCESS && rename(temp_filename, filename) )
+      result = FAILURE;
+    if ( result != SUCCESS )
+      unlink(temp_filename);
+  } else
+    fprintf(stderr, "Unable to save sysfs index %s: %s\n", temp_filename, strerror(errno));
+
+  sdsfree(temp_filename);
+  sdsfree(filename);
+  sdsfree(content);
+  return result;
+}
+
+/*
+  Apply a kernel event to the indexes. Events must be applied in sequence;
+  an index that missed one, is rebuilt on the next lookup.
+*/
+static void apply_event(struct udev_device *device){
+  unsigned long long seqnum = udev_device_get_seqnum(device);
+  const char *action = udev_device_get_action(device);
+  const char *devpath = udev_device_get_devpath(device);
+  const char *old_devpath;
+  struct sysfs_index *index;
+  sds path, old_path;
+
+  if ( !action || !devpath )
+    return;
+
+  path = sysfs_path("/sys");
+  path = sdscat(path, devpath);
+
+  for (GList *iterator = indexes; iterator; iterator = iterator->next) {
+    index = (struct sysfs_index *)iterator->data;
+    if ( !index->built || seqnum <= index->seqnum )
+      continue;
+    if ( seqnum != index->seqnum + 1 ) {
+      index->built = false;
+      continue;
+    }
+    index->seqnum = seqnum;
+
+    if ( !strcmp(action, "move") && (old_devpath = udev_device_get_property_value(device, "DEVPATH_OLD")) ) {
+      old_path = sdscat(sysfs_path("/sys"), old_devpath);
+      if ( within(old_path, index->base, sdslen(index->base)) )
+        index_remove(index, old_path);
+      sdsfree(old_path);
+    }
+
+    if ( !within(path, index->base, sdslen(index->base)) )
+      continue;
+
+    if ( !strcmp(action, "remove") )
+      index_remove(index, path);
+    // Binding a driver can add or remove attribute groups
+    else if ( !strcmp(action, "add") || !strcmp(action, "move") || !strcmp(action, "bind") || !strcmp(action, "unbind") )
+      index_update(index, path);
+  }
+  sdsfree(path);
+}
+
+static void apply_events(void){
+  struct udev_device *device;
+
+  if ( !uevents )
+    return;
+  while ( (device = udev_monitor_receive_device(uevents)) ) {
+    apply_event(device);
+    udev_device_unref(device);
+  }
+}
+
+static struct sysfs_index *get_index(const char *basepath){
+  struct sysfs_index *index;
+
+  for (GList *iterator = indexes; iterator; iterator = iterator->next)
+    if ( !strcmp(((struct sysfs_index *)iterator->data)->base, basepath) )
+      return (struct sysfs_index *)iterator->data;
+
+  index = (struct sysfs_index *)malloc(sizeof(struct sysfs_index));
+  memset(index, 0, sizeof(struct sysfs_index));
+  index->base = sdsnew(basepath);
+  while ( sdslen(index->base) > 1 && index->base[sdslen(index->base) - 1] == '/' )
+    sdsrange(index->base, 0, -2);
+  index->names = g_hash_table_new_full(g_str_hash, g_str_equal, (GDestroyNotify)sdsfree, (GDestroyNotify)free_name_entry);
+  indexes = g_list_append(indexes, index);
+  return index;
+}
+
+/*
+  Find directories with this name, below basepath.
+  As with finddir, the search doesn't continue below a match, and the
+  paths are sorted.
+  Free the list with finddir_free and g_list_free.
+*/
+GList *sysfs_index_find(const char *basepath, const char *name){
+  struct sysfs_index *index;
+  struct name_entry *entry;
+  GList *list = NULL;
+  sds nested;
+
+  pthread_mutex_lock(&index_mutex);
+  apply_events();
+
+  index = get_index(basepath);
+  if ( !index_current(index) && index_load(index) ) {
+    index_build(index);
+    index_save(index);
+  }
+
+  if ( (entry = (struct name_entry *)g_hash_table_lookup(index->names, name)) ) {
+    nested = sdscatprintf(sdsempty(), "/%s/", name);
+    for (GList *iterator = entry->paths; iterator; iterator = iterator->next)
+      if ( !strstr((sds)iterator->data + sdslen(index->base), nested) )
+        list = g_list_prepend(list, sdsdup((sds)iterator->data));
+    sdsfree(nested);
+  }
+  pthread_mutex_unlock(&index_mutex);
+  return g_list_sort(list, (GCompareFunc)strcmp);
+}
+
+/*
+  Keep the indexes up to date from kernel events, rather than rebuilding them
+  when a device is added or removed. Call before the first lookup.
+*/
+int sysfs_index_watch(void){
+  int result = SUCCESS;
+
+  pthread_mutex_lock(&index_mutex);
+  if ( !uevents ) {
+    udev = udev_new();
+    if ( !udev || !(uevents = udev_monitor_new_from_netlink(udev, "kernel")) ) {
+      result = FAILURE;
+    } else {
+      udev_monitor_set_receive_buffer_size(uevents, UEVENT_BUFFER_SIZE);
+      if ( udev_monitor_enable_receiving(uevents) < 0 ) {
+        udev_monitor_unref(uevents);
+        uevents = NULL;
+        result = FAILURE;
+      }
+    }
+    if ( result != SUCCESS && udev ) {
+      udev_unref(udev);
+      udev = NULL;
+    }
+    if ( info )
+      puts(result == SUCCESS ? "Updating sysfs index from kernel events" : "Unable to watch kernel events. The sysfs index is rebuilt on changes");
+  }
+  pthread_mutex_unlock(&index_mutex);
+  return result;
+}
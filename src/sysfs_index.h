@@ -0,0 +1,11 @@
+#ifndef SYSFS_INDEX_H
+#define SYSFS_INDEX_H
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+GList *sysfs_index_find(const char *basepath, const char *name);
+int sysfs_index_watch(void);
+
+#endif
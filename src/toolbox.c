@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 /* Linux */
 #include <glib.h>
@@ -31,6 +32,7 @@
 // Application
 #include "sds.h"
 #include "toolbox.h"
+#include "walk.h"
 
 
 #define SUCCESS 0
@@ -98,15 +100,36 @@ char *strtounical(char * source) {
   return source;  
 }
 
+/*
+  The name of a user or group, or its number if it has none.
+  Reentrant, as permissions are checked from several threads at once.
+*/
+static sds user_name(uid_t uid){
+  struct passwd pw, *result = NULL;
+  char buffer[1024];
+
+  if ( getpwuid_r(uid, &pw, buffer, sizeof(buffer), &result) || !result )
+    return sdsfromlonglong(uid);
+  return sdsnew(pw.pw_name);
+}
+
+static sds group_name(gid_t gid){
+  struct group grp, *result = NULL;
+  char buffer[1024];
+
+  if ( getgrgid_r(gid, &grp, buffer, sizeof(buffer), &result) || !result )
+    return sdsfromlonglong(gid);
+  return sdsnew(grp.gr_name);
+}
+
 // Create a ls -l like file permission string for debug purposes 
 // Modified version of code by askovpen
 sds file_permissions_string(char * path){
-  struct group *grp;   
-  struct passwd *pw;
+  sds user, group;
   sds permission_str;
   struct stat stat_buffer;
   static const char *rwx[] = {"---", "--x", "-w-", "-wx","r--", "r-x", "rw-", "rwx"};
-  static char bits[11];
+  char bits[11];
 
   if (stat(path, &stat_buffer) )
     return sdsnew("File does not exists or is inaccessible") ;
@@ -144,9 +167,11 @@ sds file_permissions_string(char * path){
     bits[9] = (stat_buffer.st_mode & S_IXOTH) ? 't' : 'T';
   bits[10] = '\0';
 
-  pw = getpwuid(stat_buffer.st_uid);
-  grp = getgrgid(stat_buffer.st_gid); 
-  permission_str = sdscatprintf(sdsempty(),"%s %s:%s",bits,pw->pw_name,grp->gr_name);
+  user = user_name(stat_buffer.st_uid);
+  group = group_name(stat_buffer.st_gid);
+  permission_str = sdscatprintf(sdsempty(),"%s %s:%s",bits,user,group);
+  sdsfree(user);
+  sdsfree(group);
 
   return permission_str ;
 }
@@ -163,10 +188,9 @@ sds file_permissions_string(char * path){
   if the current user has permissions, return an empty string.
 */
 sds file_permission_needed(char * path, int access_type){
-  struct group *grp;   
-  struct passwd *pw;
   struct stat stat_buffer;
-  static char current_username[100];
+  char current_username[100] = "";
+  sds name, needed;
 
   access_type &= 7;
 
@@ -176,76 +200,81 @@ sds file_permission_needed(char * path, int access_type){
   if ( !access(path, access_type) ) 
     return sdsempty();
 
-  pw = getpwuid(stat_buffer.st_uid);
-  grp = getgrgid(stat_buffer.st_gid);
   getlogin_r(current_username, sizeof(current_username));
 
   // Test group
-  if ( (stat_buffer.st_mode >> 3) & access_type ) 
-    return sdscatprintf(
+  if ( (stat_buffer.st_mode >> 3) & access_type ) {
+    name = group_name(stat_buffer.st_gid);
+    needed = sdscatprintf(
       sdsempty(),
       "must be a member for group '%s' (usermod -aG %s %s)",
-      grp->gr_name,
-      grp->gr_name,
+      name,
+      name,
       current_username
     );
+    sdsfree(name);
+    return needed;
+  }
   
   // Test user
-  if ( (stat_buffer.st_mode >> 6) & access_type ) 
-    return sdscatprintf(
-      sdsempty(),
-      "login as '%s' ",
-      pw->pw_name
-    );
+  if ( (stat_buffer.st_mode >> 6) & access_type ) {
+    name = user_name(stat_buffer.st_uid);
+    needed = sdscatprintf(sdsempty(), "login as '%s' ", name);
+    sdsfree(name);
+    return needed;
+  }
 
   return sdsnew("not accessible");
 }
 
+struct finddir_search {
+  const char *name;
+  int limit;
+  int found;
+  GList *list;
+  pthread_mutex_t mutex;
+};
+
+// Collect matching directories. The search doesn't continue below a match
+static int finddir_visit(struct walk_entry *entry, void *context){
+  struct finddir_search *search = (struct finddir_search *)context;
+  int stop;
+
+  if ( strcmp(entry->name, search->name) )
+    return WALK_DESCEND;
+
+  pthread_mutex_lock(&search->mutex);
+  search->list = g_list_append(search->list, sdsnewlen(entry->path, entry->length));
+  stop = search->limit && ++search->found >= search->limit;
+  pthread_mutex_unlock(&search->mutex);
+  return stop ? WALK_STOP : WALK_PRUNE;
+}
+
 /* Find a directory, by searching basepath tree
 
-  Return a list of matching paths
+  Return a list of matching paths, sorted. The search stops when limit
+  paths are found, unless limit is 0.
 
   use finddir_free to free list
 */
-int _finddir(char *basepath, char *searchdir, GList **list) {
-  struct dirent *dp;
-  DIR *dir;
-  sds path;
-  
-  dir = opendir(basepath);
-  if (!dir){
-    perror("finddir failed");
-    return FAILURE;
-  }
-
-  while ((dp = readdir(dir)) != NULL) {
-    if ( !strcmp(dp->d_name, ".") != 0 || !strcmp(dp->d_name, "..") ) 
-      continue;
+GList * finddir_limit(char *basepath, char *searchdir, int limit) {
+  struct finddir_search search;
 
-    if ( dp->d_type != DT_DIR )  
-      continue;
+  memset(&search, 0, sizeof(search));
+  search.name = searchdir;
+  search.limit = limit;
+  pthread_mutex_init(&search.mutex, NULL);
 
-    path = sdscatprintf(sdsempty(),"%s/%s",basepath,dp->d_name );
-
-    if ( !strcmp(  dp->d_name , searchdir ) ) {
-      *list = g_list_append(*list, path);
-
-    } else {
-      _finddir( path, searchdir, list);
-      sdsfree(path);
-    }
-  }
-
-  closedir(dir);
+  if( walk_tree(basepath, 0, WALK_DIRECTORIES, finddir_visit, &search) != SUCCESS )
+    perror("finddir failed");
+  pthread_mutex_destroy(&search.mutex);
 
-  return SUCCESS;
+  // The tree is walked by several threads, so matches are found in any order
+  return g_list_sort(search.list, (GCompareFunc)strcmp);
 }
 
 GList * finddir(char *basepath, char *searchdir) {
-  GList * list = NULL;
-  if( _finddir(basepath, searchdir, &list) != SUCCESS )
-    return NULL;
-  return list;  
+  return finddir_limit(basepath, searchdir, 0);
 }
 
 void finddir_free(GList *list){
@@ -18,6 +18,7 @@ char *int2bin(int value ,int len, char *buffer, int buf_size);
 sds file_permission_needed(char * path, int access_type);
 sds file_permissions_string(char * path);
 GList *finddir(char *basepath, char *searchdir);
+GList *finddir_limit(char *basepath, char *searchdir, int limit);
 void finddir_free(GList *list);
 int file_put( char *file_name, void *data, int length );
 void * file_get(char * file_name, int *length);
@@ -0,0 +1,294 @@
+/*
+  Simulated relay controllers
+
+  A number of virtual USB HID relay boards, that answer the 16 byte reports
+  of the Nuvoton and Sainsmart 16 channel controllers. They are found like
+  any other device, so monitoring, wildcard dispatch and batches can be
+  benchmarked and stress tested with hundreds of boards, without hardware.
+
+  The boards are configured with the DEVIA_VIRTUAL environment variable, a
+  comma separated list of:
+    nuvoton=<n>       Number of Nuvoton boards
+    sainsmart16=<n>   Number of Sainsmart 16 channel boards
+    latency=<us>      Time from a read request, until the reply is ready
+    errors=<percent>  Chance that a write fails, or a reply is lost
+
+  The relay state lives in the process. It persists for as long as devia
+  runs, ex. in daemon or monitor mode.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <time.h>
+
+/* Unix */
+#include <unistd.h>
+#include <pthread.h>
+
+/* Linux */
+#include <glib.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+#include "stats.h"
+
+#include "virtual.h"
+
+#define REPORT_SIZE 16
+#define VIRTUAL_PORT "virtual-%d"
+
+enum board_type { NUVOTON, SAINSMART16 };
+
+struct board {
+  enum board_type type;
+  uint16_t state;         // Relay n is bit n-1
+  pthread_mutex_t mutex;
+};
+
+// An open board
+struct virtual_handle {
+  struct board *board;
+  unsigned int seed;
+  int pending;                    // A reply is waiting to be read
+  uint64_t ready;                 // When the reply can be read, in µs
+  unsigned char reply[REPORT_SIZE];
+};
+
+static struct board *board = NULL;
+static int boards = 0;
+static int latency_us = 0;
+static int error_percent = 0;
+static pthread_once_t configured = PTHREAD_ONCE_INIT;
+
+// Bit position of each Sainsmart relay, in the bitmap it replies with
+static const uint8_t relay_bit_pos[] = {7 , 8 , 6 , 9 , 5 , 10, 4 , 11, 3 , 12, 2 , 13, 1 , 14, 0 , 15};
+
+// Create the boards from the environment
+static void configure(void){
+  const char *config = getenv(VIRTUAL_ENV);
+  int nuvoton = 0, sainsmart16 = 0;
+  sds *option;
+  int count;
+
+  if ( !config )
+    return;
+
+  option = sdssplitlen(config, strlen(config), ",", 1, &count);
+  for (int i = 0; i < count; i++) {
+    sdstrim(option[i], " ");
+    if ( sscanf(option[i], "nuvoton=%d", &nuvoton) == 1 
+      || sscanf(option[i], "sainsmart16=%d", &sainsmart16) == 1
+      || sscanf(option[i], "latency=%d", &latency_us) == 1
+      || sscanf(option[i], "errors=%d", &error_percent) == 1 ) 
+      continue;
+    fprintf(stderr, "Unknown %s option: %s\n", VIRTUAL_ENV, option[i]);
+  }
+  sdsfreesplitres(option, count);
+
+  if ( nuvoton < 0 ) nuvoton = 0;
+  if ( sainsmart16 < 0 ) sainsmart16 = 0;
+  boards = nuvoton + sainsmart16;
+  board = (struct board *) calloc(boards ? boards : 1, sizeof(struct board));
+  for (int i = 0; i < boards; i++) {
+    board[i].type = i < nuvoton ? NUVOTON : SAINSMART16;
+    pthread_mutex_init(&board[i].mutex, NULL);
+  }
+}
+
+// Create a device list entry for a board
+static struct _device_list * new_virtual_entry(int si_index, int index){
+  const struct _supported_device *device = &supported_interface[si_index].device[board[index].type];
+  struct _device_list *entry;
+
+  entry = (struct _device_list *) malloc(sizeof(struct _device_list)); 
+  memset(entry, 0, sizeof(struct _device_list));
+
+  entry->name = sdsnew(device->name);
+  entry->port = sdscatprintf(sdsempty(), VIRTUAL_PORT, index + 1);
+  entry->id = sdscatprintf(sdsempty(), "%s#0416:5020::%s#%s",
+    supported_interface[si_index].name,
+    board[index].type == NUVOTON ? "Nuvoton" : "Sainsmart",
+    entry->port
+  );
+  entry->path = sdsempty();
+  entry->group = sdsempty();
+  entry->action = device->action;
+  entry->batch = device->batch;
+  entry->si_index = si_index;
+  return entry;
+}
+
+/*
+  Find the boards that match the identifier.
+*/
+int probe_virtual(int si_index, struct _device_identifier id, GList **device_list){
+  struct _device_list *entry;
+
+  assert(supported_interface[si_index].name);
+  pthread_once(&configured, configure);
+
+  for (int i = 0; i < boards; i++) {
+    entry = new_virtual_entry(si_index, i);
+    if ( !match_identifier(entry, &id) ) {
+      free_device_entry(entry);
+      continue;
+    }
+    if ( info ) 
+      printf(" found %s %s\n", entry->name, entry->port);
+    *device_list = g_list_append(*device_list, entry);
+  }
+  return SUCCESS;
+}
+
+/*
+  Open the board named by the port of the identifier.
+*/
+int direct_virtual(int si_index, struct _device_identifier id, GList **device_list){
+  struct _device_list *entry;
+  int index;
+  char tail;
+
+  pthread_once(&configured, configure);
+
+  if ( !id.port || sscanf(id.port, VIRTUAL_PORT "%c", &index, &tail) != 1 
+    || index < 1 || index > boards )
+    return FAILURE;
+
+  entry = new_virtual_entry(si_index, index - 1);
+  if ( !match_identifier(entry, &id) ) {
+    free_device_entry(entry);
+    return FAILURE;
+  }
+  *device_list = g_list_append(*device_list, entry);
+  return SUCCESS;
+}
+
+// Randomly decide if a transfer fails
+static int inject_error(struct virtual_handle *handle){
+  return error_percent > 0 && (int)( rand_r(&handle->seed) % 100 ) < error_percent;
+}
+
+// Checksum of a report: the sum of all bytes, but the checksum
+static uint16_t checksum(const unsigned char *report){
+  uint16_t sum = 0;
+
+  for (int i = 0; i < REPORT_SIZE - 2; i++)
+    sum += report[i];
+  return sum;
+}
+
+// Make the reply to a read request, with the relay state as the board type reports it
+static void read_reply(struct virtual_handle *handle, uint16_t state){
+  uint16_t bitmap = 0, sum;
+
+  memset(handle->reply, 0, REPORT_SIZE);
+  handle->reply[0] = 0xD2;
+  handle->reply[1] = REPORT_SIZE - 2;
+  if ( handle->board->type == NUVOTON ) {
+    // Big endian
+    handle->reply[2] = state >> 8;
+    handle->reply[3] = state & 0xFF;
+  } else {
+    // Little endian, relays scrambled
+    for (int i = 0; i < 16; i++)
+      if ( state & ( 1 << i ) )
+        bitmap |= 1 << relay_bit_pos[i];
+    handle->reply[2] = bitmap & 0xFF;
+    handle->reply[3] = bitmap >> 8;
+  }
+  memcpy(handle->reply + 10, "HIDC", 4);
+  sum = checksum(handle->reply);
+  handle->reply[14] = sum & 0xFF;
+  handle->reply[15] = sum >> 8;
+  handle->pending = true;
+  handle->ready = stats_time_us() + latency_us;
+}
+
+static void * virtual_open(struct _device_list *device){
+  const char *port = device->port;
+  struct virtual_handle *handle;
+  int index;
+  char tail;
+
+  pthread_once(&configured, configure);
+
+  if ( !port || sscanf(port, VIRTUAL_PORT "%c", &index, &tail) != 1 || index < 1 || index > boards )
+    return NULL;
+
+  handle = (struct virtual_handle *) calloc(1, sizeof(struct virtual_handle));
+  handle->board = &board[index - 1];
+  handle->seed = (unsigned int)stats_time_us() ^ index;
+  return handle;
+}
+
+static int virtual_write(void *h, const unsigned char *data, size_t length){
+  struct virtual_handle *handle = (struct virtual_handle *)h;
+  uint16_t sum;
+
+  if ( inject_error(handle) )
+    return -1;
+
+  if ( length != REPORT_SIZE || memcmp(data + 10, "HIDC", 4) )
+    return -1;
+
+  sum = checksum(data);
+  if ( data[14] != ( sum & 0xFF ) || data[15] != ( sum >> 8 ) )
+    return -1;
+
+  pthread_mutex_lock(&handle->board->mutex);
+  switch ( data[0] ) {
+    case 0xD2: 
+      read_reply(handle, handle->board->state);
+      break;
+
+    case 0xC3: // Both boards take the state little endian, in relay order
+      handle->board->state = data[2] | ( data[3] << 8 );
+      break;
+
+    default:
+      length = -1;
+  }
+  pthread_mutex_unlock(&handle->board->mutex);
+  return length;
+}
+
+static int virtual_read_timeout(void *h, unsigned char *data, size_t length, int milliseconds){
+  struct virtual_handle *handle = (struct virtual_handle *)h;
+  uint64_t now = stats_time_us(), timeout;
+
+  if ( !handle->pending )
+    return 0;
+
+  // Wait for the reply, as long as the caller will
+  timeout = milliseconds < 0 ? handle->ready : now + milliseconds * 1000ULL;
+  if ( handle->ready > now )
+    usleep( ( handle->ready < timeout ? handle->ready : timeout ) - now );
+  if ( handle->ready > timeout )
+    return 0;
+
+  handle->pending = false;
+  if ( inject_error(handle) )
+    return 0;
+
+  if ( length > REPORT_SIZE )
+    length = REPORT_SIZE;
+  memcpy(data, handle->reply, length);
+  return length;
+}
+
+static void virtual_close(void *handle){
+  free(handle);
+}
+
+const struct _hid_transport virtual_transport = {
+  "virtual",
+  virtual_open,
+  virtual_write,
+  virtual_read_timeout,
+  virtual_close
+};
@@ -0,0 +1,17 @@
+#ifndef VIRTUAL_H
+#define VIRTUAL_H
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+#include "hid_transport.h"
+
+// Environment variable, that configures the simulated relay boards. Ex: "nuvoton=100,sainsmart16=20,latency=500,errors=1"
+#define VIRTUAL_ENV "DEVIA_VIRTUAL"
+
+extern const struct _hid_transport virtual_transport;
+
+int probe_virtual(int si_index, struct _device_identifier id, GList **device_list);
+int direct_virtual(int si_index, struct _device_identifier id, GList **device_list);
+
+#endif
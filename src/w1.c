@@ -34,19 +34,45 @@
 /* Linux */
 #include <glib.h>
 #include <libgen.h>
+#include <libudev.h>
 
 /* Application */
 #include "toolbox.h"
 #include "common.h"
+#include "stats.h"
 
 #include "w1.h"
 
-#define W1_SYS_DIR (char *)"/sys/devices/w1_bus_master1"
+#define W1_SYS_DIR "/sys/devices/w1_bus_master1"
+
+// Directory of the one-wire bus master, within the sysfs root
+static const char * w1_sys_dir(void){
+  static sds dir = NULL;
+
+  if ( !dir )
+    dir = sysfs_path(W1_SYS_DIR);
+  return dir;
+}
+
+// Create a device list entry for a one-wire device
+static struct _device_list * new_w1_entry(const char *name){
+  struct _device_list *entry;
+
+  entry = (struct _device_list *) malloc(sizeof(struct _device_list)); 
+  memset(entry, 0, sizeof(struct _device_list));
+
+  entry->name = sdsnew((char *)"One-wire device");
+  entry->id = sdscatprintf( sdsempty(), "w1#%s", name );
+  entry->path = sdscatprintf( sdsempty(), "%s/%s",w1_sys_dir(), name );
+  entry->group = file_permissions_string( entry->path );
+  entry->action = action_w1;
+  return entry;
+}
+
 /* 
   probe for !-wire devices 
 */  
 int probe_w1(int si_index, struct _device_identifier id, GList **device_list){
-  struct _device_list *entry;
   sds path = NULL;
   GList * path_list = NULL, *iterator = NULL;;
   struct dirent *dp;
@@ -55,7 +81,7 @@ int probe_w1(int si_index, struct _device_identifier id, GList **device_list){
   assert(supported_interface[si_index].name);
 
   // Check that /sys/class exists
-  if ( access(W1_SYS_DIR, F_OK) ) {
+  if ( access(w1_sys_dir(), F_OK) ) {
     if ( info ) printf("No one-wire SysFs entry\n");
     return FAILURE;
   }
@@ -68,7 +94,7 @@ int probe_w1(int si_index, struct _device_identifier id, GList **device_list){
 
     // List attributes
     if( info ) {
-      path = sdscatprintf(sdsempty(),"%s/%s",W1_SYS_DIR, id.device_id);
+      path = sdscatprintf(sdsempty(),"%s/%s",w1_sys_dir(), id.device_id);
       dir = opendir(path);
       if (dir) {
         printf("%s attributes:\n",id.device_id);  
@@ -92,7 +118,7 @@ int probe_w1(int si_index, struct _device_identifier id, GList **device_list){
 
   // find dir  
   } else {
-    dir = opendir(W1_SYS_DIR);
+    dir = opendir(w1_sys_dir());
     if (!dir){
       if ( info ) printf("No path to one-wire  SysFs kernel driver");
       return FAILURE;
@@ -115,17 +141,77 @@ int probe_w1(int si_index, struct _device_identifier id, GList **device_list){
     closedir(dir);
   }
 
-  for ( iterator = path_list; iterator; iterator = iterator->next) {
-    // Create a new entry in active device list
-    entry = (struct _device_list *) malloc(sizeof(struct _device_list)); 
-    memset(entry, 0, sizeof(struct _device_list));
-    *device_list = g_list_append(*device_list, entry); 
-
-    entry->name = sdsnew((char *)"One-wire device");
-    entry->id = sdscatprintf( sdsempty(), "w1#%s", (char *)iterator->data );
-    entry->path = sdscatprintf( sdsempty(), "%s/%s",W1_SYS_DIR, (char *)iterator->data );
-    entry->group = file_permissions_string( entry->path );
-    entry->action = action_w1;
+  for ( iterator = path_list; iterator; iterator = iterator->next) 
+    *device_list = g_list_append(*device_list, new_w1_entry((char *)iterator->data)); 
+  return SUCCESS;
+}
+
+/*
+  Open a named one-wire device directly, without reading the bus.
+  The device id is the device name, or the absolute path to it.
+*/
+int direct_w1(int si_index, struct _device_identifier id, GList **device_list){
+  struct stat stat_buffer;
+  const char *name;
+  sds path;
+  int result;
+
+  if ( !id.device_id || !sdslen(id.device_id) )
+    return FAILURE;
+
+  if ( !strncmp(id.device_id, w1_sys_dir(), strlen(w1_sys_dir())) && id.device_id[strlen(w1_sys_dir())] == '/' )
+    name = id.device_id + strlen(w1_sys_dir()) + 1;
+  else
+    name = id.device_id;
+
+  // Only numeric names are devices
+  if ( name[0] > '9' || name[0] < '0' || strchr(name, '/') )
+    return FAILURE;
+
+  path = sdscatprintf(sdsempty(), "%s/%s", w1_sys_dir(), name);
+  result = stat(path, &stat_buffer);
+  sdsfree(path);
+  if ( result || !S_ISDIR(stat_buffer.st_mode) )
+    return FAILURE;
+
+  *device_list = g_list_append(*device_list, new_w1_entry(name));
+  return SUCCESS;
+}
+
+/*
+  Handle hotplug of a single one-wire slave device.
+  Slave devices are named <family>-<serial number>. Bus masters are ignored.
+*/
+int hotplug_w1(int si_index, struct udev_device *device, GList **device_list, GList **added, GList **removed){
+  const char *action = udev_device_get_action(device);
+  const char *subsystem = udev_device_get_subsystem(device);
+  const char *sysname = udev_device_get_sysname(device);
+  struct _device_list *entry;
+  GList *iterator;
+  sds id;
+
+  if ( !action || !subsystem || !sysname || strcmp(subsystem, "w1") )
+    return SUCCESS;
+
+  // Only numeric names are devices
+  if ( sysname[0] > '9' || sysname[0] < '0' )
+    return SUCCESS;
+
+  id = sdscatprintf(sdsempty(), "w1#%s", sysname);
+  for (iterator = *device_list; iterator; iterator = iterator->next) {
+    entry = (struct _device_list *)iterator->data;
+    if ( entry->si_index == si_index && !strcmp(entry->id, id) )
+      break;
+  }
+  sdsfree(id);
+
+  if ( !strcmp(action, "remove") && iterator ) {
+    *device_list = g_list_remove_link(*device_list, iterator);
+    *removed = g_list_concat(*removed, iterator);
+
+  } else if ( !strcmp(action, "add") && !iterator ) {
+    if ( info ) printf(" hotplugged %s\n", sysname);
+    *added = g_list_append(*added, new_w1_entry(sysname));
   }
   return SUCCESS;
 }
@@ -136,6 +222,7 @@ int action_w1(struct _device_list *device, sds attribute, sds action, sds *reply
   int fd;
   int length;
   char input[1025];
+  uint64_t start;
 
   if ( info )
     printf("w1 on: %s  Action: %s id: %s\n",attribute, action, device->id);
@@ -165,15 +252,19 @@ int action_w1(struct _device_list *device, sds attribute, sds action, sds *reply
     sdsfree(permission_needed);
     
     // open device attribute
+    start = stats_start();
     if( (fd = open(file_path, action ? O_WRONLY : O_RDONLY)) < 0) {
       perror("Failed to open sysfs file");
       *reply = sdsnew("Off-line");
       return FAILURE;
     }
+    stats_stop("w1 open", NULL, start);
 
     // Write to device attribute
     if ( action ) {
+      start = stats_start();
       length = write( fd , action, sdslen(action) );
+      stats_stop("w1 write", NULL, start);
       if ( length < 0 ) {
         perror( "unable to write to attribute" );
         *reply = sdsnew("**output error**");
@@ -185,6 +276,7 @@ int action_w1(struct _device_list *device, sds attribute, sds action, sds *reply
 
     // read from device attribute
     } else { 
+      start = stats_start();
       *reply = sdscatprintf(sdsempty(),"%s ", attribute);
     	do {
         length = read(fd,input, sizeof(input)-1 );
@@ -195,6 +287,7 @@ int action_w1(struct _device_list *device, sds attribute, sds action, sds *reply
           *reply = sdscat(*reply,data);
         }
       }while (length == sizeof(input)-1 );
+      stats_stop("w1 read", NULL, start);
 
       if ( length < 0 ) {
     		perror("Failed to read attribute");
@@ -204,7 +297,9 @@ int action_w1(struct _device_list *device, sds attribute, sds action, sds *reply
       }  
     } 
 
+    start = stats_start();
    	close(fd);
+    stats_stop("w1 close", NULL, start);
     sdsfree(file_path);
   
   // List attributes
@@ -6,6 +6,8 @@
 #include "common.h"
 
 int probe_w1(int si_index, struct _device_identifier id, GList **device_list);
+int direct_w1(int si_index, struct _device_identifier id, GList **device_list);
+int hotplug_w1(int si_index, struct udev_device *device, GList **device_list, GList **added, GList **removed);
 int recognize_w1(int si_index,  void * dev_info );
 int action_w1(struct _device_list *device, sds attribute, sds action, sds *reply);
 
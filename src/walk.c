@@ -0,0 +1,310 @@
+/*
+
+  Directory tree walk
+
+  Walk a directory tree, and call a visit function for each entry. Used to
+  search sysfs, where a full scan can't be avoided.
+
+  Directories are opened relative to their parent (openat), and read with
+  fdopendir, so no path is resolved from the root for each directory. Symbolic
+  links are never followed. Each walker extends and restores a single path
+  buffer, rather than allocating a path per entry.
+
+  A large tree is split across a small pool of threads. The calling thread
+  starts walking alone. If the tree turns out to be large, helper threads are
+  started. A walker that runs out of work waits, and a busy walker hands the
+  next subdirectory it finds to the waiting walker, rather than walking it
+  itself. Queued subtrees are taken by their owner from the newest end, and
+  stolen by others from the oldest, that is usually the largest.
+
+  The walk stops as soon as a visit function returns WALK_STOP, ex. when the
+  expected number of matches are found.
+*/
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <limits.h>
+
+/* Unix */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+#include "walk.h"
+
+#define WALK_MAX_THREADS 4
+#define WALK_SPAWN_AFTER 64     // Directories walked alone, before helper threads are started
+
+// A subtree, queued to be walked
+struct task {
+  size_t length;
+  int depth;
+  char path[PATH_MAX];
+};
+
+struct worker {
+  struct walk *walk;
+  int id;
+  pthread_t thread;
+  int head;                     // Deque of queued subtrees (walk->mutex)
+  int count;
+  struct task task[WALK_MAX_THREADS];
+  char path[PATH_MAX];
+};
+
+struct walk {
+  int root_fd;
+  size_t base_length;
+  int flags;
+  walk_visit visit;
+  void *context;
+  int threads;                  // Walkers, including the calling thread
+  int running;                  // Walkers started
+  int directories;              // Directories walked by the calling thread alone
+  int stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int idle;                     // Walkers waiting for a subtree
+  int pending;                  // Queued subtrees
+  int done;
+  struct worker *worker;
+};
+
+static void start_helpers(struct walk *walk);
+
+/*
+  Queue a subtree, if another walker is waiting for work.
+  Return false if the caller must walk it.
+*/
+static int offer(struct worker *worker, size_t length, int depth){
+  struct walk *walk = worker->walk;
+  struct task *task;
+  int queued = false;
+
+  if ( !__atomic_load_n(&walk->idle, __ATOMIC_RELAXED) )
+    return false;
+
+  pthread_mutex_lock(&walk->mutex);
+  if ( walk->idle > walk->pending && worker->count < WALK_MAX_THREADS ) {
+    task = &worker->task[( worker->head + worker->count++ ) % WALK_MAX_THREADS];
+    memcpy(task->path, worker->path, length + 1);
+    task->length = length;
+    task->depth = depth;
+    walk->pending++;
+    pthread_cond_signal(&walk->cond);
+    queued = true;
+  }
+  pthread_mutex_unlock(&walk->mutex);
+  return queued;
+}
+
+// Take a queued subtree: The newest of our own, or the oldest of another walker (walk->mutex)
+static int take(struct worker *worker, size_t *length, int *depth){
+  struct walk *walk = worker->walk;
+  struct worker *victim = NULL;
+  struct task *task;
+
+  if ( worker->count ) {
+    task = &worker->task[( worker->head + --worker->count ) % WALK_MAX_THREADS];
+  } else {
+    for (int i = 1; i < walk->threads && !victim; i++)
+      if ( walk->worker[( worker->id + i ) % walk->threads].count )
+        victim = &walk->worker[( worker->id + i ) % walk->threads];
+    if ( !victim )
+      return false;
+    task = &victim->task[victim->head];
+    victim->head = ( victim->head + 1 ) % WALK_MAX_THREADS;
+    victim->count--;
+  }
+  walk->pending--;
+  memcpy(worker->path, task->path, task->length + 1);
+  *length = task->length;
+  *depth = task->depth;
+  return true;
+}
+
+/*
+  Visit the entries of an open directory, and walk its subdirectories.
+  worker->path holds the path of the directory, <length> long. The
+  directory is closed.
+*/
+static void walk_dir(struct worker *worker, int fd, size_t length, int depth){
+  struct walk *walk = worker->walk;
+  struct walk_entry entry;
+  struct stat stat_buffer;
+  struct dirent *dp;
+  size_t name_length;
+  int action, child;
+  DIR *dir;
+
+  if ( !(dir = fdopendir(fd)) ) {
+    close(fd);
+    return;
+  }
+
+  if ( worker->id == 0 && walk->running < walk->threads && ++walk->directories == WALK_SPAWN_AFTER )
+    start_helpers(walk);
+
+  entry.dir_fd = dirfd(dir);
+  entry.path = worker->path;
+  entry.depth = depth + 1;
+
+  while ( !__atomic_load_n(&walk->stop, __ATOMIC_RELAXED) && (dp = readdir(dir)) ) {
+    if ( !strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..") )
+      continue;
+
+    name_length = strlen(dp->d_name);
+    if ( length + 1 + name_length >= PATH_MAX )
+      continue;
+
+    entry.type = dp->d_type;
+    if ( entry.type == DT_UNKNOWN && !fstatat(entry.dir_fd, dp->d_name, &stat_buffer, AT_SYMLINK_NOFOLLOW) )
+      entry.type = S_ISDIR(stat_buffer.st_mode) ? DT_DIR : S_ISLNK(stat_buffer.st_mode) ? DT_LNK : DT_REG;
+    if ( ( walk->flags & WALK_DIRECTORIES ) && entry.type != DT_DIR )
+      continue;
+
+    worker->path[length] = '/';
+    memcpy(worker->path + length + 1, dp->d_name, name_length + 1);
+    entry.length = length + 1 + name_length;
+    entry.name = worker->path + length + 1;
+
+    action = walk->visit(&entry, walk->context);
+    if ( action == WALK_STOP ) {
+      __atomic_store_n(&walk->stop, true, __ATOMIC_RELAXED);
+      break;
+    }
+    if ( entry.type != DT_DIR || action == WALK_PRUNE )
+      continue;
+
+    if ( !offer(worker, entry.length, depth + 1) ) {
+      child = openat(entry.dir_fd, dp->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if ( child >= 0 )
+        walk_dir(worker, child, entry.length, depth + 1);
+    }
+  }
+  worker->path[length] = '\0';
+  closedir(dir);
+}
+
+// Walk queued subtrees, until every walker is out of work
+static void work(struct worker *worker){
+  struct walk *walk = worker->walk;
+  size_t length;
+  int depth, fd;
+
+  for (;;) {
+    pthread_mutex_lock(&walk->mutex);
+    while ( !walk->done && !take(worker, &length, &depth) ) {
+      if ( __atomic_load_n(&walk->stop, __ATOMIC_RELAXED) || walk->idle + 1 == walk->running ) {
+        walk->done = true;
+        pthread_cond_broadcast(&walk->cond);
+        break;
+      }
+      // Busy walkers check for idle walkers, without the lock
+      __atomic_add_fetch(&walk->idle, 1, __ATOMIC_RELAXED);
+      pthread_cond_wait(&walk->cond, &walk->mutex);
+      __atomic_sub_fetch(&walk->idle, 1, __ATOMIC_RELAXED);
+    }
+    if ( walk->done ) {
+      pthread_mutex_unlock(&walk->mutex);
+      return;
+    }
+    pthread_mutex_unlock(&walk->mutex);
+
+    fd = openat(walk->root_fd, worker->path + walk->base_length + 1, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if ( fd >= 0 )
+      walk_dir(worker, fd, length, depth);
+  }
+}
+
+static void *helper(void *arg){
+  work((struct worker *)arg);
+  return NULL;
+}
+
+static void start_helpers(struct walk *walk){
+  pthread_mutex_lock(&walk->mutex);
+  for (int i = 1; i < walk->threads; i++) {
+    walk->running++;
+    if ( pthread_create(&walk->worker[i].thread, NULL, helper, &walk->worker[i]) ) {
+      walk->running--;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&walk->mutex);
+}
+
+/*
+  Walk the tree below base, and call visit for each entry.
+  threads is the largest number of threads to use, or 0 for the default.
+  Return FAILURE if base can't be opened.
+*/
+int walk_tree(const char *base, int threads, int flags, walk_visit visit, void *context){
+  struct walk *walk;
+  size_t base_length = strlen(base);
+  long cpus;
+  int fd;
+
+  while ( base_length > 0 && base[base_length - 1] == '/' )
+    base_length--;
+  if ( base_length >= PATH_MAX )
+    return FAILURE;
+
+  if ( threads <= 0 ) {
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus < 1 ? 1 : cpus > WALK_MAX_THREADS ? WALK_MAX_THREADS : cpus;
+  }
+  if ( threads > WALK_MAX_THREADS )
+    threads = WALK_MAX_THREADS;
+
+  if ( (fd = open(base, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 )
+    return FAILURE;
+
+  walk = (struct walk *)malloc(sizeof(struct walk));
+  memset(walk, 0, sizeof(struct walk));
+  walk->root_fd = fd;
+  walk->base_length = base_length;
+  walk->flags = flags;
+  walk->visit = visit;
+  walk->context = context;
+  walk->threads = threads;
+  walk->running = 1;
+  pthread_mutex_init(&walk->mutex, NULL);
+  pthread_cond_init(&walk->cond, NULL);
+
+  walk->worker = (struct worker *)malloc(sizeof(struct worker) * threads);
+  for (int i = 0; i < threads; i++) {
+    walk->worker[i].walk = walk;
+    walk->worker[i].id = i;
+    walk->worker[i].head = 0;
+    walk->worker[i].count = 0;
+  }
+  memcpy(walk->worker[0].path, base, base_length);
+  walk->worker[0].path[base_length] = '\0';
+
+  if ( (fd = dup(walk->root_fd)) >= 0 )
+    walk_dir(&walk->worker[0], fd, base_length, 0);
+
+  // Help the helpers, until the tree is done
+  if ( walk->running > 1 ) {
+    work(&walk->worker[0]);
+    for (int i = 1; i < walk->running; i++)
+      pthread_join(walk->worker[i].thread, NULL);
+  }
+
+  close(walk->root_fd);
+  pthread_mutex_destroy(&walk->mutex);
+  pthread_cond_destroy(&walk->cond);
+  free(walk->worker);
+  free(walk);
+  return SUCCESS;
+}
@@ -0,0 +1,34 @@
+#ifndef WALK_H
+#define WALK_H
+
+/* Application */
+#include "toolbox.h"
+#include "common.h"
+
+// Return values of a visit function
+#define WALK_DESCEND 0          // Continue, and walk the directory, if it is one
+#define WALK_PRUNE   1          // Continue, but don't walk the directory
+#define WALK_STOP    2          // Stop the walk
+
+// Flags
+#define WALK_DIRECTORIES 1      // Only visit directories
+
+// An entry in a directory, as seen by a visit function
+struct walk_entry {
+  int dir_fd;                   // The directory that holds the entry. Use with *at() functions
+  const char *path;             // Full path of the entry
+  size_t length;                // Length of the path
+  const char *name;             // Name of the entry (the end of path)
+  unsigned char type;           // DT_DIR, DT_LNK, DT_REG etc.
+  int depth;                    // 1 for entries in the base directory
+};
+
+/*
+  Called for each entry. With more than one thread, it is called concurrently,
+  and must synchronize access to the context.
+*/
+typedef int (*walk_visit)(struct walk_entry *entry, void *context);
+
+int walk_tree(const char *base, int threads, int flags, walk_visit visit, void *context);
+
+#endif